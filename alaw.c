@@ -0,0 +1,132 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "alaw.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define ALAW_SSSE3
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define ALAW_NEON
+#endif
+
+static const int16_t alaw_table[256] = {
+        -5504, -5248, -6016, -5760, -4480, -4224, -4992, -4736, -7552, -7296, -8064, -7808,
+        -6528, -6272, -7040, -6784, -2752, -2624, -3008, -2880, -2240, -2112, -2496, -2368,
+        -3776, -3648, -4032, -3904, -3264, -3136, -3520, -3392, -22016, -20992, -24064, -23040,
+        -17920, -16896, -19968, -18944, -30208, -29184, -32256, -31232, -26112, -25088, -28160, -27136,
+        -11008, -10496, -12032, -11520, -8960, -8448, -9984, -9472, -15104, -14592, -16128, -15616,
+        -13056, -12544, -14080, -13568, -344, -328, -376, -360, -280, -264, -312, -296,
+        -472, -456, -504, -488, -408, -392, -440, -424, -88, -72, -120, -104,
+        -24, -8, -56, -40, -216, -200, -248, -232, -152, -136, -184, -168,
+        -1376, -1312, -1504, -1440, -1120, -1056, -1248, -1184, -1888, -1824, -2016, -1952,
+        -1632, -1568, -1760, -1696, -688, -656, -752, -720, -560, -528, -624, -592,
+        -944, -912, -1008, -976, -816, -784, -880, -848, 5504, 5248, 6016, 5760,
+        4480, 4224, 4992, 4736, 7552, 7296, 8064, 7808, 6528, 6272, 7040, 6784,
+        2752, 2624, 3008, 2880, 2240, 2112, 2496, 2368, 3776, 3648, 4032, 3904,
+        3264, 3136, 3520, 3392, 22016, 20992, 24064, 23040, 17920, 16896, 19968, 18944,
+        30208, 29184, 32256, 31232, 26112, 25088, 28160, 27136, 11008, 10496, 12032, 11520,
+        8960, 8448, 9984, 9472, 15104, 14592, 16128, 15616, 13056, 12544, 14080, 13568,
+        344, 328, 376, 360, 280, 264, 312, 296, 472, 456, 504, 488,
+        408, 392, 440, 424, 88, 72, 120, 104, 24, 8, 56, 40,
+        216, 200, 248, 232, 152, 136, 184, 168, 1376, 1312, 1504, 1440,
+        1120, 1056, 1248, 1184, 1888, 1824, 2016, 1952, 1632, 1568, 1760, 1696,
+        688, 656, 752, 720, 560, 528, 624, 592, 944, 912, 1008, 976,
+        816, 784, 880, 848
+};
+
+static void AlawDecodeScalar(const uint8_t *src, int16_t *dst, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = alaw_table[src[i]];
+    }
+}
+
+// The vector kernels compute what the table holds, 16 samples at a time:
+//   a ^= 0x55, seg = (a >> 4) & 7, t = (a & 0x0f) << 4
+//   t += seg ? 0x108 : 8, t <<= seg ? seg - 1 : 0
+//   sample = a & 0x80 ? t : -t
+
+#ifdef ALAW_SSSE3
+__attribute__((target("ssse3")))
+static inline __m128i AlawDecodeHalf(__m128i a, __m128i seg, __m128i multiplier) {
+    __m128i t = _mm_slli_epi16(_mm_and_si128(a, _mm_set1_epi16(0x0f)), 4);
+    __m128i seg0 = _mm_cmpeq_epi16(seg, _mm_setzero_si128());
+    t = _mm_add_epi16(t, _mm_sub_epi16(_mm_set1_epi16(0x108), _mm_and_si128(seg0, _mm_set1_epi16(0x100))));
+    t = _mm_mullo_epi16(t, multiplier); // shift by a different amount in each lane
+    __m128i negative = _mm_cmpeq_epi16(_mm_and_si128(a, _mm_set1_epi16(0x80)), _mm_setzero_si128());
+    return _mm_sub_epi16(_mm_xor_si128(t, negative), negative);
+}
+
+__attribute__((target("ssse3")))
+static void AlawDecodeSSSE3(const uint8_t *src, int16_t *dst, size_t count) {
+    const __m128i powers = _mm_setr_epi8(1, 1, 2, 4, 8, 16, 32, 64, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m128i a = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (src + i)), _mm_set1_epi8(0x55));
+        __m128i seg = _mm_and_si128(_mm_srli_epi16(a, 4), _mm_set1_epi8(0x07));
+        __m128i multiplier = _mm_shuffle_epi8(powers, seg);
+        _mm_storeu_si128((__m128i *) (dst + i),
+                         AlawDecodeHalf(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(seg, zero),
+                                        _mm_unpacklo_epi8(multiplier, zero)));
+        _mm_storeu_si128((__m128i *) (dst + i + 8),
+                         AlawDecodeHalf(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(seg, zero),
+                                        _mm_unpackhi_epi8(multiplier, zero)));
+    }
+    AlawDecodeScalar(src + i, dst + i, count - i);
+}
+#endif
+
+#ifdef ALAW_NEON
+static inline int16x8_t AlawDecodeHalf(uint16x8_t a) {
+    uint16x8_t seg = vandq_u16(vshrq_n_u16(a, 4), vdupq_n_u16(7));
+    uint16x8_t t = vshlq_n_u16(vandq_u16(a, vdupq_n_u16(0x0f)), 4);
+    t = vaddq_u16(t, vbslq_u16(vceqq_u16(seg, vdupq_n_u16(0)), vdupq_n_u16(8), vdupq_n_u16(0x108)));
+    t = vshlq_u16(t, vreinterpretq_s16_u16(vqsubq_u16(seg, vdupq_n_u16(1))));
+    int16x8_t sample = vreinterpretq_s16_u16(t);
+    return vbslq_s16(vtstq_u16(a, vdupq_n_u16(0x80)), sample, vnegq_s16(sample));
+}
+
+static void AlawDecodeNEON(const uint8_t *src, int16_t *dst, size_t count) {
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        uint8x16_t a = veorq_u8(vld1q_u8(src + i), vdupq_n_u8(0x55));
+        vst1q_s16(dst + i, AlawDecodeHalf(vmovl_u8(vget_low_u8(a))));
+        vst1q_s16(dst + i + 8, AlawDecodeHalf(vmovl_u8(vget_high_u8(a))));
+    }
+    AlawDecodeScalar(src + i, dst + i, count - i);
+}
+#endif
+
+void AlawDecode(const uint8_t *src, int16_t *dst, size_t count) {
+#if defined(ALAW_SSSE3)
+    static int ssse3 = -1;
+    if (ssse3 < 0) {
+        ssse3 = __builtin_cpu_supports("ssse3");
+    }
+    if (ssse3) {
+        AlawDecodeSSSE3(src, dst, count);
+        return;
+    }
+#elif defined(ALAW_NEON)
+    AlawDecodeNEON(src, dst, count);
+    return;
+#endif
+    AlawDecodeScalar(src, dst, count);
+}
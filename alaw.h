@@ -0,0 +1,26 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef ALAW_H
+#define ALAW_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// G.711 a-law to 16 bit linear PCM
+void AlawDecode(const uint8_t *src, int16_t *dst, size_t count);
+
+#endif
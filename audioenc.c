@@ -0,0 +1,356 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "audioenc.h"
+#include "alaw.h"
+#include "metrics.h"
+
+#define AUDIO_QUEUE_LENGTH      64      // a-law payloads waiting for the encoder thread, about a second
+#define AUDIO_DEFAULT_FRAME     1024    // samples per frame for encoders accepting any frame size
+#define AUDIO_BIT_RATE          32000
+
+typedef struct AudioChunk_t {
+    uint8_t *data;
+    size_t length;
+    size_t size;
+    int64_t pts;
+} AudioChunk_t;
+
+struct AudioEncoder_t {
+    AVFormatContext *format_ctx;
+    AVCodecContext *encoder;
+    int stream_index;
+    pthread_mutex_t *mux_lock;
+    pthread_t thread;
+
+    // Queue shared between the converter and the encoder thread
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    AudioChunk_t chunks[AUDIO_QUEUE_LENGTH];
+    int head;
+    int count;
+    bool finished;
+    bool failed;
+
+    // Decoded samples waiting to fill an encoder frame, only used by the encoder thread
+    int16_t *samples;
+    size_t samples_count;
+    size_t samples_size;
+    int64_t samples_pts;
+    int frame_size;
+    AVFrame *frame;
+    AVPacket *packet;
+};
+
+AVCodecContext *OpenAudioEncoder(const char *codec_name, int sample_rate, bool global_header) {
+    const AVCodec *codec;
+    int retval;
+
+    if (strcmp(codec_name, "opus") == 0) {
+        // The native Opus encoder only supports 48 kHz, libopus also handles camera sampling frequencies
+        codec = avcodec_find_encoder_by_name("libopus");
+    } else {
+        codec = avcodec_find_encoder_by_name(codec_name);
+    }
+    if (!codec) {
+        fprintf(stderr, "Audio encoder for %s is not available.\n", codec_name);
+        return NULL;
+    }
+
+    AVCodecContext *encoder = avcodec_alloc_context3(codec);
+    if (!encoder) {
+        fprintf(stderr, "Could not allocate audio encoder.\n");
+        return NULL;
+    }
+    encoder->time_base = (AVRational) {1, sample_rate};
+    encoder->sample_rate = sample_rate;
+    encoder->channel_layout = AV_CH_LAYOUT_MONO;
+    encoder->channels = 1;
+    encoder->bit_rate = AUDIO_BIT_RATE;
+
+    // Prefer 16 bit samples, which need no conversion, then float
+    encoder->sample_fmt = codec->sample_fmts ? codec->sample_fmts[0] : AV_SAMPLE_FMT_S16;
+    for (const enum AVSampleFormat *fmt = codec->sample_fmts; fmt && *fmt != AV_SAMPLE_FMT_NONE; fmt++) {
+        if (*fmt == AV_SAMPLE_FMT_S16) {
+            encoder->sample_fmt = AV_SAMPLE_FMT_S16;
+            break;
+        }
+    }
+    if (encoder->sample_fmt != AV_SAMPLE_FMT_S16 && encoder->sample_fmt != AV_SAMPLE_FMT_FLT &&
+        encoder->sample_fmt != AV_SAMPLE_FMT_FLTP) {
+        fprintf(stderr, "Audio encoder %s doesn't accept 16 bit or float samples.\n", codec->name);
+        avcodec_free_context(&encoder);
+        return NULL;
+    }
+
+    if (global_header) {
+        encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    if ((retval = avcodec_open2(encoder, codec, NULL)) < 0) {
+        fprintf(stderr, "Could not open audio encoder %s at %d Hz: %s\n", codec->name, sample_rate,
+                av_err2str(retval));
+        avcodec_free_context(&encoder);
+        return NULL;
+    }
+    return encoder;
+}
+
+static bool WriteEncodedPackets(AudioEncoder_t *ae) {
+    int retval;
+    AVStream *stream = ae->format_ctx->streams[ae->stream_index];
+
+    while ((retval = avcodec_receive_packet(ae->encoder, ae->packet)) == 0) {
+        av_packet_rescale_ts(ae->packet, ae->encoder->time_base, stream->time_base);
+        ae->packet->stream_index = ae->stream_index;
+        pthread_mutex_lock(ae->mux_lock);
+        retval = av_interleaved_write_frame(ae->format_ctx, ae->packet);
+        pthread_mutex_unlock(ae->mux_lock);
+        if (retval < 0) {
+            fprintf(stderr, "Error while writing output packet: %s\n", av_err2str(retval));
+            return false;
+        }
+        METRICS_ADD(audio_packets, 1);
+    }
+
+    if (retval != AVERROR(EAGAIN) && retval != AVERROR_EOF) {
+        fprintf(stderr, "Error while encoding audio: %s\n", av_err2str(retval));
+        return false;
+    }
+    return true;
+}
+
+// Encodes the first count buffered samples, padding with silence up to the frame size if needed
+static bool EncodeSamples(AudioEncoder_t *ae, size_t count) {
+    int retval;
+    AVFrame *frame = ae->frame;
+
+    if ((retval = av_frame_make_writable(frame)) < 0) {
+        fprintf(stderr, "Could not allocate audio frame: %s\n", av_err2str(retval));
+        return false;
+    }
+
+    size_t encoded = count < (size_t) frame->nb_samples ? count : (size_t) frame->nb_samples;
+    if (ae->encoder->sample_fmt == AV_SAMPLE_FMT_S16) {
+        int16_t *dst = (int16_t *) frame->data[0];
+        memcpy(dst, ae->samples, encoded * sizeof(int16_t));
+        memset(dst + encoded, 0, (frame->nb_samples - encoded) * sizeof(int16_t));
+    } else { // mono, so packed and planar float share the same layout
+        float *dst = (float *) frame->data[0];
+        for (size_t i = 0; i < encoded; i++) {
+            dst[i] = (float) ae->samples[i] / 32768.0f;
+        }
+        memset(dst + encoded, 0, (frame->nb_samples - encoded) * sizeof(float));
+    }
+    frame->pts = ae->samples_pts;
+
+    if ((retval = avcodec_send_frame(ae->encoder, frame)) < 0) {
+        fprintf(stderr, "Error while encoding audio: %s\n", av_err2str(retval));
+        return false;
+    }
+
+    ae->samples_count -= encoded;
+    ae->samples_pts += (int64_t) encoded;
+    memmove(ae->samples, ae->samples + encoded, ae->samples_count * sizeof(int16_t));
+    return WriteEncodedPackets(ae);
+}
+
+static bool DecodeChunk(AudioEncoder_t *ae, const AudioChunk_t *chunk) {
+    // Encoder frames are contiguous, so short gaps left by the converter to resync with the camera clock are filled
+    // with silence, longer ones restart the frames after them
+    int64_t gap = chunk->pts - (ae->samples_pts + (int64_t) ae->samples_count);
+    if (ae->samples_count > 0 && gap > ae->encoder->sample_rate) {
+        if (!EncodeSamples(ae, ae->samples_count)) {
+            return false;
+        }
+    }
+    if (ae->samples_count == 0) {
+        ae->samples_pts = chunk->pts;
+        gap = 0;
+    }
+    size_t silence = gap > 0 ? (size_t) gap : 0;
+
+    if (ae->samples_count + silence + chunk->length > ae->samples_size) {
+        ae->samples_size = ae->samples_count + silence + chunk->length + ae->frame_size;
+        ae->samples = realloc(ae->samples, ae->samples_size * sizeof(int16_t));
+        if (ae->samples == NULL) {
+            fprintf(stderr, "Cannot allocate memory for audio samples.\n");
+            return false;
+        }
+    }
+    memset(ae->samples + ae->samples_count, 0, silence * sizeof(int16_t));
+    ae->samples_count += silence;
+    AlawDecode(chunk->data, ae->samples + ae->samples_count, chunk->length);
+    ae->samples_count += chunk->length;
+
+    while (ae->samples_count >= (size_t) ae->frame_size) {
+        if (!EncodeSamples(ae, ae->frame_size)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void *AudioEncoderThread(void *arg) {
+    AudioEncoder_t *ae = arg;
+    bool success = true;
+
+    for (;;) {
+        pthread_mutex_lock(&ae->lock);
+        while (ae->count == 0 && !ae->finished) {
+            pthread_cond_wait(&ae->not_empty, &ae->lock);
+        }
+        if (ae->count == 0) {
+            pthread_mutex_unlock(&ae->lock);
+            break;
+        }
+        AudioChunk_t *chunk = &ae->chunks[ae->head];
+        pthread_mutex_unlock(&ae->lock);
+
+        // The chunk slot can't be reused by the converter until it is released below
+        success = DecodeChunk(ae, chunk);
+
+        pthread_mutex_lock(&ae->lock);
+        ae->head = (ae->head + 1) % AUDIO_QUEUE_LENGTH;
+        ae->count--;
+        if (!success) {
+            ae->failed = true;
+        }
+        pthread_cond_signal(&ae->not_full);
+        pthread_mutex_unlock(&ae->lock);
+
+        if (!success) {
+            return NULL;
+        }
+    }
+
+    // Last partial frame, then drain the encoder
+    if (ae->samples_count && !EncodeSamples(ae, ae->samples_count)) {
+        ae->failed = true;
+        return NULL;
+    }
+    if (avcodec_send_frame(ae->encoder, NULL) < 0 || !WriteEncodedPackets(ae)) {
+        ae->failed = true;
+    }
+    return NULL;
+}
+
+AudioEncoder_t *AudioEncoderStart(AVFormatContext *format_ctx, int stream_index, AVCodecContext *encoder,
+                                  pthread_mutex_t *mux_lock) {
+    AudioEncoder_t *ae = calloc(1, sizeof(AudioEncoder_t));
+    if (!ae) {
+        fprintf(stderr, "Cannot allocate memory for audio encoder.\n");
+        avcodec_free_context(&encoder);
+        return NULL;
+    }
+
+    ae->format_ctx = format_ctx;
+    ae->encoder = encoder;
+    ae->stream_index = stream_index;
+    ae->mux_lock = mux_lock;
+    ae->frame_size = encoder->frame_size > 0 && !(encoder->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE) ?
+                     encoder->frame_size : AUDIO_DEFAULT_FRAME;
+    ae->frame = av_frame_alloc();
+    ae->packet = av_packet_alloc();
+    if (!ae->frame || !ae->packet) {
+        fprintf(stderr, "Cannot allocate memory for audio encoder.\n");
+        goto error;
+    }
+    ae->frame->nb_samples = ae->frame_size;
+    ae->frame->format = encoder->sample_fmt;
+    ae->frame->channel_layout = encoder->channel_layout;
+    ae->frame->channels = encoder->channels;
+    ae->frame->sample_rate = encoder->sample_rate;
+    if (av_frame_get_buffer(ae->frame, 0) < 0) {
+        fprintf(stderr, "Cannot allocate memory for audio frame.\n");
+        goto error;
+    }
+
+    pthread_mutex_init(&ae->lock, NULL);
+    pthread_cond_init(&ae->not_empty, NULL);
+    pthread_cond_init(&ae->not_full, NULL);
+    if (pthread_create(&ae->thread, NULL, AudioEncoderThread, ae) != 0) {
+        fprintf(stderr, "Cannot start audio encoder thread.\n");
+        goto error;
+    }
+    return ae;
+
+    error:
+    av_frame_free(&ae->frame);
+    av_packet_free(&ae->packet);
+    avcodec_free_context(&ae->encoder);
+    free(ae);
+    return NULL;
+}
+
+bool AudioEncoderPush(AudioEncoder_t *ae, const uint8_t *data, size_t length, int64_t pts) {
+    pthread_mutex_lock(&ae->lock);
+    while (ae->count == AUDIO_QUEUE_LENGTH && !ae->failed) {
+        pthread_cond_wait(&ae->not_full, &ae->lock);
+    }
+    if (ae->failed) {
+        pthread_mutex_unlock(&ae->lock);
+        return false;
+    }
+    AudioChunk_t *chunk = &ae->chunks[(ae->head + ae->count) % AUDIO_QUEUE_LENGTH];
+    pthread_mutex_unlock(&ae->lock);
+
+    // Only this thread fills free slots, so the chunk can be written without holding the lock
+    if (chunk->size < length) {
+        free(chunk->data);
+        if (!(chunk->data = malloc(length))) {
+            chunk->size = 0;
+            fprintf(stderr, "Cannot allocate memory for audio samples.\n");
+            return false;
+        }
+        chunk->size = length;
+    }
+    memcpy(chunk->data, data, length);
+    chunk->length = length;
+    chunk->pts = pts;
+
+    pthread_mutex_lock(&ae->lock);
+    ae->count++;
+    pthread_cond_signal(&ae->not_empty);
+    pthread_mutex_unlock(&ae->lock);
+    return true;
+}
+
+bool AudioEncoderFinish(AudioEncoder_t *ae) {
+    pthread_mutex_lock(&ae->lock);
+    ae->finished = true;
+    pthread_cond_signal(&ae->not_empty);
+    pthread_mutex_unlock(&ae->lock);
+    pthread_join(ae->thread, NULL);
+
+    bool success = !ae->failed;
+    for (int i = 0; i < AUDIO_QUEUE_LENGTH; i++) {
+        free(ae->chunks[i].data);
+    }
+    free(ae->samples);
+    av_frame_free(&ae->frame);
+    av_packet_free(&ae->packet);
+    avcodec_free_context(&ae->encoder);
+    pthread_mutex_destroy(&ae->lock);
+    pthread_cond_destroy(&ae->not_empty);
+    pthread_cond_destroy(&ae->not_full);
+    free(ae);
+    return success;
+}
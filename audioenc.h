@@ -0,0 +1,43 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef AUDIOENC_H
+#define AUDIOENC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+typedef struct AudioEncoder_t AudioEncoder_t;
+
+// Opens the encoder used to transcode a-law audio: "aac" or "opus", mono at the given sample rate
+AVCodecContext *OpenAudioEncoder(const char *codec_name, int sample_rate, bool global_header);
+
+// Starts a thread which decodes the a-law payloads pushed to it, encodes them with encoder and writes the resulting
+// packets to stream_index of format_ctx, holding mux_lock while doing so. Takes ownership of encoder.
+AudioEncoder_t *AudioEncoderStart(AVFormatContext *format_ctx, int stream_index, AVCodecContext *encoder,
+                                  pthread_mutex_t *mux_lock);
+
+// Queues a copy of an a-law payload whose first sample has the given pts, in 1 / sample rate units. Blocks while
+// the encoder thread is too far behind. Returns false if the encoder thread failed.
+bool AudioEncoderPush(AudioEncoder_t *audio_encoder, const uint8_t *data, size_t length, int64_t pts);
+
+// Encodes the remaining samples, flushes the encoder and stops the thread. Returns false if encoding failed.
+bool AudioEncoderFinish(AudioEncoder_t *audio_encoder);
+
+#endif
@@ -0,0 +1,737 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include "batch.h"
+#include "metrics.h"
+#include "trace.h"
+#include "hxscan.h"
+#include "nal.h"
+
+#define STDIN_POLL_MS       100
+#define SPLIT_POLL_MS       10              // how often the answer to a split request is checked
+#define SPLIT_MIN_SIZE      (256LL << 20)   // inputs at least this large are written as fragments, so they can be split
+#define SPLIT_MIN_LEFT      (64LL << 20)    // conversions with less input than this left aren't split
+#define CHUNK_OUTPUT_BASE   (1LL << 48)     // output offset of chunks after the first, placing their header before it
+#define JOIN_COPY_MAX       (1 << 30)
+
+enum SplitAnswer {
+    SPLIT_NONE = 0,
+    SPLIT_ACCEPTED,
+    SPLIT_REFUSED
+};
+
+struct BatchDevice_t;
+
+// An input file, converted as a whole or, if large, as chunks starting at key frames, each written to a part of its
+// own which is appended to the output once all of them are done
+typedef struct BatchFile_t {
+    char *in_filename;
+    off_t size;
+    int64_t priority;           // files with the highest one start first
+    struct BatchDevice_t *device;
+    char *out_filename;         // only set for inputs which can be split
+    int out_fd;
+    struct BatchPart_t {
+        int64_t input_offset;
+        int fd;
+    } *parts;
+    size_t parts_count;
+    int chunks_left;            // chunks running or waiting for a worker
+    bool failed;
+    struct timespec start;
+} BatchFile_t;
+
+// Shared between the scheduler and the process converting a chunk, which checks for requests at every key frame
+typedef struct BatchSplit_t {
+    int64_t position;           // input offset of the last key frame reached
+    int64_t request;            // input offset asked by the scheduler to stop at, 0 if none
+    int32_t answer;             // SplitAnswer, set by the conversion and reset by the scheduler
+    Checkpoint_t state;         // state at the key frame where the request was accepted
+} BatchSplit_t;
+
+// Work waiting for a worker: a chunk taken from a running conversion, or the parts of a file to put together
+typedef struct BatchTask_t {
+    BatchFile_t *file;
+    bool join;
+    Checkpoint_t from;          // key frame the chunk is searched from
+    int64_t split_at;           // the chunk starts at the first key frame at or after this offset
+    int64_t input_end;          // and ends at the first one at or after this one
+    int part_fd;
+} BatchTask_t;
+
+typedef struct BatchJob_t {
+    pid_t pid;
+    int track;                  // worker number in traces
+    BatchFile_t *file;
+    bool join;
+    int64_t input_end;          // chunks end at the first key frame at or after this offset
+    BatchSplit_t *split;        // in memory shared with the conversion
+} BatchJob_t;
+
+// Files stored on a block device, waiting for a worker largest first, so that a long conversion doesn't start last
+// and hold up the end, or in the order they are laid out on a rotational disk. Only limit jobs read from the device at
+// the same time, one for rotational disks by default, as interleaved reads would keep their heads seeking back and
+// forth.
+typedef struct BatchDevice_t {
+    dev_t dev;
+    bool physical_order;
+    int limit;
+    int running;
+    BatchFile_t **items;
+    size_t count, size;
+} BatchDevice_t;
+
+// Files waiting for a worker, on all devices
+typedef struct BatchQueue_t {
+    BatchDevice_t **devices;
+    size_t devices_count;
+    size_t count;
+    int rotational_jobs, other_jobs;
+    bool physical_order;
+} BatchQueue_t;
+
+// State of the conversion process of a chunk
+typedef struct BatchChunk_t {
+    BatchSplit_t *split;
+    int64_t input_end;
+} BatchChunk_t;
+
+// Whether the disk holding dev, or the disk of the partition dev is, has rotating platters
+static bool IsRotational(dev_t dev) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/rotational", major(dev), minor(dev));
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/rotational", major(dev), minor(dev));
+        fp = fopen(path, "r");
+    }
+    if (!fp) {
+        return false; // not a block device, like network and memory file systems
+    }
+    bool rotational = fgetc(fp) == '1';
+    fclose(fp);
+    return rotational;
+}
+
+// Where the file starts on its disk, from its first extent, or its inode number on file systems not telling
+static uint64_t PhysicalOffset(const char *filename, const struct stat *st) {
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.map.fm_length = FIEMAP_MAX_OFFSET;
+    request.map.fm_extent_count = 1;
+
+    int fd = open(filename, O_RDONLY);
+    bool mapped = fd >= 0 && ioctl(fd, FS_IOC_FIEMAP, &request.map) == 0 && request.map.fm_mapped_extents > 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    return mapped ? request.extent.fe_physical : (uint64_t) st->st_ino;
+}
+
+static BatchDevice_t *QueueDevice(BatchQueue_t *queue, dev_t dev) {
+    for (size_t i = 0; i < queue->devices_count; i++) {
+        if (queue->devices[i]->dev == dev) {
+            return queue->devices[i];
+        }
+    }
+
+    BatchDevice_t *device = calloc(1, sizeof(BatchDevice_t));
+    queue->devices = realloc(queue->devices, (queue->devices_count + 1) * sizeof(BatchDevice_t *));
+    if (device == NULL || queue->devices == NULL) {
+        fprintf(stderr, "Cannot allocate memory, aborting.\n");
+        exit(1);
+    }
+    bool rotational = IsRotational(dev);
+    device->dev = dev;
+    device->limit = rotational ? queue->rotational_jobs : queue->other_jobs;
+    device->physical_order = rotational && queue->physical_order;
+    queue->devices[queue->devices_count++] = device;
+    return device;
+}
+
+static void QueuePush(BatchQueue_t *queue, char *in_filename) {
+    BatchFile_t *file = calloc(1, sizeof(BatchFile_t));
+    if (file == NULL) {
+        fprintf(stderr, "Cannot allocate memory, aborting.\n");
+        exit(1);
+    }
+    struct stat st;
+    bool found = stat(in_filename, &st) == 0;
+    file->in_filename = in_filename;
+    file->size = found ? st.st_size : 0;
+    file->device = QueueDevice(queue, found ? st.st_dev : 0);
+    file->out_fd = -1;
+
+    BatchDevice_t *device = file->device;
+    file->priority = !device->physical_order ? (int64_t) file->size :
+                     found ? -(int64_t) (PhysicalOffset(in_filename, &st) >> 1) : 0;
+    if (device->count == device->size) {
+        device->size = device->size ? device->size * 2 : 64;
+        if (!(device->items = realloc(device->items, device->size * sizeof(BatchFile_t *)))) {
+            fprintf(stderr, "Cannot allocate memory, aborting.\n");
+            exit(1);
+        }
+    }
+
+    // Binary max-heap on priority
+    size_t i = device->count++;
+    while (i > 0 && device->items[(i - 1) / 2]->priority < file->priority) {
+        device->items[i] = device->items[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    device->items[i] = file;
+    queue->count++;
+    METRICS_ADD(queue_depth, 1);
+}
+
+// Largest file waiting on a device which can take one more job, NULL if there is none
+static BatchFile_t *QueuePop(BatchQueue_t *queue) {
+    BatchDevice_t *device = NULL;
+    for (size_t i = 0; i < queue->devices_count; i++) {
+        BatchDevice_t *candidate = queue->devices[i];
+        if (candidate->count > 0 && candidate->running < candidate->limit &&
+            (!device || candidate->items[0]->size > device->items[0]->size)) {
+            device = candidate;
+        }
+    }
+    if (!device) {
+        return NULL;
+    }
+    queue->count--;
+    METRICS_SUB(queue_depth, 1);
+
+    BatchFile_t *top = device->items[0], *last = device->items[--device->count];
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= device->count) {
+            break;
+        }
+        if (child + 1 < device->count && device->items[child + 1]->priority > device->items[child]->priority) {
+            child++;
+        }
+        if (device->items[child]->priority <= last->priority) {
+            break;
+        }
+        device->items[i] = device->items[child];
+        i = child;
+    }
+    device->items[i] = last;
+    return top;
+}
+
+static void FileFree(BatchFile_t *file) {
+    for (size_t i = 0; i < file->parts_count; i++) {
+        close(file->parts[i].fd);
+    }
+    if (file->out_fd >= 0) {
+        close(file->out_fd);
+    }
+    av_free(file->out_filename);
+    free(file->parts);
+    free(file->in_filename);
+    free(file);
+}
+
+// Reads one input name from standard input, returns false at end of file
+static bool ReadInputName(BatchQueue_t *queue) {
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t length = getline(&line, &line_size, stdin);
+    if (length < 0) {
+        free(line);
+        return false;
+    }
+
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+        line[--length] = '\0';
+    }
+    if (length > 0) {
+        QueuePush(queue, line);
+    } else {
+        free(line);
+    }
+    return true;
+}
+
+// Large inputs going to a format which can be written as fragments are converted as chunks, which idle workers can
+// take over. Chunks are streamed, which can't transcode audio nor follow a growing input. The output is opened here,
+// so that the chunks don't have to agree on who creates it.
+static bool PrepareSplit(BatchFile_t *file, const ConvertOptions_t *options) {
+    const AVOutputFormat *format = av_guess_format(options->format_name ? options->format_name : "matroska", NULL,
+                                                   NULL);
+    bool transcoding = options->audio_codec && strcmp(options->audio_codec, "copy") != 0;
+    if (file->size < SPLIT_MIN_SIZE || !format || !IsFragmentableFormat(format) || transcoding ||
+        options->resumable || options->follow_ms) {
+        return true;
+    }
+
+    file->out_filename = OutputFilename(file->in_filename, format, true);
+    if (!options->overwrite_existing && access(file->out_filename, F_OK) == 0) {
+        fprintf(stderr, "Output file %s already exists but can't overwrite it, skipping.\n", file->out_filename);
+        return false;
+    }
+    if ((file->out_fd = open(file->out_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        fprintf(stderr, "Could not open output file %s.\n", file->out_filename);
+        file->failed = true;
+        return false;
+    }
+    return true;
+}
+
+// Anonymous file next to the output, holding the output of a chunk until it is appended
+static int CreatePart(const BatchFile_t *file) {
+    char *copy = strdup(file->out_filename);
+    char *template = malloc(strlen(file->out_filename) + 16);
+    int fd = -1;
+    if (copy && template) {
+        sprintf(template, "%s/.partXXXXXX", dirname(copy));
+        if ((fd = mkstemp(template)) >= 0) {
+            unlink(template);
+        }
+    }
+    free(template);
+    free(copy);
+    return fd;
+}
+
+// Walks the records following the key frame of from, as the conversion does, to the first key frame at or after
+// split_at. Returns its offset, and the number of its fragment in fragment_index, or -1 if the input ends before.
+static int64_t FindKeyFrame(FILE *fp, const Checkpoint_t *from, int64_t split_at, uint32_t *fragment_index) {
+    bool hevc = from->info.video_header == HXVT, param_sets = false;
+    *fragment_index = from->fragment_index;
+    if (fseeko(fp, (off_t) from->input_offset, SEEK_SET) < 0) {
+        return -1;
+    }
+
+    HXFrame_t frame;
+    int64_t offset = ftello(fp);
+    while (HXReadFrame(fp, &frame)) {
+        if (frame.header == HXFI) {
+            break;
+        }
+        if (frame.header == HXVF) {
+            if (!param_sets && frame.data.hxvf.type == HXVF_TYPE_I && offset > (int64_t) from->input_offset) {
+                (*fragment_index)++;
+                if (offset >= split_at) {
+                    return offset;
+                }
+            }
+            uint8_t nal[8];
+            size_t length = frame.data.hxvf.length < sizeof(nal) ? frame.data.hxvf.length : sizeof(nal);
+            if (fread(nal, 1, length, fp) != length) {
+                break;
+            }
+            param_sets = NalIsParameterSet(hevc, NalUnitType(hevc, nal, length));
+            if (fseeko(fp, (off_t) (frame.data.hxvf.length - length), SEEK_CUR) < 0) {
+                break;
+            }
+        } else if ((frame.header == HXAF || frame.header == HXVS || frame.header == HXVT) &&
+                   !HXSkipPayload(fp, &frame)) {
+            break;
+        }
+        offset = ftello(fp);
+    }
+    return -1;
+}
+
+// Called at every key frame of a chunk: stops at the end of the chunk, and answers split requests
+static bool ChunkFragment(void *opaque, const Checkpoint_t *checkpoint, long time_ms) {
+    BatchChunk_t *chunk = opaque;
+    int64_t offset = (int64_t) checkpoint->input_offset;
+    if (offset >= chunk->input_end) {
+        return false;
+    }
+
+    __atomic_store_n(&chunk->split->position, offset, __ATOMIC_RELAXED);
+    int64_t request = __atomic_load_n(&chunk->split->request, __ATOMIC_ACQUIRE);
+    if (request && __atomic_load_n(&chunk->split->answer, __ATOMIC_ACQUIRE) == SPLIT_NONE) {
+        if (request > offset && request < chunk->input_end) {
+            chunk->split->state = *checkpoint;
+            chunk->input_end = request;
+            __atomic_store_n(&chunk->split->answer, SPLIT_ACCEPTED, __ATOMIC_RELEASE);
+        } else {
+            __atomic_store_n(&chunk->split->answer, SPLIT_REFUSED, __ATOMIC_RELEASE);
+        }
+    }
+    return true;
+}
+
+// Converts a chunk in the job process, from the beginning of the input if task is NULL
+static int ConvertChunk(BatchJob_t *job, const BatchTask_t *task, int fd, const ConvertOptions_t *options) {
+    BatchChunk_t chunk = {job->split, job->input_end};
+    ConvertStream_t stream = {.fd = fd, .range_end = -1, .on_fragment = ChunkFragment, .opaque = &chunk};
+    ConvertOptions_t chunk_options = *options;
+    chunk_options.stream = &stream;
+
+    Checkpoint_t start;
+    if (task) {
+        FILE *fp = fopen(job->file->in_filename, "rb");
+        uint32_t fragment_index;
+        int64_t offset = fp ? FindKeyFrame(fp, &task->from, task->split_at, &fragment_index) : -1;
+        if (fp) {
+            fclose(fp);
+        }
+        if (offset < 0 || offset >= task->input_end) {
+            return 0; // the conversion split ended before reaching this chunk
+        }
+
+        // Audio restarts from the camera clock, which is within a few ms from where the previous chunk left it
+        start = task->from;
+        start.input_offset = (uint64_t) offset;
+        start.output_offset = CHUNK_OUTPUT_BASE;
+        start.fragment_index = fragment_index;
+        start.audio_clock_started = 0;
+        start.audio_next_pts = 0;
+        stream.start = &start;
+        stream.range_start = CHUNK_OUTPUT_BASE;
+        chunk_options.quiet = true;
+    }
+    return ConvertFile(job->file->in_filename, job->file->out_filename, &chunk_options);
+}
+
+// Appends the parts of a file to its output, in input order, in the job process
+static int JoinParts(BatchFile_t *file) {
+    if (lseek(file->out_fd, 0, SEEK_END) < 0) {
+        return 1;
+    }
+    for (size_t i = 0; i < file->parts_count; i++) {
+        int fd = file->parts[i].fd;
+        off_t size = lseek(fd, 0, SEEK_END), offset = 0;
+        while (offset < size) {
+            size_t count = size - offset < JOIN_COPY_MAX ? (size_t) (size - offset) : JOIN_COPY_MAX;
+            ssize_t copied = sendfile(file->out_fd, fd, &offset, count);
+            if (copied <= 0) {
+                fprintf(stderr, "Cannot write output file %s: %s\n", file->out_filename, strerror(errno));
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static bool StartJob(BatchJob_t *job, BatchFile_t *file, const BatchTask_t *task, const ConvertOptions_t *options) {
+    fflush(NULL); // don't let children flush buffered output of the parent again
+    if (file->start.tv_sec == 0 && file->start.tv_nsec == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &file->start);
+    }
+    job->file = file;
+    job->join = task && task->join;
+    job->input_end = task ? task->input_end : INT64_MAX;
+    memset(job->split, 0, sizeof(BatchSplit_t));
+    job->pid = fork();
+    if (job->pid < 0) {
+        fprintf(stderr, "Cannot start conversion of %s: %s\n", file->in_filename, strerror(errno));
+        job->pid = 0;
+        return false;
+    }
+
+    if (job->pid == 0) {
+        TraceTrack(job->track, "worker");
+        if (job->join) {
+            TRACE_BEGIN(trace_join);
+            int retval = JoinParts(file);
+            TRACE_END(trace_join, "join parts", file->out_filename);
+            exit(retval);
+        } else if (file->out_filename) {
+            exit(ConvertChunk(job, task, task ? task->part_fd : file->out_fd, options));
+        }
+        exit(ConvertFile(file->in_filename, NULL, options));
+    }
+    file->device->running++;
+    if (!job->join) {
+        METRICS_ADD(conversions_running, 1);
+    }
+    return true;
+}
+
+// Accounts for a file whose conversion is over, returning false if it failed
+static bool FinishFile(BatchFile_t *file) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (double) (end.tv_sec - file->start.tv_sec) + (double) (end.tv_nsec - file->start.tv_nsec) / 1e9;
+
+    if (file->failed) {
+        METRICS_ADD(files_failed, 1);
+        fprintf(stderr, "Conversion of %s failed.\n", file->in_filename);
+        if (file->out_filename) {
+            unlink(file->out_filename); // chunks left out would make it look complete
+        }
+    } else {
+        METRICS_ADD(files_converted, 1);
+        MetricsObserveLatency(elapsed);
+    }
+    bool success = !file->failed;
+    FileFree(file);
+    return success;
+}
+
+static void TaskPush(BatchTask_t **tasks, size_t *count, const BatchTask_t *task) {
+    if (!(*tasks = realloc(*tasks, (*count + 1) * sizeof(BatchTask_t)))) {
+        fprintf(stderr, "Cannot allocate memory, aborting.\n");
+        exit(1);
+    }
+    (*tasks)[(*count)++] = *task;
+}
+
+// Turns an accepted split request into a chunk waiting for a worker
+static void SplitAccepted(BatchJob_t *job, BatchTask_t **tasks, size_t *tasks_count, bool quiet) {
+    BatchFile_t *file = job->file;
+    BatchTask_t task = {.file = file, .from = job->split->state, .split_at = job->split->request,
+                        .input_end = job->input_end};
+    job->input_end = job->split->request;
+    if ((task.part_fd = CreatePart(file)) < 0 ||
+        !(file->parts = realloc(file->parts, (file->parts_count + 1) * sizeof(file->parts[0])))) {
+        fprintf(stderr, "Cannot create a part of %s, not splitting it.\n", file->out_filename);
+        file->failed = true; // the conversion stops at the split nonetheless
+        if (task.part_fd >= 0) {
+            close(task.part_fd);
+        }
+        return;
+    }
+
+    // Parts are kept in input order, each one ending where the next one starts
+    size_t i = file->parts_count++;
+    while (i > 0 && file->parts[i - 1].input_offset > task.split_at) {
+        file->parts[i] = file->parts[i - 1];
+        i--;
+    }
+    file->parts[i].input_offset = task.split_at;
+    file->parts[i].fd = task.part_fd;
+    file->chunks_left++;
+    TaskPush(tasks, tasks_count, &task);
+    if (!quiet) {
+        fprintf(stderr, "Splitting conversion of %s at byte %lld.\n", file->in_filename, (long long) task.split_at);
+    }
+}
+
+// Asks the running chunk with the most input left to stop halfway, so that an idle worker can take the rest
+static BatchJob_t *RequestSplit(BatchJob_t *jobs, int jobs_count) {
+    BatchJob_t *victim = NULL;
+    int64_t victim_left = SPLIT_MIN_LEFT - 1, victim_position = 0;
+    for (int i = 0; i < jobs_count; i++) {
+        if (jobs[i].pid == 0 || jobs[i].join || !jobs[i].file->out_filename ||
+            jobs[i].file->device->running >= jobs[i].file->device->limit) {
+            continue;
+        }
+        int64_t position = __atomic_load_n(&jobs[i].split->position, __ATOMIC_RELAXED);
+        int64_t end = jobs[i].input_end < jobs[i].file->size ? jobs[i].input_end : jobs[i].file->size;
+        if (end - position > victim_left) {
+            victim = &jobs[i];
+            victim_left = end - position;
+            victim_position = position;
+        }
+    }
+    if (victim) {
+        __atomic_store_n(&victim->split->request, victim_position + victim_left / 2, __ATOMIC_RELEASE);
+    }
+    return victim;
+}
+
+// Checks the answer to a split request, returning false once there is no request pending any more
+static bool SplitPending(BatchJob_t *victim, BatchTask_t **tasks, size_t *tasks_count, bool exited, bool quiet) {
+    int32_t answer = __atomic_load_n(&victim->split->answer, __ATOMIC_ACQUIRE);
+    if (answer == SPLIT_NONE && !exited) {
+        return true;
+    }
+    if (answer == SPLIT_ACCEPTED) {
+        SplitAccepted(victim, tasks, tasks_count, quiet);
+    }
+    __atomic_store_n(&victim->split->request, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&victim->split->answer, SPLIT_NONE, __ATOMIC_RELEASE);
+    return false;
+}
+
+// Accounts for a finished job, returning the number of failed files
+static int FinishJob(BatchJob_t *jobs, int jobs_count, pid_t pid, int status, BatchJob_t **victim,
+                     BatchTask_t **tasks, size_t *tasks_count, bool quiet) {
+    for (int i = 0; i < jobs_count; i++) {
+        if (jobs[i].pid != pid) {
+            continue;
+        }
+
+        BatchFile_t *file = jobs[i].file;
+        if (*victim == &jobs[i] && !SplitPending(*victim, tasks, tasks_count, true, quiet)) {
+            *victim = NULL;
+        }
+        jobs[i].pid = 0;
+        file->device->running--;
+        if (!jobs[i].join) {
+            METRICS_SUB(conversions_running, 1);
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            file->failed = true;
+        }
+
+        if (jobs[i].join || !file->out_filename) {
+            return FinishFile(file) ? 0 : 1;
+        }
+        if (--file->chunks_left > 0) {
+            return 0;
+        }
+        if (file->failed || file->parts_count == 0) {
+            return FinishFile(file) ? 0 : 1;
+        }
+        BatchTask_t task = {.file = file, .join = true};
+        TaskPush(tasks, tasks_count, &task);
+        return 0;
+    }
+    return 0;
+}
+
+int RunBatch(char **inputs, int inputs_count, int jobs_count, int rotational_jobs, int other_jobs, bool physical_order,
+             const ConvertOptions_t *options) {
+    BatchQueue_t queue = {NULL, 0, 0, rotational_jobs, other_jobs, physical_order};
+    BatchTask_t *tasks = NULL;
+    size_t tasks_count = 0;
+    BatchJob_t *victim = NULL;
+    bool read_stdin = false;
+    int failures = 0, running = 0;
+
+    for (int i = 0; i < inputs_count; i++) {
+        if (strcmp(inputs[i], "-") == 0) {
+            read_stdin = true;
+        } else {
+            QueuePush(&queue, strdup(inputs[i]));
+        }
+    }
+
+    BatchJob_t *jobs = calloc(jobs_count, sizeof(BatchJob_t));
+    BatchSplit_t *splits = mmap(NULL, jobs_count * sizeof(BatchSplit_t), PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (jobs == NULL || splits == MAP_FAILED) {
+        fprintf(stderr, "Cannot allocate memory, aborting.\n");
+        exit(1);
+    }
+    for (int i = 0; i < jobs_count; i++) {
+        jobs[i].split = &splits[i];
+        jobs[i].track = i + 1;
+    }
+
+    for (;;) {
+        // Start as many jobs as there are free slots and devices allow: chunks and joins first, then the largest files
+        for (int i = 0; i < jobs_count; i++) {
+            if (jobs[i].pid != 0) {
+                continue;
+            }
+            size_t t = 0;
+            while (t < tasks_count && tasks[t].file->device->running >= tasks[t].file->device->limit) {
+                t++;
+            }
+            if (t < tasks_count) {
+                BatchTask_t task = tasks[t];
+                memmove(tasks + t, tasks + t + 1, (--tasks_count - t) * sizeof(BatchTask_t));
+                if (!task.file->failed && StartJob(&jobs[i], task.file, &task, options)) {
+                    running++;
+                } else {
+                    task.file->failed = true;
+                    if (task.join || --task.file->chunks_left == 0) {
+                        failures += FinishFile(task.file) ? 0 : 1;
+                    }
+                }
+                continue;
+            }
+
+            BatchFile_t *file = QueuePop(&queue);
+            if (!file) {
+                break;
+            }
+            if (!PrepareSplit(file, options)) {
+                failures += file->failed;
+                if (file->failed) {
+                    METRICS_ADD(files_failed, 1);
+                }
+                FileFree(file);
+                continue;
+            }
+            file->chunks_left = 1;
+            if (StartJob(&jobs[i], file, NULL, options)) {
+                running++;
+            } else {
+                file->failed = true;
+                failures += FinishFile(file) ? 0 : 1;
+            }
+        }
+
+        // Workers left idle take over half of the input left to a large conversion
+        if (!victim && running < jobs_count) {
+            victim = RequestSplit(jobs, jobs_count);
+        }
+        if (victim && !SplitPending(victim, &tasks, &tasks_count, false, options->quiet)) {
+            victim = NULL;
+            continue;
+        }
+
+        if (running == 0 && queue.count == 0 && tasks_count == 0 && !read_stdin) {
+            break;
+        }
+
+        if (read_stdin) {
+            // Keep reading input names while conversions run, so that the queue depth is visible
+            struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+            if (poll(&pfd, 1, victim ? SPLIT_POLL_MS : running ? STDIN_POLL_MS : -1) > 0 &&
+                !ReadInputName(&queue)) {
+                read_stdin = false;
+            }
+        } else if (victim) {
+            poll(NULL, 0, SPLIT_POLL_MS);
+        } else if (running) {
+            int status;
+            pid_t pid = waitpid(-1, &status, 0);
+            if (pid > 0) {
+                failures += FinishJob(jobs, jobs_count, pid, status, &victim, &tasks, &tasks_count, options->quiet);
+                running--;
+            }
+        }
+
+        int status;
+        pid_t pid;
+        while (running && (pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            failures += FinishJob(jobs, jobs_count, pid, status, &victim, &tasks, &tasks_count, options->quiet);
+            running--;
+        }
+    }
+
+    for (size_t i = 0; i < queue.devices_count; i++) {
+        free(queue.devices[i]->items);
+        free(queue.devices[i]);
+    }
+    free(queue.devices);
+    free(tasks);
+    munmap(splits, jobs_count * sizeof(BatchSplit_t));
+    free(jobs);
+    return failures;
+}
@@ -0,0 +1,30 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "convert.h"
+
+// Converts every input in a process of its own, running up to jobs conversions at the same time. Output names are
+// generated from input ones. An input named "-" reads further input names from standard input, one per line, until
+// end of file, which keeps the converter running as a service. At most rotational_jobs conversions read from the same
+// rotational disk, and other_jobs from the same other device. Inputs on a rotational disk are taken in the order of
+// their location on it if physical_order is set, rather than largest first. Returns the number of failed conversions.
+int RunBatch(char **inputs, int inputs_count, int jobs, int rotational_jobs, int other_jobs, bool physical_order,
+             const ConvertOptions_t *options);
+
+#endif
@@ -0,0 +1,653 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Times the hot paths of the converter in isolation, on copies of the sample clips held in memory so that disk speed
+// and the page cache don't blur the results: record header decoding, ReadToBuffer, NAL unit classification, the
+// first pass estimating rates, and muxing into an output that discards everything.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <libavformat/avformat.h>
+#include "hxscan.h"
+#include "convert.h"
+#include "fdsink.h"
+#include "nal.h"
+#include "metrics.h"
+
+#define BENCH_WARMUP        2
+#define BENCH_ITERATIONS    20
+#define BENCH_MAX_INPUTS    32
+#define BENCH_CONVERT_ITERATIONS    5
+#define BENCH_THROUGHPUT_TOLERANCE  0.25    // throughput is noisy on shared machines
+#define BENCH_RSS_TOLERANCE         0.10
+#define BENCH_SKIPPED               77      // exit status when limits are yet to be measured, which ctest reports
+
+// A packet of the clip as ConvertFile would write it, parameter sets glued to their key frame
+typedef struct BenchPacket_t {
+    size_t offset;          // in the packets buffer of the input
+    size_t size;
+    int64_t pts;            // ms for video, samples for audio
+    int stream_index;
+    bool key;
+} BenchPacket_t;
+
+// A payload record, pointing into the clip
+typedef struct BenchRecord_t {
+    const uint8_t *data;
+    size_t length;
+    bool video;
+} BenchRecord_t;
+
+typedef struct BenchInput_t {
+    char *name;
+    uint8_t *data;
+    size_t size;
+    HXStreamInfo_t info;
+    BenchRecord_t *records;
+    size_t records_count;
+    uint8_t *packets_data;
+    BenchPacket_t *packets;
+    size_t packets_count;
+} BenchInput_t;
+
+// Result of converting a clip to a format
+typedef struct BenchMeasure_t {
+    double throughput;      // MB of input per second
+    long peak_rss;          // KB
+} BenchMeasure_t;
+
+typedef void (*BenchFunction_t)(const BenchInput_t *input);
+
+typedef struct Bench_t {
+    const char *name;
+    BenchFunction_t function;
+} Bench_t;
+
+static volatile uint64_t bench_sink; // results are stored here so that the compiler doesn't drop the work
+
+static double Now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+static void *Allocate(size_t size) {
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        fprintf(stderr, "Cannot allocate memory, aborting.\n");
+        exit(1);
+    }
+    return p;
+}
+
+static FILE *OpenMemory(const BenchInput_t *input) {
+    FILE *fp = fmemopen(input->data, input->size, "rb");
+    if (!fp) {
+        fprintf(stderr, "Cannot open %s in memory, aborting.\n", input->name);
+        exit(1);
+    }
+    return fp;
+}
+
+// File name part of a path
+static const char *Basename(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// Walks the record headers of the clip in memory, as check does
+static void BenchHeaderDecode(const BenchInput_t *input) {
+    HXFrame_t frame;
+    uint64_t count = 0;
+    size_t offset = 0, header_size;
+    while ((header_size = HXParseFrame(input->data + offset, input->size - offset, &frame)) > 0) {
+        if (frame.header == HXFI) {
+            break;
+        }
+        offset += header_size + (size_t) HXPayloadLength(&frame);
+        count += frame.header;
+        if (offset > input->size) {
+            break;
+        }
+    }
+    bench_sink += count;
+}
+
+// Same walk through stdio, seeking past payloads, as the first pass does
+static void BenchHeaderRead(const BenchInput_t *input) {
+    FILE *fp = OpenMemory(input);
+    HXFrame_t frame;
+    uint64_t count = 0;
+    while (HXReadFrame(fp, &frame) && frame.header != HXFI && HXSkipPayload(fp, &frame)) {
+        count += frame.header;
+    }
+    fclose(fp);
+    bench_sink += count;
+}
+
+// Reads every payload with ReadToBuffer, starting from an empty buffer, so that growing it is part of the time
+static void BenchReadToBuffer(const BenchInput_t *input) {
+    FILE *fp = OpenMemory(input);
+    uint8_t *buffer = NULL;
+    size_t buffer_size = 0;
+    HXFrame_t frame;
+    uint64_t count = 0;
+    while (HXReadFrame(fp, &frame) && frame.header != HXFI) {
+        size_t length = (size_t) HXPayloadLength(&frame);
+        if (frame.header == HXVF || frame.header == HXAF) {
+            count += ReadToBuffer(fp, &buffer, 0, length, &buffer_size, 0);
+        } else if (!HXSkipPayload(fp, &frame)) {
+            break;
+        }
+    }
+    free(buffer);
+    MetricsBufferResize(-(long) buffer_size);
+    fclose(fp);
+    bench_sink += count;
+}
+
+static void BenchNalClassify(const BenchInput_t *input) {
+    bool hevc = input->info.video_header == HXVT;
+    uint64_t count = 0;
+    for (size_t i = 0; i < input->records_count; i++) {
+        const BenchRecord_t *record = &input->records[i];
+        if (record->video) {
+            count += NalIsParameterSet(hevc, NalUnitType(hevc, record->data, record->length));
+        }
+    }
+    bench_sink += count;
+}
+
+static void BenchScanStream(const BenchInput_t *input) {
+    FILE *fp = OpenMemory(input);
+    HXStreamInfo_t info;
+    if (!HXScanStream(fp, &info, NULL, NULL)) {
+        exit(1);
+    }
+    fclose(fp);
+    bench_sink += (uint64_t) info.video_packets_count;
+}
+
+// Muxes every packet to Matroska through an FdSink with an empty range, which discards the output
+static void BenchMux(const BenchInput_t *input) {
+    AVFormatContext *format_ctx;
+    if (avformat_alloc_output_context2(&format_ctx, NULL, "matroska", NULL) < 0) {
+        exit(1);
+    }
+    const HXStreamInfo_t *info = &input->info;
+    int audio_sample_rate = info->audio_avg_sample_rate > 0 ? HXNominalSampleRate(info->audio_avg_sample_rate) : 0;
+    if (!InitAVStreams(format_ctx, info->video_w, info->video_h,
+                       info->video_header == HXVT ? AV_CODEC_ID_H265 : AV_CODEC_ID_H264, info->video_avg_frame_rate,
+                       (long) info->video_packets_count, audio_sample_rate, NULL, NULL)) {
+        exit(1);
+    }
+    FdSink_t sink = {.fd = -1, .range_start = INT64_MAX, .range_end = -1};
+    if (!(format_ctx->pb = FdSinkOpen(&sink)) || avformat_write_header(format_ctx, NULL) < 0) {
+        exit(1);
+    }
+
+    AVPacket packet;
+    av_init_packet(&packet);
+    for (size_t i = 0; i < input->packets_count; i++) {
+        const BenchPacket_t *p = &input->packets[i];
+        if (p->stream_index == 1 && audio_sample_rate <= 0) {
+            continue;
+        }
+        packet.data = input->packets_data + p->offset;
+        packet.size = (int) p->size;
+        packet.stream_index = p->stream_index;
+        packet.pts = packet.dts = p->pts;
+        packet.duration = p->stream_index == 1 ? (int64_t) p->size : 0;
+        packet.flags = p->key ? AV_PKT_FLAG_KEY : 0;
+        av_packet_rescale_ts(&packet, (AVRational) {1, p->stream_index == 1 ? audio_sample_rate : TIMEBASE_MS},
+                             format_ctx->streams[p->stream_index]->time_base);
+        if (av_interleaved_write_frame(format_ctx, &packet) < 0) {
+            fprintf(stderr, "Cannot mux %s, aborting.\n", input->name);
+            exit(1);
+        }
+    }
+    av_write_trailer(format_ctx);
+    FdSinkClose(&format_ctx->pb);
+    avformat_free_context(format_ctx);
+    bench_sink += (uint64_t) sink.position;
+}
+
+static const Bench_t benches[] = {
+        {"header_decode", BenchHeaderDecode},
+        {"header_read", BenchHeaderRead},
+        {"read_to_buffer", BenchReadToBuffer},
+        {"nal_classify", BenchNalClassify},
+        {"scan_stream", BenchScanStream},
+        {"mux_null", BenchMux},
+};
+
+// Formats of the conversions measured for a new baseline
+static const char *baseline_formats[] = {"matroska", "mp4", "mpegts"};
+
+// Loads a clip and lists its payloads and packets, which is not timed
+static void LoadInput(BenchInput_t *input, const char *filename) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp || fseeko(fp, 0, SEEK_END) < 0) {
+        fprintf(stderr, "Cannot open %s for reading.\n", filename);
+        exit(1);
+    }
+    input->name = strdup(Basename(filename));
+    input->size = (size_t) ftello(fp);
+    input->data = Allocate(input->size);
+    rewind(fp);
+    if (fread(input->data, 1, input->size, fp) != input->size) {
+        fprintf(stderr, "Cannot read %s.\n", filename);
+        exit(1);
+    }
+    rewind(fp);
+    if (!HXScanStream(fp, &input->info, NULL, NULL)) {
+        exit(1);
+    }
+    fclose(fp);
+
+    // Records, and packets: as many as there are records at most, and no larger than the clip altogether
+    HXFrame_t frame;
+    size_t offset = 0, header_size, records_size = 1024, pending = 0;
+    bool hevc = input->info.video_header == HXVT;
+    int64_t audio_samples = 0;
+    input->records = Allocate(records_size * sizeof(BenchRecord_t));
+    input->packets = Allocate(records_size * sizeof(BenchPacket_t));
+    input->packets_data = Allocate(input->size);
+    size_t packets_data_length = 0;
+    while ((header_size = HXParseFrame(input->data + offset, input->size - offset, &frame)) > 0 &&
+           frame.header != HXFI) {
+        size_t length = (size_t) HXPayloadLength(&frame);
+        const uint8_t *payload = input->data + offset + header_size;
+        offset += header_size + length;
+        if (offset > input->size) {
+            break;
+        }
+        if (frame.header != HXVF && frame.header != HXAF) {
+            continue;
+        }
+
+        if (input->records_count == records_size) {
+            records_size *= 2;
+            if (!(input->records = realloc(input->records, records_size * sizeof(BenchRecord_t))) ||
+                !(input->packets = realloc(input->packets, records_size * sizeof(BenchPacket_t)))) {
+                fprintf(stderr, "Cannot allocate memory, aborting.\n");
+                exit(1);
+            }
+        }
+        bool video = frame.header == HXVF;
+        input->records[input->records_count++] = (BenchRecord_t) {payload, length, video};
+
+        memcpy(input->packets_data + packets_data_length, payload, length);
+        packets_data_length += length;
+        if (video && NalIsParameterSet(hevc, NalUnitType(hevc, payload, length))) {
+            pending += length;
+            continue;
+        }
+        BenchPacket_t *packet = &input->packets[input->packets_count++];
+        packet->offset = packets_data_length - length - (video ? pending : 0);
+        packet->size = length + (video ? pending : 0);
+        packet->stream_index = video ? 0 : 1;
+        packet->key = !video || frame.data.hxvf.type == HXVF_TYPE_I;
+        if (video) {
+            packet->pts = HXElapsed(frame.data.hxvf.timestamp, (uint32_t) input->info.video_ts_initial);
+            pending = 0;
+        } else {
+            packet->pts = audio_samples;
+            audio_samples += (int64_t) length;
+        }
+    }
+}
+
+static bool IsClip(const char *name) {
+    const char *extension = strrchr(name, '.');
+    return extension && (strcmp(extension, ".264") == 0 || strcmp(extension, ".265") == 0);
+}
+
+static int CompareDouble(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double Median(const double *sorted, int count) {
+    return count % 2 ? sorted[count / 2] : (sorted[count / 2 - 1] + sorted[count / 2]) / 2;
+}
+
+// Times iterations runs of a bench, after a few untimed ones, and prints the distribution of their durations
+static void RunBench(const Bench_t *bench, const BenchInput_t *input, int iterations) {
+    double *times = Allocate(iterations * sizeof(double));
+    for (int i = 0; i < BENCH_WARMUP; i++) {
+        bench->function(input);
+    }
+    double sum = 0;
+    for (int i = 0; i < iterations; i++) {
+        double start = Now();
+        bench->function(input);
+        times[i] = Now() - start;
+        sum += times[i];
+    }
+    qsort(times, iterations, sizeof(double), CompareDouble);
+
+    double mean = sum / iterations, variance = 0;
+    for (int i = 0; i < iterations; i++) {
+        variance += (times[i] - mean) * (times[i] - mean);
+    }
+    double stddev = iterations > 1 ? sqrt(variance / (iterations - 1)) : 0;
+    double median = Median(times, iterations);
+    double p90 = times[(int) ceil(0.9 * iterations) - 1];
+    printf("%-16s %-28s %10.3f %10.3f %10.3f %10.3f %10.3f %9.1f\n", bench->name, input->name, times[0] * 1e3,
+           median * 1e3, mean * 1e3, p90 * 1e3, stddev * 1e3, (double) input->size / median / 1e6);
+    free(times);
+}
+
+// Converts filename to format_name in a process of its own, iterations times, measuring the throughput in MB of input
+// per second at the median time and the largest peak memory of the conversions in KB
+static void MeasureConversion(const char *filename, const char *format_name, const char *out_dir, int iterations,
+                              BenchMeasure_t *measure) {
+    struct stat st;
+    if (stat(filename, &st) < 0) {
+        fprintf(stderr, "Cannot open %s for reading.\n", filename);
+        exit(1);
+    }
+    char out_filename[PATH_MAX];
+    snprintf(out_filename, sizeof(out_filename), "%s/%s", out_dir, format_name);
+
+    double *times = Allocate(iterations * sizeof(double));
+    measure->peak_rss = 0;
+    for (int i = 0; i < iterations; i++) {
+        fflush(NULL);
+        double start = Now();
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "Cannot fork, aborting.\n");
+            exit(1);
+        }
+        if (pid == 0) { // a fresh image, so that nothing of this process counts in the peak memory of the conversion
+            execl("/proc/self/exe", "ipcam26Xbench", "-x", format_name, filename, out_filename, (char *) NULL);
+            fprintf(stderr, "Cannot run a conversion, aborting.\n");
+            _exit(1);
+        }
+        int status;
+        struct rusage usage;
+        if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "Converting %s to %s failed.\n", filename, format_name);
+            exit(1);
+        }
+        times[i] = Now() - start;
+        if (usage.ru_maxrss > measure->peak_rss) {
+            measure->peak_rss = usage.ru_maxrss;
+        }
+        unlink(out_filename);
+    }
+    qsort(times, iterations, sizeof(double), CompareDouble);
+    measure->throughput = (double) st.st_size / Median(times, iterations) / 1e6;
+    free(times);
+}
+
+// Measures the conversion of every input to every format and writes the results as a new baseline
+static void WriteBaseline(const char *baseline_filename, char **inputs, int inputs_count, const char *out_dir,
+                          int iterations) {
+    FILE *fp = fopen(baseline_filename, "w");
+    if (!fp) {
+        fprintf(stderr, "Cannot open %s for writing.\n", baseline_filename);
+        exit(1);
+    }
+    fprintf(fp, "# Conversion throughput in MB of input per second and peak RSS in KB, measured by ipcam26Xbench -w.\n"
+                "# A limit of 0 is not checked, and a check with both limits at 0 is reported as skipped.\n"
+                "# Limits are to be measured on the machine releases are validated on, with\n"
+                "#   ipcam26Xbench -w perf_baseline.txt test_videos\n"
+                "# clip format throughput peak_rss\n");
+    for (int i = 0; i < inputs_count; i++) {
+        for (size_t f = 0; f < sizeof(baseline_formats) / sizeof(baseline_formats[0]); f++) {
+            BenchMeasure_t measure;
+            MeasureConversion(inputs[i], baseline_formats[f], out_dir, iterations, &measure);
+            fprintf(fp, "%s %s %.1f %ld\n", Basename(inputs[i]), baseline_formats[f], measure.throughput,
+                    measure.peak_rss);
+            printf("%-28s %-10s %9.1f MB/s %9ld KB\n", Basename(inputs[i]), baseline_formats[f], measure.throughput,
+                   measure.peak_rss);
+        }
+    }
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "Cannot write %s.\n", baseline_filename);
+        exit(1);
+    }
+}
+
+// Measures the conversions listed in the baseline for the inputs and compares them with it. Returns the exit status:
+// 1 if any is slower, or uses more memory, than the baseline allows, else BENCH_SKIPPED if any has no limits yet.
+static int CheckBaseline(const char *baseline_filename, char **inputs, int inputs_count, const char *out_dir,
+                          int iterations, double throughput_tolerance, double rss_tolerance) {
+    FILE *fp = fopen(baseline_filename, "r");
+    if (!fp) {
+        fprintf(stderr, "Cannot open %s for reading.\n", baseline_filename);
+        exit(1);
+    }
+    bool passed = true, unmeasured = false;
+    for (int i = 0; i < inputs_count; i++) {
+        char line[512], clip[256], format_name[64];
+        int rows = 0;
+        rewind(fp);
+        while (fgets(line, sizeof(line), fp)) {
+            BenchMeasure_t baseline, measure;
+            if (line[0] == '#' || sscanf(line, "%255s %63s %lf %ld", clip, format_name, &baseline.throughput,
+                                         &baseline.peak_rss) != 4 || strcmp(clip, Basename(inputs[i])) != 0) {
+                continue;
+            }
+            rows++;
+            MeasureConversion(inputs[i], format_name, out_dir, iterations, &measure);
+            bool slower = baseline.throughput > 0 &&
+                          measure.throughput < baseline.throughput * (1 - throughput_tolerance);
+            bool larger = baseline.peak_rss > 0 && measure.peak_rss > baseline.peak_rss * (1 + rss_tolerance);
+            bool limited = baseline.throughput > 0 || baseline.peak_rss > 0;
+            printf("%-28s %-10s %9.1f MB/s (baseline %.1f) %9ld KB (baseline %ld) %s\n", clip, format_name,
+                   measure.throughput, baseline.throughput, measure.peak_rss, baseline.peak_rss,
+                   slower || larger ? "REGRESSION" : limited ? "ok" : "not measured");
+            passed &= !slower && !larger;
+            unmeasured |= !limited;
+        }
+        if (rows == 0) {
+            fprintf(stderr, "%s has no baseline in %s.\n", Basename(inputs[i]), baseline_filename);
+            passed = false;
+        }
+    }
+    fclose(fp);
+    if (unmeasured && passed) {
+        fprintf(stderr, "Limits of %s are yet to be measured, with -w on the machine releases are validated on.\n",
+                baseline_filename);
+    }
+    return !passed ? 1 : unmeasured ? BENCH_SKIPPED : 0;
+}
+
+static void ShowHelp(char *command, int exitcode) {
+    fprintf(stderr, "Times the parsing and muxing hot paths on clips loaded in memory, or whole conversions against a "
+                    "baseline.\n");
+    fprintf(stderr, "Usage: %s [-n iterations] [-b bench] directory|input.26x...\n", basename(command));
+    fprintf(stderr, "       %s -c|-w baseline [-n iterations] [-t tolerance] [-m tolerance] directory|input.26x...\n",
+            basename(command));
+    fprintf(stderr, "  -n iterations   Timed runs of each bench on each input (default: %d, %d for conversions)\n",
+            BENCH_ITERATIONS, BENCH_CONVERT_ITERATIONS);
+    fprintf(stderr, "  -b bench        Only run bench:");
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        fprintf(stderr, " %s", benches[i].name);
+    }
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -c baseline     Convert the inputs as listed in baseline, fail if any is slower or larger\n");
+    fprintf(stderr, "  -w baseline     Convert the inputs to the usual formats and write the results to baseline\n");
+    fprintf(stderr, "  -t tolerance    Fraction of the baseline throughput that may be lost (default: %.2f)\n",
+            BENCH_THROUGHPUT_TOLERANCE);
+    fprintf(stderr, "  -m tolerance    Fraction of the baseline peak memory that may be exceeded (default: %.2f)\n",
+            BENCH_RSS_TOLERANCE);
+    fprintf(stderr, "Times are in ms, throughput in MB of input per second at the median time.\n");
+    exit(exitcode);
+}
+
+static int CompareName(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static void AddInput(char **inputs, int *count, const char *filename) {
+    if (*count == BENCH_MAX_INPUTS) {
+        fprintf(stderr, "Too many inputs, only the first %d are used.\n", BENCH_MAX_INPUTS);
+        return;
+    }
+    if (!(inputs[(*count)++] = strdup(filename))) {
+        exit(1);
+    }
+}
+
+// Adds the .264 and .265 files of a directory, sorted by name, or a single file to the inputs
+static void AddInputs(const char *path, char **inputs, int *count) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        AddInput(inputs, count, path);
+        return;
+    }
+    int first = *count;
+    struct dirent *entry;
+    char filename[PATH_MAX];
+    while ((entry = readdir(dir))) {
+        if (IsClip(entry->d_name)) {
+            snprintf(filename, sizeof(filename), "%s/%s", path, entry->d_name);
+            AddInput(inputs, count, filename);
+        }
+    }
+    closedir(dir);
+    qsort(&inputs[first], *count - first, sizeof(char *), CompareName);
+}
+
+int main(int argc, char *argv[]) {
+    int opt, iterations = 0;
+    const char *only = NULL, *check_baseline = NULL, *write_baseline = NULL, *convert_format = NULL;
+    double throughput_tolerance = BENCH_THROUGHPUT_TOLERANCE, rss_tolerance = BENCH_RSS_TOLERANCE;
+    while ((opt = getopt(argc, argv, "n:b:c:w:t:m:x:")) != -1) {
+        switch (opt) {
+            case 'n':
+                if ((iterations = atoi(optarg)) < 1) {
+                    ShowHelp(argv[0], EXIT_FAILURE);
+                }
+                break;
+            case 'b':
+                only = optarg;
+                break;
+            case 'c':
+                check_baseline = optarg;
+                break;
+            case 'w':
+                write_baseline = optarg;
+                break;
+            case 't':
+                if ((throughput_tolerance = atof(optarg)) < 0 || throughput_tolerance >= 1) {
+                    ShowHelp(argv[0], EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                if ((rss_tolerance = atof(optarg)) < 0) {
+                    ShowHelp(argv[0], EXIT_FAILURE);
+                }
+                break;
+            case 'x': // a single conversion measured by MeasureConversion, not meant to be used directly
+                convert_format = optarg;
+                break;
+            default:
+                ShowHelp(argv[0], EXIT_FAILURE);
+        }
+    }
+    if (convert_format && argc - optind == 2) {
+        ConvertOptions_t options = {.quiet = true, .overwrite_existing = true, .format_name = convert_format};
+        return ConvertFile(argv[optind], argv[optind + 1], &options);
+    }
+    if (optind >= argc || convert_format || (check_baseline && write_baseline)) {
+        ShowHelp(argv[0], EXIT_FAILURE);
+    }
+
+    av_log_set_level(AV_LOG_ERROR);
+    char *inputs[BENCH_MAX_INPUTS];
+    int inputs_count = 0;
+    for (int i = optind; i < argc; i++) {
+        AddInputs(argv[i], inputs, &inputs_count);
+    }
+    if (inputs_count == 0) {
+        fprintf(stderr, "No input clips found.\n");
+        return 1;
+    }
+
+    // Whole conversions, each in a process of its own so that clips loaded for the benches don't count in its memory
+    if (check_baseline || write_baseline) {
+        char out_dir[] = "/tmp/ipcam26XbenchXXXXXX";
+        if (!mkdtemp(out_dir)) {
+            fprintf(stderr, "Cannot create a temporary directory, aborting.\n");
+            return 1;
+        }
+        iterations = iterations ? iterations : BENCH_CONVERT_ITERATIONS;
+        int status = 0;
+        if (write_baseline) {
+            WriteBaseline(write_baseline, inputs, inputs_count, out_dir, iterations);
+        } else {
+            status = CheckBaseline(check_baseline, inputs, inputs_count, out_dir, iterations, throughput_tolerance,
+                                   rss_tolerance);
+        }
+        rmdir(out_dir);
+        for (int i = 0; i < inputs_count; i++) {
+            free(inputs[i]);
+        }
+        return status;
+    }
+
+    iterations = iterations ? iterations : BENCH_ITERATIONS;
+    BenchInput_t loaded[BENCH_MAX_INPUTS];
+    memset(loaded, 0, sizeof(loaded));
+    for (int i = 0; i < inputs_count; i++) {
+        LoadInput(&loaded[i], inputs[i]);
+        free(inputs[i]);
+    }
+
+    printf("%-16s %-28s %10s %10s %10s %10s %10s %9s\n", "bench", "input", "min", "median", "mean", "p90", "stddev",
+           "MB/s");
+    bool found = false;
+    for (size_t b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+        if (only && strcmp(only, benches[b].name) != 0) {
+            continue;
+        }
+        found = true;
+        for (int i = 0; i < inputs_count; i++) {
+            RunBench(&benches[b], &loaded[i], iterations);
+        }
+    }
+    if (!found) {
+        ShowHelp(argv[0], EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < inputs_count; i++) {
+        free(loaded[i].name);
+        free(loaded[i].data);
+        free(loaded[i].records);
+        free(loaded[i].packets);
+        free(loaded[i].packets_data);
+    }
+    return 0;
+}
@@ -0,0 +1,310 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "check.h"
+#include "hxscan.h"
+#include "workers.h"
+
+#define CHECK_MESSAGE_SIZE      256
+#define CHECK_DURATION_SLACK_MS 1000    // trailer duration may be off by the length of the last frame
+#define HXFI_INDEX_OFFSET       16      // key frame index follows header, length, duration and an unknown field
+
+// Location of a key frame record, and its time relative to the first video record, as the HXFI index stores it
+typedef struct CheckKey_t {
+    uint64_t offset;
+    uint32_t time;
+} CheckKey_t;
+
+typedef struct CheckResult_t {
+    long errors;
+    char message[CHECK_MESSAGE_SIZE];   // first error found
+    long video_records, audio_records, key_records;
+    long duration_ms;
+} CheckResult_t;
+
+typedef struct CheckQueue_t {
+    char **inputs;
+    int inputs_count;
+    int next;           // index of the next input to check, taken atomically by workers
+    int failures;
+    bool quiet;
+    pthread_mutex_t output_lock;
+} CheckQueue_t;
+
+// Counts an error, keeping the description of the first one
+static void CheckError(CheckResult_t *result, size_t offset, const char *format, ...) {
+    if (result->errors++ > 0) {
+        return;
+    }
+
+    int length = snprintf(result->message, sizeof(result->message), "offset %zu: ", offset);
+    va_list args;
+    va_start(args, format);
+    vsnprintf(result->message + length, sizeof(result->message) - length, format, args);
+    va_end(args);
+}
+
+// Each video record holds a single NAL unit, which must begin with a start code and a valid NAL unit header
+static bool CheckNalUnit(bool hevc, const uint8_t *payload, size_t length) {
+    size_t start_code_length;
+    if (length >= 4 && payload[0] == 0 && payload[1] == 0 && payload[2] == 0 && payload[3] == 1) {
+        start_code_length = 4;
+    } else if (length >= 3 && payload[0] == 0 && payload[1] == 0 && payload[2] == 1) {
+        start_code_length = 3;
+    } else {
+        return false;
+    }
+
+    const uint8_t *header = payload + start_code_length;
+    size_t header_length = hevc ? 2 : 1;
+    if (length < start_code_length + header_length || (header[0] & 0x80)) { // forbidden zero bit
+        return false;
+    }
+    return !hevc || (header[1] & 0x07) != 0; // nuh_temporal_id_plus1
+}
+
+static bool AppendKey(CheckKey_t **keys, size_t *keys_count, size_t *keys_size, uint64_t offset, uint32_t time) {
+    if (*keys_count == *keys_size) {
+        *keys_size = *keys_size ? *keys_size * 2 : 256;
+        CheckKey_t *resized = realloc(*keys, *keys_size * sizeof(CheckKey_t));
+        if (resized == NULL) {
+            return false;
+        }
+        *keys = resized;
+    }
+    (*keys)[*keys_count].offset = offset;
+    (*keys)[(*keys_count)++].time = time;
+    return true;
+}
+
+// Cameras index every record of a key frame, parameter sets included, in file order until the index is full
+static void CheckIndex(const uint8_t *data, size_t hxfi_offset, uint32_t index_length, const CheckKey_t *keys,
+                       size_t keys_count, CheckResult_t *result) {
+    const uint8_t *index = data + hxfi_offset + HXFI_INDEX_OFFSET;
+    size_t entries_count = index_length / (2 * sizeof(uint32_t)), entry, key = 0;
+
+    for (entry = 0; entry < entries_count; entry++) {
+        uint32_t fields[2];
+        memcpy(fields, index + entry * sizeof(fields), sizeof(fields));
+        if (fields[0] == 0 && fields[1] == 0) {
+            break;
+        }
+        if (key == keys_count) {
+            CheckError(result, hxfi_offset, "index entry %zu points to %u, past the last key frame record", entry,
+                       fields[0]);
+            return;
+        }
+        if (fields[0] != keys[key].offset || fields[1] != keys[key].time) {
+            CheckError(result, hxfi_offset, "index entry %zu is %u at %u ms, key frame record is %lu at %u ms", entry,
+                       fields[0], fields[1], (unsigned long) keys[key].offset, keys[key].time);
+            return;
+        }
+        key++;
+    }
+
+    // A full index can't hold every key frame, neither can a 32 bit offset beyond 4 GiB
+    if (key < keys_count && entry + 1 < entries_count && keys[key].offset <= UINT32_MAX) {
+        CheckError(result, hxfi_offset, "%zu key frame records missing from index", keys_count - key);
+    }
+}
+
+static bool CheckFile(const char *in_filename, CheckResult_t *result) {
+    memset(result, 0, sizeof(CheckResult_t));
+
+    int fd = open(in_filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        snprintf(result->message, sizeof(result->message), "cannot read file");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    if (st.st_size == 0) {
+        snprintf(result->message, sizeof(result->message), "empty file");
+        close(fd);
+        return false;
+    }
+
+    size_t size = (size_t) st.st_size;
+    uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        snprintf(result->message, sizeof(result->message), "cannot map file in memory");
+        return false;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    CheckKey_t *keys = NULL;
+    size_t keys_count = 0, keys_size = 0;
+    uint32_t video_header = 0, video_ts_first = 0, video_ts_prev = 0, audio_ts_prev = 0;
+    size_t offset = 0;
+    bool hxfi_detected = false, framing_lost = false;
+    HXFrame_t hx_frame;
+
+    while (!hxfi_detected && !framing_lost && offset < size) {
+        size_t record_offset = offset;
+        size_t frame_size = HXParseFrame(data + offset, size - offset, &hx_frame);
+        if (frame_size == 0) {
+            CheckError(result, record_offset, "truncated record header");
+            break;
+        }
+        offset += frame_size;
+
+        // Records can't be told apart from their payload, so nothing past a broken one can be trusted
+        size_t payload_length = (size_t) HXPayloadLength(&hx_frame);
+        if (payload_length > size - offset) {
+            CheckError(result, record_offset, "record length %zu goes past end of file", payload_length);
+            break;
+        }
+
+        const uint8_t *payload = data + offset;
+        switch (hx_frame.header) {
+            case HXVS:
+            case HXVT:
+                if (video_header && video_header != hx_frame.header) {
+                    CheckError(result, record_offset, "video codec changes within the file");
+                }
+                if (hx_frame.data.hxvs.width == 0 || hx_frame.data.hxvs.height == 0) {
+                    CheckError(result, record_offset, "invalid video dimensions %u x %u", hx_frame.data.hxvs.width,
+                               hx_frame.data.hxvs.height);
+                }
+                video_header = hx_frame.header;
+                break;
+
+            case HXVF:
+                if (video_header == 0) {
+                    CheckError(result, record_offset, "video record before the video header");
+                }
+                if (hx_frame.data.hxvf.type != HXVF_TYPE_I && hx_frame.data.hxvf.type != HXVF_TYPE_P) {
+                    CheckError(result, record_offset, "unknown video frame type %u", hx_frame.data.hxvf.type);
+                }
+                if (!CheckNalUnit(video_header == HXVT, payload, payload_length)) {
+                    CheckError(result, record_offset, "video record doesn't start with a valid NAL unit");
+                }
+
+                if (result->video_records == 0) {
+                    video_ts_first = hx_frame.data.hxvf.timestamp;
+                } else if (HXElapsed(hx_frame.data.hxvf.timestamp, video_ts_prev) < 0) {
+                    CheckError(result, record_offset, "video timestamp goes back %ld ms",
+                               -HXElapsed(hx_frame.data.hxvf.timestamp, video_ts_prev));
+                }
+                video_ts_prev = hx_frame.data.hxvf.timestamp;
+                result->video_records++;
+
+                if (hx_frame.data.hxvf.type == HXVF_TYPE_I) {
+                    result->key_records++;
+                    if (!AppendKey(&keys, &keys_count, &keys_size, record_offset,
+                                   hx_frame.data.hxvf.timestamp - video_ts_first)) {
+                        fprintf(stderr, "Cannot allocate memory, aborting.\n");
+                        exit(1);
+                    }
+                }
+                break;
+
+            case HXAF:
+                if (hx_frame.data.hxaf.length < 4) {
+                    CheckError(result, record_offset, "audio record length %u is too short",
+                               hx_frame.data.hxaf.length);
+                }
+                if (result->audio_records > 0 && HXElapsed(hx_frame.data.hxaf.timestamp, audio_ts_prev) < 0) {
+                    CheckError(result, record_offset, "audio timestamp goes back %ld ms",
+                               -HXElapsed(hx_frame.data.hxaf.timestamp, audio_ts_prev));
+                }
+                audio_ts_prev = hx_frame.data.hxaf.timestamp;
+                result->audio_records++;
+                break;
+
+            case HXFI:
+                hxfi_detected = true;
+                if (hx_frame.data.hxfi.length < 4) {
+                    CheckError(result, record_offset, "trailer length %u is too short", hx_frame.data.hxfi.length);
+                    break;
+                }
+
+                uint32_t duration;
+                memcpy(&duration, hx_frame.data.hxfi.padding, sizeof(duration));
+                result->duration_ms = HXElapsed(video_ts_prev, video_ts_first);
+                if (labs((long) duration - result->duration_ms) > CHECK_DURATION_SLACK_MS) {
+                    CheckError(result, record_offset, "trailer duration %u ms, video lasts %ld ms", duration,
+                               result->duration_ms);
+                }
+                CheckIndex(data, record_offset, hx_frame.data.hxfi.length - 4, keys, keys_count, result);
+                break;
+
+            default:
+                CheckError(result, record_offset, "unknown record header %08x", hx_frame.header);
+                framing_lost = true;
+                break;
+        }
+        offset += payload_length;
+    }
+
+    if (result->errors == 0) {
+        if (!hxfi_detected) {
+            CheckError(result, offset, "no HXFI trailer, file wasn't closed by the camera");
+        } else if (offset < size) {
+            CheckError(result, offset, "%zu bytes of data after the HXFI trailer", size - offset);
+        } else if (result->video_records == 0) {
+            CheckError(result, 0, "no video records");
+        }
+    }
+
+    free(keys);
+    munmap(data, size);
+    return result->errors == 0;
+}
+
+static void *CheckWorker(void *arg) {
+    CheckQueue_t *queue = arg;
+    int i;
+
+    while ((i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED)) < queue->inputs_count) {
+        CheckResult_t result;
+        bool success = CheckFile(queue->inputs[i], &result);
+
+        pthread_mutex_lock(&queue->output_lock);
+        if (success && !queue->quiet) {
+            printf("%s: OK, %ld video and %ld audio records, %ld key frame records, %.1f s\n", queue->inputs[i],
+                   result.video_records, result.audio_records, result.key_records, result.duration_ms / 1000.0);
+        } else if (!success) {
+            queue->failures++;
+            if (result.errors > 1) {
+                printf("%s: FAILED, %s (and %ld more errors)\n", queue->inputs[i], result.message, result.errors - 1);
+            } else {
+                printf("%s: FAILED, %s\n", queue->inputs[i], result.message);
+            }
+        }
+        fflush(stdout);
+        pthread_mutex_unlock(&queue->output_lock);
+    }
+    return NULL;
+}
+
+int RunCheck(char **inputs, int inputs_count, int jobs, bool quiet) {
+    CheckQueue_t queue = {inputs, inputs_count, 0, 0, quiet, PTHREAD_MUTEX_INITIALIZER};
+    RunWorkers(jobs < inputs_count ? jobs : inputs_count, CheckWorker, &queue);
+    return queue.failures;
+}
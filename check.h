@@ -0,0 +1,28 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdbool.h>
+
+// Verifies the structure of camera files without converting them: record headers and lengths, timestamps, NAL unit
+// start codes and the key frame index of the HXFI trailer. Files are checked up to jobs at the same time, and a
+// verdict is printed on standard output for each one, or only for failing ones if quiet is set. Returns the number
+// of files failing the check.
+int RunCheck(char **inputs, int inputs_count, int jobs, bool quiet);
+
+#endif
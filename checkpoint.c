@@ -0,0 +1,109 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "checkpoint.h"
+
+static char *CheckpointPath(const char *out_filename) {
+    size_t length = strlen(out_filename) + sizeof(CHECKPOINT_EXTENSION);
+    char *path = malloc(length);
+    if (path) {
+        snprintf(path, length, "%s%s", out_filename, CHECKPOINT_EXTENSION);
+    }
+    return path;
+}
+
+bool CheckpointLoad(const char *out_filename, const char *in_filename, Checkpoint_t *checkpoint) {
+    struct stat in_st;
+    if (stat(in_filename, &in_st) < 0) {
+        return false;
+    }
+
+    char *path = CheckpointPath(out_filename);
+    if (path == NULL) {
+        return false;
+    }
+    FILE *fp = fopen(path, "rb");
+    free(path);
+    if (fp == NULL) {
+        return false;
+    }
+    bool success = fread(checkpoint, sizeof(Checkpoint_t), 1, fp) == 1;
+    fclose(fp);
+
+    return success && memcmp(checkpoint->magic, CHECKPOINT_MAGIC, sizeof(checkpoint->magic)) == 0 &&
+           checkpoint->version == CHECKPOINT_VERSION && checkpoint->size == sizeof(Checkpoint_t) &&
+           checkpoint->source_size == (uint64_t) in_st.st_size &&
+           checkpoint->source_mtime_sec == in_st.st_mtim.tv_sec &&
+           checkpoint->source_mtime_nsec == in_st.st_mtim.tv_nsec &&
+           checkpoint->input_offset < checkpoint->source_size;
+}
+
+bool CheckpointSave(const char *out_filename, const char *in_filename, Checkpoint_t *checkpoint) {
+    struct stat in_st;
+    if (stat(in_filename, &in_st) < 0) {
+        return false;
+    }
+    memcpy(checkpoint->magic, CHECKPOINT_MAGIC, sizeof(checkpoint->magic));
+    checkpoint->version = CHECKPOINT_VERSION;
+    checkpoint->size = sizeof(Checkpoint_t);
+    checkpoint->source_size = in_st.st_size;
+    checkpoint->source_mtime_sec = in_st.st_mtim.tv_sec;
+    checkpoint->source_mtime_nsec = in_st.st_mtim.tv_nsec;
+
+    char *path = CheckpointPath(out_filename);
+    if (path == NULL) {
+        return false;
+    }
+
+    // Write to a temporary file and rename it, so that a crash never leaves a partial checkpoint behind
+    size_t tmp_length = strlen(path) + 8;
+    char *tmp_path = malloc(tmp_length);
+    if (tmp_path == NULL) {
+        free(path);
+        return false;
+    }
+    snprintf(tmp_path, tmp_length, "%s.XXXXXX", path);
+
+    bool success = false;
+    int fd = mkstemp(tmp_path);
+    if (fd >= 0) {
+        success = write(fd, checkpoint, sizeof(Checkpoint_t)) == (ssize_t) sizeof(Checkpoint_t) && fsync(fd) == 0;
+        success = (close(fd) == 0) && success;
+        if (success) {
+            success = chmod(tmp_path, 0644) == 0 && rename(tmp_path, path) == 0;
+        }
+        if (!success) {
+            unlink(tmp_path);
+        }
+    }
+
+    free(tmp_path);
+    free(path);
+    return success;
+}
+
+void CheckpointRemove(const char *out_filename) {
+    char *path = CheckpointPath(out_filename);
+    if (path) {
+        unlink(path);
+        free(path);
+    }
+}
@@ -0,0 +1,54 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hxscan.h"
+
+#define CHECKPOINT_MAGIC        "HXCKPT\r\n"
+#define CHECKPOINT_VERSION      1
+#define CHECKPOINT_EXTENSION    ".ckpt"
+
+// State of an interrupted conversion at a key frame boundary, saved next to the output as output.ckpt. Everything
+// written before output_offset is complete, everything from input_offset on has still to be converted.
+typedef struct Checkpoint_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;                  // sizeof(Checkpoint_t), guards against layout changes
+    uint64_t source_size;           // input identity, as in the index
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+    HXStreamInfo_t info;            // first pass results, not computed again when resuming
+    uint64_t input_offset;          // first record of the key frame to resume from
+    uint64_t output_offset;         // output size when that key frame was reached
+    uint32_t fragment_index;        // number of the next MP4 fragment
+    uint32_t audio_clock_started;
+    int64_t audio_next_pts;         // audio clock, in samples
+} Checkpoint_t;
+
+// Loads the checkpoint of out_filename, if any, and checks that it was taken while converting in_filename as it is now
+bool CheckpointLoad(const char *out_filename, const char *in_filename, Checkpoint_t *checkpoint);
+
+// Atomically replaces the checkpoint of out_filename. Magic, version, size and input identity are filled in.
+bool CheckpointSave(const char *out_filename, const char *in_filename, Checkpoint_t *checkpoint);
+
+// Removes the checkpoint of out_filename, once the conversion completed
+void CheckpointRemove(const char *out_filename);
+
+#endif
@@ -0,0 +1,36 @@
+# Converts an input above the size batch mode splits conversions from, with two workers allowed on its disk whatever
+# its type so that the idle one takes over a chunk of it, and checks that the joined output starts with the MAGIC
+# bytes of FORMAT.
+# Usage: cmake -DGEN=ipcam26Xgen -DCONVERT=ipcam264convert -DFORMAT=matroska -DMAGIC=1a45dfa3 -DWORK_DIR=dir -P ...
+set(SPLIT_MIN_SIZE 268435456)
+
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+set(input ${WORK_DIR}/large.264)
+execute_process(COMMAND ${GEN} -d 600 -p 30000 ${input} RESULT_VARIABLE result)
+file(SIZE ${input} input_size)
+if (NOT result EQUAL 0 OR input_size LESS SPLIT_MIN_SIZE)
+    message(FATAL_ERROR "Cannot generate an input of at least ${SPLIT_MIN_SIZE} bytes")
+endif ()
+
+execute_process(COMMAND ${CONVERT} -b -j 2 --device-jobs 2,2 -y -f ${FORMAT} ${input} RESULT_VARIABLE result ERROR_VARIABLE log)
+if (NOT result EQUAL 0)
+    message(FATAL_ERROR "Batch conversion failed:\n${log}")
+endif ()
+if (NOT log MATCHES "Splitting conversion")
+    message(FATAL_ERROR "Batch conversion wasn't split:\n${log}")
+endif ()
+
+file(GLOB outputs ${WORK_DIR}/large.*)
+list(REMOVE_ITEM outputs ${input})
+list(LENGTH outputs outputs_count)
+if (NOT outputs_count EQUAL 1)
+    message(FATAL_ERROR "Expected one output, found: ${outputs}")
+endif ()
+string(LENGTH ${MAGIC} magic_length)
+math(EXPR magic_size "${magic_length} / 2")
+file(READ ${outputs} magic LIMIT ${magic_size} HEX)
+if (NOT magic STREQUAL MAGIC)
+    message(FATAL_ERROR "${outputs} starts with ${magic}, not ${MAGIC} as ${FORMAT} output does")
+endif ()
+file(REMOVE_RECURSE ${WORK_DIR})
@@ -0,0 +1,957 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Inspired by https://spitzner.org/kkmoon.html
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <libavutil/opt.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/timestamp.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include "ipcamvideofilefmt.h"
+#include "hxscan.h"
+#include "hxindex.h"
+#include "convert.h"
+#include "metrics.h"
+#include "audioenc.h"
+#include "nal.h"
+#include "fdsink.h"
+#include "checkpoint.h"
+#include "follow.h"
+#include "trace.h"
+#include "session.h"
+
+#define MAX_EXTENSION_LEN   12
+#define AUDIO_DRIFT_MAX_MS  40      // audio is resynced to the camera clock when drifting further than this
+#define PARAM_SETS_MAX_SCAN 64      // records read looking for the parameter sets preceding the first key frame
+#define CHECKPOINT_MS       30000   // camera time between checkpoints of resumable conversions
+#define FOLLOW_SAMPLE_MS    2000    // video scanned to detect rates when following an input still being written
+
+size_t ReadToBuffer(FILE *fp_src, uint8_t **dest, size_t dest_offset, unsigned long length, size_t *dest_size,
+                    size_t max_size) {
+
+    if (length == 0) {
+        return 0;
+    }
+
+    if (max_size && length + dest_offset > max_size) {
+        fprintf(stderr, "Packet of %lu bytes exceeds the %zu bytes buffer allowed by the memory limit, aborting.\n",
+                length + dest_offset, max_size);
+        exit(1);
+    }
+
+    // Grow the buffer if needed. It is never shrunk, so its size settles on the largest packet seen.
+    if (*dest_size < length + dest_offset) {
+        if (dest_offset) { // appending data to a previous read, we need to keep the data
+            *dest = realloc(*dest, length + dest_offset);
+            if (*dest == NULL) {
+                fprintf(stderr, "Cannot re-allocate memory, aborting.\n");
+                exit(1);
+            }
+        } else { // we just need a larger buffer, we can discard existing data if any
+            free(*dest);
+            *dest = malloc(length + dest_offset);
+            if (*dest == NULL) {
+                fprintf(stderr, "Cannot allocate memory, aborting.\n");
+                exit(1);
+            }
+        }
+        MetricsBufferResize((long) (length + dest_offset) - (long) *dest_size);
+        *dest_size = length + dest_offset;
+    }
+
+    return fread(*dest + dest_offset, 1, length, fp_src);
+}
+
+bool EndsWith(const char *str, const char *suffix) {
+    if (!str || !suffix) {
+        return false;
+    }
+    size_t lenstr = strlen(str);
+    size_t lensuffix = strlen(suffix);
+    if (lensuffix > lenstr) {
+        return false;
+    }
+    return strncmp(str + lenstr - lensuffix, suffix, lensuffix) == 0;
+}
+
+bool AudioClockNext(AudioClock_t *clock, long camera_ms, size_t samples, int64_t *pts) {
+    int64_t camera_pts = (int64_t) camera_ms * clock->sample_rate / (int64_t) TIMEBASE_MS;
+    if (!clock->started) {
+        clock->next_pts = camera_pts > 0 ? camera_pts : 0;
+        clock->started = true;
+    }
+
+    int64_t drift_ms = (camera_pts - clock->next_pts) * (int64_t) TIMEBASE_MS / clock->sample_rate;
+    if (drift_ms > AUDIO_DRIFT_MAX_MS) {
+        clock->next_pts = camera_pts; // samples were lost, leave a gap
+        clock->gaps++;
+    } else if (drift_ms < -AUDIO_DRIFT_MAX_MS) {
+        clock->drops++;
+        return false;
+    }
+
+    *pts = clock->next_pts;
+    clock->next_pts += (int64_t) samples;
+    return true;
+}
+
+uint64_t HashBytes(const uint8_t *data, size_t size) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool IsLengthPrefixedFormat(const AVOutputFormat *format) {
+    static const char *names[] = {"mp4", "mov", "3gp", "3g2", "psp", "ipod", "ismv", "f4v"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(format->name, names[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool IsFragmentableFormat(const AVOutputFormat *format) {
+    return IsLengthPrefixedFormat(format) || strcmp(format->name, "matroska") == 0 || strcmp(format->name, "webm") == 0;
+}
+
+uint8_t *ReadParameterSets(FILE *in_file, bool hevc, size_t *size) {
+    off_t start = ftello(in_file);
+    uint8_t *param_sets = NULL;
+    size_t param_sets_size = 0;
+    HXFrame_t hx_frame;
+
+    *size = 0;
+    for (int i = 0; i < PARAM_SETS_MAX_SCAN && HXReadFrame(in_file, &hx_frame); i++) {
+        if (hx_frame.header != HXVF) {
+            if (!HXSkipPayload(in_file, &hx_frame)) {
+                break;
+            }
+            continue;
+        }
+
+        if (ReadToBuffer(in_file, &param_sets, *size, hx_frame.data.hxvf.length, &param_sets_size, 0) <
+            hx_frame.data.hxvf.length) {
+            break;
+        }
+        if (!NalIsParameterSet(hevc, NalUnitType(hevc, param_sets + *size, hx_frame.data.hxvf.length))) {
+            if (*size > 0) {
+                break;
+            }
+            continue; // video starting with P-frames, keep looking
+        }
+        *size += hx_frame.data.hxvf.length;
+    }
+
+    if (fseeko(in_file, start, SEEK_SET) < 0) {
+        fprintf(stderr, "Seek error, aborting.\n");
+        exit(1);
+    }
+    MetricsBufferResize(-(long) param_sets_size); // only needed until extradata is built
+    if (*size == 0) {
+        free(param_sets);
+        return NULL;
+    }
+    return param_sets;
+}
+
+bool SetVideoExtradata(AVFormatContext *format_ctx, int index, bool hevc, FILE *in_file) {
+    size_t param_sets_size, extradata_size = 0;
+    uint8_t *param_sets = ReadParameterSets(in_file, hevc, &param_sets_size);
+    uint8_t *extradata = param_sets;
+    if (IsLengthPrefixedFormat(format_ctx->oformat)) {
+        extradata = param_sets ? NalBuildExtradata(hevc, param_sets, param_sets_size, &extradata_size) : NULL;
+        free(param_sets);
+    } else {
+        extradata_size = param_sets_size;
+    }
+    if (!extradata) {
+        return false;
+    }
+
+    AVCodecParameters *codecpar = format_ctx->streams[index]->codecpar;
+    av_freep(&codecpar->extradata);
+    if (!(codecpar->extradata = av_mallocz(extradata_size + AV_INPUT_BUFFER_PADDING_SIZE))) {
+        fprintf(stderr, "Cannot allocate memory, aborting.\n");
+        exit(1);
+    }
+    memcpy(codecpar->extradata, extradata, extradata_size);
+    codecpar->extradata_size = (int) extradata_size;
+    free(extradata);
+    return true;
+}
+
+void CountRecordHeader(uint32_t header, bool *lost, bool report) {
+    bool known = header == HXVS || header == HXVT || header == HXVF || header == HXAF || header == HXFI;
+    if (known && *lost) {
+        METRICS_ADD(resync_events, 1);
+        *lost = false;
+    } else if (!known) {
+        if (report) {
+            fprintf(stderr, "Unknown audio_frame header: %u\n", header);
+        }
+        METRICS_ADD(unknown_headers, 1);
+        *lost = true;
+    }
+}
+
+void ComputeOrigins(const HXStreamInfo_t *info, int audio_sample_rate, long *video_origin, long *audio_origin) {
+    long video_ts_initial = (long) info->video_ts_initial, audio_ts_initial = (long) info->audio_ts_initial;
+    long av_offset = HXElapsed((uint32_t) audio_ts_initial, (uint32_t) video_ts_initial);
+    *video_origin = video_ts_initial;
+    *audio_origin = audio_ts_initial;
+    if (audio_sample_rate > 0 && labs(av_offset) <= AV_MAX_OFFSET_MS) {
+        *video_origin = *audio_origin = av_offset < 0 ? audio_ts_initial : video_ts_initial;
+    }
+}
+
+bool InitAVStreams(AVFormatContext *format_ctx, int video_w, int video_h, enum AVCodecID video_id,
+                   double video_avg_frame_rate, long video_packets_count, int audio_sample_rate,
+                   const char *audio_codec, AVCodecContext **audio_encoder) {
+    int retval;
+
+    // Video stream. Video codec is only used to generate a valid header, not for actual encoding
+    const AVCodec *v_codec = avcodec_find_encoder(video_id);
+    AVStream *v_stream = avformat_new_stream(format_ctx, v_codec);
+    if (!v_stream) {
+        fprintf(stderr, "Could not allocate stream.\n");
+        return false;
+    }
+
+    AVCodecContext *v_encoder = avcodec_alloc_context3(v_codec);
+    v_encoder->time_base = (AVRational) {1, TIMEBASE_MS}; // Raw stream timestamps are in milliseconds
+    v_encoder->framerate = (AVRational) {(int) round(video_avg_frame_rate), 1};
+    v_encoder->pix_fmt = AV_PIX_FMT_YUV420P;
+    v_encoder->width = video_w;
+    v_encoder->height = video_h;
+    if (format_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+        v_encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    if ((retval = avcodec_open2(v_encoder, v_codec, NULL)) < 0) {
+        fprintf(stderr, "Could not open codec: %s\n", av_err2str(retval));
+        return false;
+    }
+
+    if ((retval = avcodec_parameters_from_context(v_stream->codecpar, v_encoder)) < 0) {
+        fprintf(stderr, "Could not set video stream parameters: %s\n", av_err2str(retval));
+        return false;
+    }
+
+    // We only need the encoder for parameters
+    avcodec_free_context(&v_encoder);
+
+    v_stream->avg_frame_rate = (AVRational) {(int) round(video_avg_frame_rate), 1};
+    v_stream->nb_frames = video_packets_count;
+    v_stream->time_base = (AVRational) {1, TIMEBASE_MS}; // only a hint, the muxer may pick a different one
+    v_stream->id = 0;
+
+    if (audio_sample_rate <= 0) {
+        return true;
+    }
+
+    // Audio stream
+    if (audio_codec) { // transcoded, the encoder is kept for the audio encoder thread
+        AVStream *a_stream = avformat_new_stream(format_ctx, NULL);
+        if (!a_stream) {
+            fprintf(stderr, "Could not allocate stream.\n");
+            return false;
+        }
+
+        *audio_encoder = OpenAudioEncoder(audio_codec, audio_sample_rate,
+                                          format_ctx->oformat->flags & AVFMT_GLOBALHEADER);
+        if (!*audio_encoder) {
+            return false;
+        }
+
+        if ((retval = avcodec_parameters_from_context(a_stream->codecpar, *audio_encoder)) < 0) {
+            fprintf(stderr, "Could not set audio stream parameters: %s\n", av_err2str(retval));
+            return false;
+        }
+        a_stream->time_base = (*audio_encoder)->time_base;
+        a_stream->id = 1;
+        return true;
+    }
+
+    // Audio stream
+    const AVCodec *a_codec = avcodec_find_encoder(AV_CODEC_ID_PCM_ALAW);
+    AVStream *a_stream = avformat_new_stream(format_ctx, a_codec);
+    if (!a_stream) {
+        fprintf(stderr, "Could not allocate stream.\n");
+        return false;
+    }
+
+    AVCodecContext *a_encoder = avcodec_alloc_context3(a_codec);
+    a_encoder->time_base = (AVRational) {1, audio_sample_rate}; // Audio timestamps count samples
+    a_encoder->sample_rate = audio_sample_rate;
+    a_encoder->sample_fmt = AV_SAMPLE_FMT_S16;
+    a_encoder->channel_layout = AV_CH_LAYOUT_MONO;
+    a_encoder->channels = 1;
+
+    if (format_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+        a_encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    if ((retval = avcodec_open2(a_encoder, a_codec, NULL)) < 0) {
+        fprintf(stderr, "Could not open codec: %s\n", av_err2str(retval));
+        return false;
+    }
+
+    if ((retval = avcodec_parameters_from_context(a_stream->codecpar, a_encoder)) < 0) {
+        fprintf(stderr, "Could not set audio stream parameters: %s\n", av_err2str(retval));
+        return false;
+    }
+
+    // We only need the encoder for parameters
+    avcodec_free_context(&a_encoder);
+    a_stream->time_base = (AVRational) {1, audio_sample_rate};
+    a_stream->id = 1;
+    return true;
+}
+
+char *OutputFilename(const char *in_filename, const AVOutputFormat *format, bool quiet) {
+    char *out_filename = av_mallocz(strlen(in_filename) + MAX_EXTENSION_LEN + 1);
+    if (!out_filename) {
+        fprintf(stderr, "Could not allocate memory\n");
+        exit(1);
+    }
+
+    // Generate output file name based on default format extension
+    char ext[MAX_EXTENSION_LEN] = ".";
+    if (format->extensions && strlen(format->extensions) > 0) {
+        char *extensions = strdup(format->extensions);
+        strncpy(&ext[1], strtok(extensions, ","), MAX_EXTENSION_LEN - 2);
+        free(extensions);
+    } else {
+        sprintf(&ext[1], "out");
+        if (!quiet) {
+            fprintf(stderr, "No default extension for the selected format, using '.out'\n");
+        }
+    }
+
+    if (EndsWith(in_filename, ".264") || EndsWith(in_filename, ".265")) {
+        strncpy(out_filename, in_filename, strlen(in_filename) - 4);
+    } else {
+        strcat(out_filename, in_filename);
+    }
+    strcat(out_filename, ext);
+    return out_filename;
+}
+
+// Streamed output is remuxed by a session run to the end, the same as the server runs many of in a single thread
+static void ConvertStreamed(const char *in_filename, const char *out_filename, const ConvertOptions_t *options) {
+    ConvertSession_t *session = ConvertSessionOpen(in_filename, out_filename, options);
+    if (!session) {
+        exit(1);
+    }
+    while (!ConvertSessionFinished(session)) {
+        if (!ConvertSessionStep(session, INT_MAX, SIZE_MAX)) {
+            exit(1);
+        }
+    }
+    ConvertSessionClose(session);
+}
+
+int ConvertFile(const char *in_filename, const char *out_filename, const ConvertOptions_t *options) {
+    TRACE_BEGIN(trace_convert);
+    if (options->stream) {
+        ConvertStreamed(in_filename, out_filename, options);
+        TRACE_END(trace_convert, "convert", in_filename);
+        return 0;
+    }
+    const char *format_name = options->format_name;
+    if (!out_filename && !format_name) {
+        format_name = "matroska";
+    }
+
+
+    av_log_set_level(AV_LOG_ERROR);
+    //av_register_all();
+    int retval;
+
+    // Init format_ctx based on format name
+    AVFormatContext *format_ctx;
+    if (format_name) {
+        if ((retval = avformat_alloc_output_context2(&format_ctx, NULL, format_name, NULL)) < 0) {
+            fprintf(stderr, "Could not allocate an output context: %s\n", av_err2str(retval));
+            exit(1);
+        }
+
+        if (out_filename) {
+            if (!format_ctx->url && !(format_ctx->url = av_strdup(out_filename))) {
+                fprintf(stderr, "Could not allocate memory\n");
+                exit(1);
+            }
+        } else {
+            av_freep(&format_ctx->url);
+            format_ctx->url = OutputFilename(in_filename, format_ctx->oformat, options->quiet);
+            if (!options->quiet) {
+                fprintf(stderr, "Output file is %s\n", format_ctx->url);
+            }
+        }
+    } else {
+        if ((retval = avformat_alloc_output_context2(&format_ctx, NULL, NULL, out_filename)) < 0) {
+            fprintf(stderr, "Could not allocate an output context: %s\n", av_err2str(retval));
+            exit(1);
+        }
+    }
+
+    FILE *in_file = options->follow_ms ? FollowOpen(in_filename, options->follow_ms) : fopen(in_filename, "rb");
+    if (!in_file) {
+        fprintf(stderr, "Cannot open %s for reading.\n", in_filename);
+        exit(1);
+    }
+
+    // First pass over input file to detect video frame and audio sample rates and video size, unless an up to date
+    // index of the file is available
+    HXStreamInfo_t stream_info;
+    HXIndex_t index;
+    Checkpoint_t checkpoint;
+    const Checkpoint_t *start = NULL;
+    bool fragmented = options->resumable;
+    bool resuming = options->resumable && CheckpointLoad(format_ctx->url, in_filename, &checkpoint);
+    if (resuming) {
+        start = &checkpoint;
+        if (!options->quiet) {
+            fprintf(stderr, "Resuming interrupted conversion of %s.\n", in_filename);
+        }
+    }
+    TRACE_BEGIN(trace_scan);
+    if (start) {
+        stream_info = start->info;
+    } else if (options->follow_ms) {
+        // Only the first seconds are there yet, and whatever an index says about the clip is outdated
+        if (!HXScanSample(in_file, &stream_info, FOLLOW_SAMPLE_MS)) {
+            exit(1);
+        }
+    } else if (options->use_index && HXIndexOpen(in_filename, options->index_dir, &index)) {
+        stream_info = index.header->info;
+        HXIndexClose(&index);
+        if (!options->quiet) {
+            fprintf(stderr, "Using stream parameters from index.\n");
+        }
+    } else {
+        // Packet locations grow with the file, so the index isn't written under a memory limit
+        HXPacketEntry_t *entries = NULL;
+        size_t entries_count = 0;
+        bool write_index = options->use_index && !options->memory_limit;
+        if (options->use_index && options->memory_limit && !options->quiet) {
+            fprintf(stderr, "Warning! Not writing index under a memory limit.\n");
+        }
+        if (!HXScanStream(in_file, &stream_info, write_index ? &entries : NULL, &entries_count)) {
+            exit(1);
+        }
+        if (write_index) {
+            if (!HXIndexWrite(in_filename, options->index_dir, &stream_info, entries, entries_count)) {
+                fprintf(stderr, "Warning! Cannot write index of %s.\n", in_filename);
+            }
+            free(entries);
+        }
+    }
+    TRACE_END(trace_scan, "scan", NULL);
+
+    int video_w = stream_info.video_w, video_h = stream_info.video_h;
+    enum AVCodecID video_id = stream_info.video_header == HXVT ? AV_CODEC_ID_H265 : AV_CODEC_ID_H264;
+    double video_avg_frame_rate = stream_info.video_avg_frame_rate;
+    int audio_sample_rate = stream_info.audio_avg_sample_rate > 0 ?
+                            HXNominalSampleRate(stream_info.audio_avg_sample_rate) : 0;
+    long audio_packets_count = (long) stream_info.audio_packets_count;
+    long video_packets_count = (long) stream_info.video_packets_count;
+
+    if (!options->quiet && stream_info.video_header) {
+        fprintf(stderr, "Detected %s video dimensions: %d x %d\n", video_id == AV_CODEC_ID_H265 ? "h265" : "h264",
+                video_w, video_h);
+    }
+
+    if (video_avg_frame_rate <= 0) {
+        fprintf(stderr, "No video detected, aborting.\n");
+        exit(1);
+    }
+
+    const AVOutputFormat *out_fmt = format_ctx->oformat;
+    if (!options->quiet) {
+        if (format_ctx->oformat->mime_type) {
+            fprintf(stderr, "Selected output format: %s (%s)\n", format_ctx->oformat->long_name,
+                    format_ctx->oformat->mime_type);
+        } else {
+            fprintf(stderr, "Selected output format: %s\n", format_ctx->oformat->long_name);
+        }
+    }
+
+    if (!options->quiet) {
+        fprintf(stderr, "Detected video frame rate: %d\n", (int) round(video_avg_frame_rate));
+    }
+
+    if (options->skip_audio) {
+        if (!options->quiet) {
+            fprintf(stderr, "Audio processing is disabled.\n");
+        }
+        audio_sample_rate = 0;
+    } else {
+        if (!options->quiet) {
+            if (audio_sample_rate <= 0) {
+                fprintf(stderr, "Warning! No audio detected.\n");
+            } else {
+                fprintf(stderr, "Detected audio PCM frequency: %d\n", audio_sample_rate);
+                if (options->audio_codec && strcmp(options->audio_codec, "copy") != 0) {
+                    fprintf(stderr, "Transcoding audio to %s.\n", options->audio_codec);
+                }
+            }
+        }
+    }
+
+    // Init streams
+    AVCodecContext *audio_encoder = NULL;
+    const char *audio_codec = options->audio_codec && strcmp(options->audio_codec, "copy") != 0 ?
+                              options->audio_codec : NULL;
+    if (fragmented) {
+        if (!IsFragmentableFormat(out_fmt)) {
+            fprintf(stderr, "Fragmented output needs MP4, MOV, Matroska or WebM format.\n");
+            exit(1);
+        }
+        if (audio_codec) { // encoder state can't be restored at a fragment
+            fprintf(stderr, "Fragmented output can't transcode audio.\n");
+            exit(1);
+        }
+    }
+
+    TRACE_BEGIN(trace_init);
+    if (!InitAVStreams(format_ctx, video_w, video_h, video_id, video_avg_frame_rate, video_packets_count,
+                       audio_sample_rate, audio_codec, &audio_encoder)) {
+        exit(1);
+    }
+    TRACE_END(trace_init, "init streams", audio_codec);
+
+    // MP4 wants length prefixed NAL units and the matching avcC/hvcC record. Packets are converted here, in place when
+    // possible, and the record is built from the parameter sets of the first key frame, so that the muxer doesn't
+    // scan and copy every packet again. When repeated parameter sets are dropped, other formats get them as Annex-B
+    // extradata instead, so that they are still available to players seeking past the first key frame.
+    bool hevc = video_id == AV_CODEC_ID_H265;
+    bool length_prefixed = false, dedup_param_sets = options->dedup_param_sets;
+    uint8_t *length_buffer = NULL;
+    size_t length_buffer_size = 0;
+    TRACE_BEGIN(trace_param_sets);
+    if (IsLengthPrefixedFormat(out_fmt) || dedup_param_sets) {
+        bool extradata = SetVideoExtradata(format_ctx, 0, hevc, in_file);
+        length_prefixed = extradata && IsLengthPrefixedFormat(out_fmt);
+        if (!extradata && IsLengthPrefixedFormat(out_fmt) && !options->quiet) {
+            fprintf(stderr, "Warning! Cannot parse video parameter sets, leaving NAL conversion to LibAV.\n");
+        }
+        if (!extradata && dedup_param_sets) {
+            if (!options->quiet) {
+                fprintf(stderr, "Warning! No video parameter sets found, keeping repeated ones.\n");
+            }
+            dedup_param_sets = false;
+        }
+    }
+    TRACE_END(trace_param_sets, "parameter sets", NULL);
+
+    long video_origin, audio_origin;
+    ComputeOrigins(&stream_info, audio_sample_rate, &video_origin, &audio_origin);
+    AudioClock_t audio_clock = {.sample_rate = audio_sample_rate};
+
+    if (!options->overwrite_existing && !resuming) {
+        if (access(format_ctx->url, F_OK) == 0) {
+            fprintf(stderr, "Output file %s already exists but can't overwrite it, exiting.\n",
+                    format_ctx->url);
+            exit(0);
+        }
+    }
+
+    // Open output file and write header. Resumable conversions write a sequence of fragments, cut at key frames,
+    // through a sink which only writes a range of the output. When resuming from a fragment, the header is written
+    // again to bring the muxer back to its initial state, but it is outside of the range.
+    FdSink_t sink = {.fd = -1, .range_end = -1};
+    AVDictionary *muxer_options = NULL;
+    if (options->resumable) {
+        if ((sink.fd = open(format_ctx->url, O_WRONLY | O_CREAT | (resuming ? 0 : O_TRUNC), 0644)) < 0) {
+            fprintf(stderr, "Could not open output file %s.\n", format_ctx->url);
+            exit(1);
+        }
+        if (resuming) {
+            struct stat out_st;
+            if (fstat(sink.fd, &out_st) < 0 || (uint64_t) out_st.st_size < checkpoint.output_offset) {
+                if (!options->quiet) {
+                    fprintf(stderr, "Warning! Output file is shorter than its checkpoint, starting over.\n");
+                }
+                resuming = false;
+                start = NULL;
+            }
+            off_t offset = resuming ? (off_t) checkpoint.output_offset : 0;
+            if (ftruncate(sink.fd, offset) < 0 || lseek(sink.fd, offset, SEEK_SET) < 0) {
+                fprintf(stderr, "Could not truncate output file %s.\n", format_ctx->url);
+                exit(1);
+            }
+            sink.range_start = offset;
+        }
+    }
+    if (fragmented) {
+        if (!(format_ctx->pb = FdSinkOpen(&sink))) {
+            exit(1);
+        }
+        if (IsLengthPrefixedFormat(out_fmt)) {
+            // Fragments hold absolute timestamps, so that those written after a restart follow the earlier ones, and
+            // there is no trailer, which would only list the fragments written since
+            av_dict_set(&muxer_options, "movflags",
+                        "frag_custom+empty_moov+default_base_moof+frag_discont+skip_trailer", 0);
+            if (start) {
+                av_dict_set_int(&muxer_options, "fragment_index", start->fragment_index, 0);
+            }
+        }
+    } else if (!(out_fmt->flags & AVFMT_NOFILE)) {
+        if ((retval = avio_open(&(format_ctx->pb), format_ctx->url, AVIO_FLAG_WRITE)) < 0) {
+            fprintf(stderr, "Could not open output file: %s\n", av_err2str(retval));
+            exit(1);
+        }
+    }
+    if (options->follow_ms && IsLengthPrefixedFormat(out_fmt) && !fragmented) {
+        // Written a fragment per key frame as the input grows, rather than all at once at the end
+        av_dict_set(&muxer_options, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    }
+    if (options->memory_limit) {
+        // Bound what the muxer holds: MP4 sample tables grow with the file until the trailer, so they are written
+        // with each fragment instead, Matroska clusters are kept small, and the interleaving queue doesn't wait long
+        // for a stream with no packets
+        if (IsLengthPrefixedFormat(out_fmt) && !fragmented) {
+            av_dict_set(&muxer_options, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+        } else if (strcmp(out_fmt->name, "matroska") == 0 || strcmp(out_fmt->name, "webm") == 0) {
+            av_dict_set_int(&muxer_options, "cluster_size_limit",
+                            (int64_t) (options->memory_limit / MEMORY_PACKET_SHARE), 0);
+            av_dict_set_int(&muxer_options, "cluster_time_limit", 1000, 0);
+        }
+        format_ctx->max_interleave_delta = MEMORY_INTERLEAVE_US;
+    }
+    TRACE_BEGIN(trace_header);
+    if ((retval = avformat_write_header(format_ctx, &muxer_options)) < 0) {
+        fprintf(stderr, "Error occurred when opening output file: %s\n", av_err2str(retval));
+        exit(1);
+    }
+    TRACE_END(trace_header, "write header", out_fmt->name);
+    av_dict_free(&muxer_options);
+
+    uint32_t fragment_index = 1;
+    if (start) {
+        avio_flush(format_ctx->pb);
+        sink.position = (int64_t) start->output_offset;
+        fragment_index = start->fragment_index;
+        audio_clock.started = start->audio_clock_started;
+        audio_clock.next_pts = start->audio_next_pts;
+        if (fseeko(in_file, (off_t) start->input_offset, SEEK_SET) < 0) {
+            fprintf(stderr, "Seek error, aborting.\n");
+            exit(1);
+        }
+    }
+
+    // Audio is transcoded in a thread of its own, which shares the muxer with the extraction loop
+    pthread_mutex_t mux_lock = PTHREAD_MUTEX_INITIALIZER;
+    AudioEncoder_t *audio_transcoder = NULL;
+    if (audio_encoder && !(audio_transcoder = AudioEncoderStart(format_ctx, 1, audio_encoder, &mux_lock))) {
+        exit(1);
+    }
+
+    // Main extraction loop. Under a memory limit buffers are allocated once, at their largest size.
+    uint8_t *packet_buffer = NULL;
+    size_t packet_buffer_length = 0, packet_buffer_max = options->memory_limit / MEMORY_PACKET_SHARE;
+    if (packet_buffer_max) {
+        packet_buffer_length = packet_buffer_max;
+        length_buffer_size = length_prefixed ? NAL_LENGTH_PREFIXED_SIZE(packet_buffer_max) : 0;
+        if (!(packet_buffer = malloc(packet_buffer_length)) ||
+            (length_buffer_size && !(length_buffer = malloc(length_buffer_size)))) {
+            fprintf(stderr, "Cannot allocate memory, aborting.\n");
+            exit(1);
+        }
+        MetricsBufferResize((long) (packet_buffer_length + length_buffer_size));
+    }
+    int packet_buffer_offset = 0;
+    uint64_t param_sets_hash = 0;
+    bool param_sets_hash_set = false;
+    long param_sets_dropped = 0;
+    bool fragment_empty = true, checkpoint_ts_set = false;
+    uint32_t checkpoint_ts = 0;
+    bool hxfi_detected = false;
+    bool unknown_header = false;
+    long video_records = 0;
+    HXFrame_t hx_frame;
+    AVPacket packet;
+    av_init_packet(&packet);
+    do {
+        if (fread(&hx_frame.header, 1, sizeof(hx_frame.header), in_file) != sizeof(hx_frame.header)) {
+            fprintf(stderr, "Premature end of file, aborting.\n");
+            exit(1);
+        }
+
+        CountRecordHeader(hx_frame.header, &unknown_header, true);
+
+        switch (hx_frame.header) {
+
+            case HXVS:
+                if (fseek(in_file, sizeof(HXVSFrame_t), SEEK_CUR) < 0) {
+                    fprintf(stderr, "Seek error, aborting.\n");
+                    exit(1);
+                }
+                break;
+
+            case HXVT:
+                if (fseek(in_file, sizeof(HXVTFrame_t), SEEK_CUR) < 0) {
+                    fprintf(stderr, "Seek error, aborting.\n");
+                    exit(1);
+                }
+                break;
+
+            case HXVF:
+                if (fread(&hx_frame.data, 1, sizeof(HXVFFrame_t), in_file) != sizeof(HXVFFrame_t)) {
+                    fprintf(stderr, "Premature end of file, aborting.\n");
+                    exit(1);
+                }
+
+                if (options->follow_ms && packet_buffer_offset == 0 && hx_frame.data.hxvf.type == HXVF_TYPE_I) {
+                    // What precedes the key frame is on its way to viewers. The audio transcoder writes to the same
+                    // output from its thread.
+                    pthread_mutex_lock(&mux_lock);
+                    avio_flush(format_ctx->pb);
+                    pthread_mutex_unlock(&mux_lock);
+                }
+
+                if (fragmented && packet_buffer_offset == 0 && hx_frame.data.hxvf.type == HXVF_TYPE_I) {
+                    // A key frame, or its parameter sets, starts here: end the fragment and record the state needed
+                    // to restart from here, for checkpoints now and then
+                    TRACE_BEGIN(trace_flush);
+                    if (!fragment_empty) {
+                        if ((retval = av_interleaved_write_frame(format_ctx, NULL)) < 0 ||
+                            (retval = av_write_frame(format_ctx, NULL)) < 0) {
+                            fprintf(stderr, "Error while writing output packet: %s\n", av_err2str(retval));
+                            exit(1);
+                        }
+                        fragment_index++;
+                        fragment_empty = true;
+                    }
+                    avio_flush(format_ctx->pb);
+                    TRACE_END(trace_flush, "flush fragment", NULL);
+                    memset(&checkpoint, 0, sizeof(checkpoint));
+                    checkpoint.info = stream_info;
+                    checkpoint.input_offset = ftello(in_file) - sizeof(hx_frame.header) - sizeof(HXVFFrame_t);
+                    checkpoint.output_offset = sink.position;
+                    checkpoint.fragment_index = fragment_index;
+                    checkpoint.audio_clock_started = audio_clock.started;
+                    checkpoint.audio_next_pts = audio_clock.next_pts;
+
+                    if (options->resumable && !checkpoint_ts_set) {
+                        checkpoint_ts = hx_frame.data.hxvf.timestamp;
+                        checkpoint_ts_set = true;
+                    } else if (options->resumable &&
+                               HXElapsed(hx_frame.data.hxvf.timestamp, checkpoint_ts) >= CHECKPOINT_MS) {
+                        // Output must be on disk before a checkpoint pointing at it is
+                        if (fdatasync(sink.fd) < 0 || !CheckpointSave(format_ctx->url, in_filename, &checkpoint)) {
+                            fprintf(stderr, "Warning! Cannot save checkpoint of %s.\n", format_ctx->url);
+                        }
+                        checkpoint_ts = hx_frame.data.hxvf.timestamp;
+                    }
+                }
+
+                // Start of the record if it is one of those sampled for tracing, else 0
+                int64_t trace_packet = trace_fd >= 0 && video_records++ % TRACE_PACKET_SAMPLE == 0 ? TraceNow() : 0;
+                retval = (int) ReadToBuffer(in_file, &packet_buffer, packet_buffer_offset,
+                                            hx_frame.data.hxvf.length, &packet_buffer_length, packet_buffer_max);
+                if (trace_packet) {
+                    TraceSpan(trace_packet, "read packet", NULL);
+                }
+
+                if (retval < hx_frame.data.hxvf.length) {
+                    fprintf(stderr, "Premature end of file, aborting.\n");
+                    exit(1);
+                }
+
+                if (NalIsParameterSet(hevc, NalUnitType(hevc, packet_buffer + packet_buffer_offset, retval))) {
+                    packet_buffer_offset += retval; // enqueue data in buffer, wait for a different type to write a packet
+                } else {
+                    packet.data = packet_buffer;
+                    packet.size = retval + packet_buffer_offset;
+                    if (dedup_param_sets && packet_buffer_offset > 0) {
+                        uint64_t hash = HashBytes(packet_buffer, packet_buffer_offset);
+                        if (param_sets_hash_set && hash == param_sets_hash) {
+                            packet.data += packet_buffer_offset; // same as last time, drop them
+                            packet.size -= packet_buffer_offset;
+                            param_sets_dropped++;
+                        }
+                        param_sets_hash = hash;
+                        param_sets_hash_set = true;
+                    }
+                    packet_buffer_offset = 0;
+                    if (length_prefixed && !NalAnnexBToLengthPrefixed(packet.data, packet.size)) {
+                        // 3 byte start codes leave no room for lengths, convert to a separate buffer
+                        size_t length_size = NAL_LENGTH_PREFIXED_SIZE((size_t) packet.size);
+                        if (length_size > length_buffer_size) {
+                            if (!(length_buffer = realloc(length_buffer, length_size))) {
+                                fprintf(stderr, "Cannot allocate memory, aborting.\n");
+                                exit(1);
+                            }
+                            MetricsBufferResize((long) length_size - (long) length_buffer_size);
+                            length_buffer_size = length_size;
+                        }
+                        packet.size = (int) NalAnnexBToLengthPrefixedCopy(packet.data, packet.size, length_buffer);
+                        packet.data = length_buffer;
+                    }
+                    packet.flags = hx_frame.data.hxvf.type == HXVF_TYPE_I ? AV_PKT_FLAG_KEY : 0;
+                    packet.stream_index = 0;
+                    packet.pts = packet.dts = HXElapsed(hx_frame.data.hxvf.timestamp, video_origin);
+                    packet.duration = 0;
+                    av_packet_rescale_ts(&packet, (AVRational) {1, TIMEBASE_MS},
+                                         format_ctx->streams[0]->time_base);
+                    int64_t trace_mux = trace_packet ? TraceNow() : 0;
+                    pthread_mutex_lock(&mux_lock);
+                    retval = av_interleaved_write_frame(format_ctx, &packet);
+                    pthread_mutex_unlock(&mux_lock);
+                    if (trace_packet) {
+                        TraceSpan(trace_mux, "mux packet", NULL);
+                    }
+                    if (retval < 0) {
+                        fprintf(stderr, "Error while writing output packet: %s\n", av_err2str(retval));
+                        exit(1);
+                    }
+                    fragment_empty = false;
+                    METRICS_ADD(video_packets, 1);
+                }
+                break;
+
+            case HXAF:
+                if (fread(&hx_frame.data, 1, sizeof(HXAFFrame_t), in_file) != sizeof(HXAFFrame_t)) {
+                    fprintf(stderr, "Premature end of file, aborting.\n");
+                    exit(1);
+                }
+
+                if (audio_sample_rate > 0) {
+                    retval = (int) ReadToBuffer(in_file, &packet_buffer, 0, hx_frame.data.hxaf.length - 4,
+                                                &packet_buffer_length, packet_buffer_max);
+
+                    if (retval < hx_frame.data.hxaf.length - 4) {
+                        fprintf(stderr, "Premature end of file, aborting.\n");
+                        exit(1);
+                    }
+
+                    // A-law, one byte per sample
+                    int64_t pts;
+                    if (!AudioClockNext(&audio_clock, HXElapsed(hx_frame.data.hxaf.timestamp, audio_origin),
+                                        (size_t) retval, &pts)) {
+                        break;
+                    }
+
+                    if (audio_transcoder) {
+                        if (!AudioEncoderPush(audio_transcoder, packet_buffer, retval, pts)) {
+                            exit(1);
+                        }
+                        break;
+                    }
+
+                    packet.data = packet_buffer;
+                    packet.size = retval;
+                    packet.stream_index = 1;
+                    packet.pts = packet.dts = pts;
+                    packet.duration = retval;
+                    packet.flags = AV_PKT_FLAG_KEY;
+                    av_packet_rescale_ts(&packet, (AVRational) {1, audio_sample_rate},
+                                         format_ctx->streams[1]->time_base);
+                    if ((retval = av_interleaved_write_frame(format_ctx, &packet)) < 0) {
+                        fprintf(stderr, "Error while writing output packet: %s\n", av_err2str(retval));
+                        exit(1);
+                    }
+                    fragment_empty = false;
+                    METRICS_ADD(audio_packets, 1);
+                } else {
+                    if (fseek(in_file, hx_frame.data.hxaf.length - 4, SEEK_CUR) < 0) {
+                        fprintf(stderr, "Seek error, aborting");
+                        exit(1);
+                    }
+                }
+                break;
+
+            case HXFI:
+                hxfi_detected = true;
+                break;
+
+            default: // counted by CountRecordHeader
+                break;
+        }
+    } while ((!feof(in_file)) && (!hxfi_detected));
+    METRICS_ADD(bytes_in, ftello(in_file));
+    fclose(in_file);
+
+    if (audio_transcoder && !AudioEncoderFinish(audio_transcoder)) {
+        exit(1);
+    }
+
+    TRACE_BEGIN(trace_trailer);
+    av_write_trailer(format_ctx);
+    if (fragmented) {
+        FdSinkClose(&format_ctx->pb);
+        METRICS_ADD(bytes_out, sink.written);
+        if (fsync(sink.fd) < 0 || close(sink.fd) < 0) {
+            fprintf(stderr, "Error while closing output file %s.\n", format_ctx->url);
+            exit(1);
+        }
+        CheckpointRemove(format_ctx->url);
+    } else if (!(out_fmt->flags & AVFMT_NOFILE)) {
+        METRICS_ADD(bytes_out, avio_tell(format_ctx->pb));
+        avio_closep(&format_ctx->pb);
+    }
+    TRACE_END(trace_trailer, "write trailer", NULL);
+    avformat_free_context(format_ctx);
+
+    if (packet_buffer) {
+        free(packet_buffer);
+        MetricsBufferResize(-(long) packet_buffer_length);
+    }
+    if (length_buffer) {
+        free(length_buffer);
+        MetricsBufferResize(-(long) length_buffer_size);
+    }
+
+    if (!options->quiet) {
+        if (param_sets_dropped) {
+            fprintf(stderr, "Dropped repeated video parameter sets before %ld key frames.\n", param_sets_dropped);
+        }
+        if (audio_clock.gaps || audio_clock.drops) {
+            fprintf(stderr, "Audio resynced to the camera clock %ld times, %ld packets dropped.\n",
+                    audio_clock.gaps + audio_clock.drops, audio_clock.drops);
+        }
+        fprintf(stderr, "Done! Parsed %lu video packet and %lu audio packets.\n", video_packets_count,
+                audio_packets_count);
+        struct rusage usage;
+        if (options->memory_limit && getrusage(RUSAGE_SELF, &usage) == 0) {
+            fprintf(stderr, "Peak memory usage: %ld KiB resident, %zu KiB of packet buffers, limit %zu KiB.\n",
+                    usage.ru_maxrss, (packet_buffer_length + length_buffer_size) / 1024,
+                    options->memory_limit / 1024);
+        }
+    }
+
+    TRACE_END(trace_convert, "convert", in_filename);
+    return 0;
+}
@@ -0,0 +1,124 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <libavformat/avformat.h>
+#include "checkpoint.h"
+
+#define TIMEBASE_MS         1000    // camera timestamps are in ms
+#define AV_MAX_OFFSET_MS    10000   // audio and video clocks further apart than this are considered unrelated
+
+// Audio timestamps follow the number of samples written, which is what players actually play, and are only pulled
+// back to the camera clock, which video timestamps come from, when the two disagree by more than AUDIO_DRIFT_MAX_MS
+typedef struct AudioClock_t {
+    int sample_rate;
+    int64_t next_pts;       // in samples
+    bool started;
+    long gaps;              // times audio lagged behind and was moved forward
+    long drops;             // packets dropped because audio ran ahead
+} AudioClock_t;
+
+// Returns the pts in samples of a packet of the given number of samples, camera_ms being its camera timestamp relative
+// to the output origin. Returns false if the packet must be dropped to let the camera clock catch up.
+bool AudioClockNext(AudioClock_t *clock, long camera_ms, size_t samples, int64_t *pts);
+
+// Fragmented output to an already open descriptor, as served over HTTP or written by batch chunks. The output is cut
+// into fragments at every key frame, and can be started from any of them given the state recorded when the fragment
+// was reached.
+typedef struct ConvertStream_t {
+    int fd;
+    const Checkpoint_t *start;      // fragment to start from after the header, NULL to start from the beginning
+    int64_t range_start;            // only output bytes from range_start to range_end excluded are written to fd,
+    int64_t range_end;              // -1 for the end of the output
+    // Called at the start of every fragment with the state needed to start from it and the time of its key frame,
+    // in ms from the first video frame. Returning false ends the output before that fragment.
+    bool (*on_fragment)(void *opaque, const Checkpoint_t *checkpoint, long time_ms);
+    void *opaque;
+    int64_t header_size;            // set to the size of the header
+    int64_t size;                   // set to the size of the whole output, when it has been written to the end
+} ConvertStream_t;
+
+#define MEMORY_LIMIT_MIN    (8 << 20)   // smallest memory limit, a key frame must fit in a fraction of it
+#define MEMORY_PACKET_SHARE 8           // with a memory limit, the packet buffer gets this fraction of it
+#define MEMORY_INTERLEAVE_US 1000000    // with a memory limit, packets wait at most this long for other streams
+
+typedef struct ConvertOptions_t {
+    bool skip_audio;
+    bool quiet;
+    bool overwrite_existing;
+    const char *format_name;
+    bool use_index;
+    const char *index_dir;
+    const char *audio_codec;    // "aac" or "opus" to transcode a-law audio, NULL or "copy" to keep it as it is
+    bool dedup_param_sets;      // drop parameter sets repeated before key frames when they didn't change
+    bool resumable;             // write fragmented output with checkpoints, resume from the last one if any
+    ConvertStream_t *stream;    // write to a descriptor instead of a file, NULL otherwise
+    size_t memory_limit;        // bytes a conversion may use, 0 for no limit
+    long follow_ms;             // wait up to this long for an input still being written to grow, 0 to not wait
+} ConvertOptions_t;
+
+// Converts in_filename into out_filename. If out_filename is NULL, the output name is generated from the input one
+// and the default extension of the selected format (matroska if none). Errors are fatal and terminate the process,
+// which is why batch conversions run each input in a process of its own.
+int ConvertFile(const char *in_filename, const char *out_filename, const ConvertOptions_t *options);
+
+// Grows *dest, of *dest_size bytes, as needed to read length bytes from fp_src at dest_offset. Returns the number of
+// bytes read. If max_size isn't 0, data not fitting in max_size bytes is a fatal error.
+size_t ReadToBuffer(FILE *fp_src, uint8_t **dest, size_t dest_offset, unsigned long length, size_t *dest_size,
+                    size_t max_size);
+
+// Adds a video stream to format_ctx and, if audio_sample_rate isn't 0, an a-law audio stream, or one transcoded to
+// audio_codec with *audio_encoder set to its encoder
+bool InitAVStreams(AVFormatContext *format_ctx, int video_w, int video_h, enum AVCodecID video_id,
+                   double video_avg_frame_rate, long video_packets_count, int audio_sample_rate,
+                   const char *audio_codec, AVCodecContext **audio_encoder);
+
+// Output name generated from in_filename and the default extension of format, to be freed with av_free()
+char *OutputFilename(const char *in_filename, const AVOutputFormat *format, bool quiet);
+
+// Formats which can be written as a stream of self-contained fragments, and so resumed after the last one. MPEG-TS
+// isn't one: writing the header again resets its continuity counters and PAT/PMT timing, which aren't checkpointed.
+bool IsFragmentableFormat(const AVOutputFormat *format);
+
+// MOV and MP4 store NAL units prefixed by their length rather than by a start code
+bool IsLengthPrefixedFormat(const AVOutputFormat *format);
+
+// Reads the parameter sets preceding the first key frame, as a single Annex-B buffer, and goes back to where the input
+// was. Returns NULL if none are found among the first records.
+uint8_t *ReadParameterSets(FILE *in_file, bool hevc, size_t *size);
+
+// Sets the extradata of video stream index of format_ctx from the parameter sets preceding the first key frame of
+// in_file: an avcC/hvcC record for formats storing NAL units prefixed by their length, the Annex-B parameter sets for
+// others. Returns false if none can be found, or parsed, leaving the extradata as it was.
+bool SetVideoExtradata(AVFormatContext *format_ctx, int index, bool hevc, FILE *in_file);
+
+// Counts an unknown record header, which readers skip 4 bytes at a time until a known one shows up again, or the
+// known one ending such a run, *lost being true during the run. Unknown headers are reported if report is true.
+void CountRecordHeader(uint32_t header, bool *lost, bool report);
+
+// FNV-1a, to tell whether parameter sets changed
+uint64_t HashBytes(const uint8_t *data, size_t size);
+
+// Timestamps of info video and audio packets are relative to these origins in the output. Video and audio share the
+// same origin so that they start in sync, unless there is no audio or their clocks are unrelated.
+void ComputeOrigins(const HXStreamInfo_t *info, int audio_sample_rate, long *video_origin, long *audio_origin);
+
+#endif
@@ -0,0 +1,101 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "fdsink.h"
+
+#define FDSINK_BUFFER_SIZE  65536
+
+static int FdSinkWrite(void *opaque, uint8_t *buf, int buf_size) {
+    FdSink_t *sink = opaque;
+    int64_t start = sink->position, end = sink->position + buf_size;
+    sink->position = end;
+
+    if (start < sink->range_start) {
+        start = sink->range_start;
+    }
+    if (sink->range_end >= 0 && end > sink->range_end) {
+        end = sink->range_end;
+    }
+
+    if (sink->fd < 0 && start < end) {
+        size_t length = (size_t) (end - start);
+        if (sink->data_length + length > sink->data_size) {
+            size_t size = sink->data_size ? sink->data_size : FDSINK_BUFFER_SIZE;
+            while (size < sink->data_length + length) {
+                size *= 2;
+            }
+            uint8_t *data = realloc(sink->data, size);
+            if (data == NULL) {
+                return AVERROR(ENOMEM);
+            }
+            sink->data = data;
+            sink->data_size = size;
+        }
+        memcpy(sink->data + sink->data_length, buf + (start - (sink->position - buf_size)), length);
+        sink->data_length += length;
+        sink->written += (int64_t) length;
+        return buf_size;
+    }
+
+    for (int64_t offset = start; offset < end;) {
+        ssize_t retval = write(sink->fd, buf + (offset - (sink->position - buf_size)), (size_t) (end - offset));
+        if (retval < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return AVERROR(errno);
+        }
+        offset += retval;
+        sink->written += retval;
+    }
+    return buf_size;
+}
+
+AVIOContext *FdSinkOpen(FdSink_t *sink) {
+    unsigned char *buffer = av_malloc(FDSINK_BUFFER_SIZE);
+    if (buffer == NULL) {
+        fprintf(stderr, "Cannot allocate memory, aborting.\n");
+        return NULL;
+    }
+
+    AVIOContext *pb = avio_alloc_context(buffer, FDSINK_BUFFER_SIZE, 1, sink, NULL, FdSinkWrite, NULL);
+    if (pb == NULL) {
+        fprintf(stderr, "Cannot allocate memory, aborting.\n");
+        av_free(buffer);
+        return NULL;
+    }
+    pb->seekable = 0;
+    return pb;
+}
+
+void FdSinkClose(AVIOContext **pb) {
+    if (*pb == NULL) {
+        return;
+    }
+    avio_flush(*pb);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
+
+void FdSinkConsume(FdSink_t *sink, size_t length) {
+    memmove(sink->data, sink->data + length, sink->data_length - length);
+    sink->data_length -= length;
+}
@@ -0,0 +1,47 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef FDSINK_H
+#define FDSINK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <libavformat/avformat.h>
+
+// Muxer output going to a file descriptor the caller opened, so that it can be positioned and truncated freely, or to
+// memory if fd is negative. Only the part of the output within a byte range is written, which lets the muxer rebuild
+// its state without writing anything again, and serves HTTP range requests.
+typedef struct FdSink_t {
+    int fd;
+    uint8_t *data;          // output kept in memory when fd is negative, data_length bytes of data_size
+    size_t data_length, data_size;
+    int64_t position;       // offset in the output of the next byte the muxer writes
+    int64_t range_start;    // first byte of the output written to fd
+    int64_t range_end;      // byte after the last one written to fd, -1 for the end of the output
+    int64_t written;        // bytes written to fd
+} FdSink_t;
+
+// Allocates an AVIO context writing to sink->fd. It is not seekable, so muxers produce streamable output and never
+// go back to patch what they already wrote.
+AVIOContext *FdSinkOpen(FdSink_t *sink);
+
+// Flushes and frees the AVIO context, the file descriptor is left open, and so is output kept in memory
+void FdSinkClose(AVIOContext **pb);
+
+// Drops the first length bytes of the output kept in memory, once the caller used them
+void FdSinkConsume(FdSink_t *sink, size_t length);
+
+#endif
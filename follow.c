@@ -0,0 +1,105 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define _GNU_SOURCE // fopencookie
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include "follow.h"
+
+#define FOLLOW_EVENTS_SIZE  4096
+
+typedef struct Follow_t {
+    int fd;
+    int inotify_fd;
+    long idle_ms;
+} Follow_t;
+
+// Waits for the file to be written to, or closed by its writer. Returns false after idle_ms without any.
+static bool FollowWait(Follow_t *follow) {
+    struct pollfd pfd = {.fd = follow->inotify_fd, .events = POLLIN};
+    int retval;
+    while ((retval = poll(&pfd, 1, (int) follow->idle_ms)) < 0 && errno == EINTR) {
+    }
+    if (retval <= 0) {
+        return false;
+    }
+    char events[FOLLOW_EVENTS_SIZE];
+    return read(follow->inotify_fd, events, sizeof(events)) > 0 || errno == EINTR || errno == EAGAIN;
+}
+
+static ssize_t FollowRead(void *cookie, char *buf, size_t size) {
+    Follow_t *follow = cookie;
+    for (;;) {
+        // The watch is in place before the read, so that data appended right after it still wakes the wait up
+        ssize_t retval = read(follow->fd, buf, size);
+        if (retval != 0 || !FollowWait(follow)) {
+            return retval;
+        }
+    }
+}
+
+static int FollowSeek(void *cookie, off64_t *offset, int whence) {
+    Follow_t *follow = cookie;
+    off_t position = lseek(follow->fd, (off_t) *offset, whence);
+    if (position < 0) {
+        return -1;
+    }
+    *offset = position;
+    return 0;
+}
+
+static int FollowClose(void *cookie) {
+    Follow_t *follow = cookie;
+    int retval = close(follow->fd);
+    close(follow->inotify_fd);
+    free(follow);
+    return retval;
+}
+
+FILE *FollowOpen(const char *filename, long idle_ms) {
+    Follow_t *follow = malloc(sizeof(Follow_t));
+    if (!follow) {
+        return NULL;
+    }
+    follow->idle_ms = idle_ms;
+    if ((follow->fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0) {
+        free(follow);
+        return NULL;
+    }
+    if ((follow->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0 ||
+        inotify_add_watch(follow->inotify_fd, filename, IN_MODIFY | IN_CLOSE_WRITE) < 0) {
+        if (follow->inotify_fd >= 0) {
+            close(follow->inotify_fd);
+        }
+        close(follow->fd);
+        free(follow);
+        return NULL;
+    }
+
+    cookie_io_functions_t functions = {.read = FollowRead, .seek = FollowSeek, .close = FollowClose};
+    FILE *fp = fopencookie(follow, "rb", functions);
+    if (!fp) {
+        FollowClose(follow);
+    }
+    return fp;
+}
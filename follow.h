@@ -0,0 +1,29 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef FOLLOW_H
+#define FOLLOW_H
+
+#include <stdio.h>
+
+#define FOLLOW_IDLE_MS      30000   // default time without new data after which a followed file is considered ended
+
+// Opens a file that is still being written for reading. Reads past its current end wait, with inotify, for the writer
+// to append more, so that the usual stdio calls see it as complete. The end of file is only reported once it has not
+// grown for idle_ms, which is how a clip whose writer went away without a trailer ends. Returns NULL on error.
+FILE *FollowOpen(const char *filename, long idle_ms);
+
+#endif
@@ -0,0 +1,503 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Generates synthetic camera files, in the same format as the ones parsed by ipcam264convert, to benchmark the
+// converter on inputs of arbitrary length without shipping large recordings.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "hxscan.h"
+
+#define HXFI_INDEX_LENGTH   200000 // size of the key frame index written by cameras, in bytes
+#define AUDIO_PACKET_MS     20
+#define ALAW_SILENCE        0xd5
+
+typedef struct Payload_t {
+    uint8_t *data;
+    uint32_t length;
+    uint32_t type;
+} Payload_t;
+
+typedef struct GenOptions_t {
+    uint32_t video_header;
+    uint32_t width, height;
+    double duration;
+    double fps;
+    int audio_rate;
+    double gop;
+    double p_mean;
+    double key_mean;
+    double size_variation;
+    double corruption_rate;
+    uint32_t ts_initial;
+    uint64_t seed;
+    const char *source;
+} GenOptions_t;
+
+static uint64_t rng_state;
+
+static uint64_t Random(void) { // xorshift64*, so that output only depends on the seed
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static double RandomUniform(void) {
+    return (double) (Random() >> 11) / (double) (1ULL << 53);
+}
+
+// Log-normal distributed size with the given mean and coefficient of variation
+static uint32_t RandomSize(double mean, double variation) {
+    if (variation <= 0) {
+        return (uint32_t) mean;
+    }
+    double sigma2 = log(1 + variation * variation);
+    double mu = log(mean) - sigma2 / 2;
+    double u1 = RandomUniform(), u2 = RandomUniform();
+    double normal = sqrt(-2 * log(u1 > 0 ? u1 : 1e-12)) * cos(2 * M_PI * u2);
+    double size = exp(mu + sqrt(sigma2) * normal);
+    return size < 16 ? 16 : (uint32_t) size;
+}
+
+static void *Allocate(size_t size) {
+    void *ptr = malloc(size);
+    if (ptr == NULL) {
+        fprintf(stderr, "Cannot allocate memory, aborting.\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+static void AppendPayload(Payload_t **payloads, size_t *count, uint8_t *data, uint32_t length, uint32_t type) {
+    if ((*count & (*count - 1)) == 0) { // grow when count reaches a power of two
+        *payloads = realloc(*payloads, (*count ? *count * 2 : 1) * sizeof(Payload_t));
+        if (*payloads == NULL) {
+            fprintf(stderr, "Cannot allocate memory, aborting.\n");
+            exit(1);
+        }
+    }
+    (*payloads)[*count].data = data;
+    (*payloads)[*count].length = length;
+    (*payloads)[(*count)++].type = type;
+}
+
+// Loads the video payloads of a real clip, starting from its first key frame, and its audio payloads
+static bool LoadSource(GenOptions_t *options, Payload_t **video, size_t *video_count, Payload_t **audio,
+                       size_t *audio_count) {
+    FILE *fp = fopen(options->source, "rb");
+    if (!fp) {
+        fprintf(stderr, "Cannot open %s for reading.\n", options->source);
+        return false;
+    }
+
+    HXFrame_t hx_frame;
+    bool key_found = false;
+    *video_count = *audio_count = 0;
+    while (HXReadFrame(fp, &hx_frame) && hx_frame.header != HXFI) {
+        uint8_t *data;
+        long length = HXPayloadLength(&hx_frame);
+
+        switch (hx_frame.header) {
+            case HXVS:
+            case HXVT:
+                options->video_header = hx_frame.header;
+                options->width = hx_frame.data.hxvs.width;
+                options->height = hx_frame.data.hxvs.height;
+                break;
+
+            case HXVF:
+            case HXAF:
+                if (hx_frame.header == HXVF && hx_frame.data.hxvf.type == HXVF_TYPE_I) {
+                    key_found = true;
+                }
+                if ((hx_frame.header == HXVF && !key_found) || length == 0) {
+                    HXSkipPayload(fp, &hx_frame);
+                    break;
+                }
+
+                data = Allocate(length);
+                if (fread(data, 1, length, fp) != (size_t) length) {
+                    free(data);
+                    break;
+                }
+                if (hx_frame.header == HXVF) {
+                    AppendPayload(video, video_count, data, length, hx_frame.data.hxvf.type);
+                } else {
+                    AppendPayload(audio, audio_count, data, length, 0);
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+    fclose(fp);
+
+    if (!*video_count) {
+        fprintf(stderr, "No video found in %s.\n", options->source);
+        return false;
+    }
+
+    // Drop the trailing parameter sets of a key frame cut off by the end of the clip, so that looping over the
+    // payloads always restarts from a complete key frame
+    while (*video_count && (*video)[*video_count - 1].type == HXVF_TYPE_I) {
+        free((*video)[--(*video_count)].data);
+    }
+    return *video_count > 0;
+}
+
+// Fills a synthetic NAL unit. Payload bytes are never zero so that they can't emulate a start code.
+static void SyntheticNal(uint8_t *data, uint32_t length, uint32_t video_header, int nal_type) {
+    memset(data, 0, 3);
+    data[3] = 1;
+    if (video_header == HXVT) {
+        data[4] = (uint8_t) (nal_type << 1);
+        data[5] = 1;
+    } else {
+        data[4] = (uint8_t) (0x60 | nal_type);
+        data[5] = 0x88;
+    }
+    for (uint32_t i = 6; i < length; i++) {
+        data[i] = (uint8_t) (Random() % 255 + 1);
+    }
+}
+
+static bool WriteRecord(FILE *fp, uint32_t header, const void *data, size_t data_size, const uint8_t *payload,
+                        size_t payload_length) {
+    return fwrite(&header, sizeof(header), 1, fp) == 1 &&
+           fwrite(data, data_size, 1, fp) == 1 &&
+           (payload_length == 0 || fwrite(payload, payload_length, 1, fp) == 1);
+}
+
+// Junk between records, a damaged start code or a timestamp going backwards
+static void Corrupt(FILE *fp, uint8_t *payload, uint32_t length, uint32_t *timestamp) {
+    uint8_t junk[64];
+    size_t junk_length;
+
+    switch (Random() % 3) {
+        case 0:
+            // Whole words, as the converter skips unknown data 4 bytes at a time looking for the next record
+            junk_length = 4 * (1 + Random() % (sizeof(junk) / 4));
+            for (size_t i = 0; i < junk_length; i++) {
+                junk[i] = (uint8_t) Random();
+            }
+            fwrite(junk, junk_length, 1, fp);
+            break;
+
+        case 1:
+            if (payload && length > 4) {
+                payload[3] ^= 0xff;
+            }
+            break;
+
+        default:
+            *timestamp -= 1000;
+            break;
+    }
+}
+
+static void ShowHelp(char *command, int exitcode) {
+    fprintf(stderr, "Generate synthetic surveillance cameras \".264/.265\" files for benchmarking.\n");
+    fprintf(stderr, "Usage: %s [options] output.26x\n", basename(command));
+    fprintf(stderr, "  -i source.26x   Reuse video and audio payloads of a real clip, looping over them. Codec\n");
+    fprintf(stderr, "                  and dimensions are taken from the clip, -c -s -g -p -k -v are ignored.\n");
+    fprintf(stderr, "  -c h264|h265    Video codec (default: h264)\n");
+    fprintf(stderr, "  -s WxH          Video dimensions (default: 1920x1080)\n");
+    fprintf(stderr, "  -d seconds      Duration (default: 60)\n");
+    fprintf(stderr, "  -r fps          Video frame rate (default: 12)\n");
+    fprintf(stderr, "  -a rate         Audio sampling frequency, 0 for no audio (default: 8000)\n");
+    fprintf(stderr, "  -g seconds      Key frame interval (default: 2)\n");
+    fprintf(stderr, "  -p bytes        Mean P-frame size (default: 30000)\n");
+    fprintf(stderr, "  -k bytes        Mean key frame size (default: 8 times the P-frame size)\n");
+    fprintf(stderr, "  -v variation    Coefficient of variation of the log-normal frame sizes (default: 0.3)\n");
+    fprintf(stderr, "  -x rate         Fraction of corrupted records: junk between records, damaged start\n");
+    fprintf(stderr, "                  codes, timestamps going backwards (default: 0)\n");
+    fprintf(stderr, "  -t timestamp    Initial camera timestamp in ms, to test wrap around (default: 0)\n");
+    fprintf(stderr, "  -S seed         Random seed (default: 1)\n");
+    exit(exitcode);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    GenOptions_t options = {HXVS, 1920, 1080, 60, 12, 8000, 2, 30000, 0, 0.3, 0, 0, 1, NULL};
+
+    while ((opt = getopt(argc, argv, ":i:c:s:d:r:a:g:p:k:v:x:t:S:")) != -1) {
+        switch (opt) {
+            case 'i':
+                options.source = optarg;
+                break;
+
+            case 'c':
+                if (strcmp(optarg, "h264") == 0) {
+                    options.video_header = HXVS;
+                } else if (strcmp(optarg, "h265") == 0) {
+                    options.video_header = HXVT;
+                } else {
+                    ShowHelp(argv[0], EXIT_FAILURE);
+                }
+                break;
+
+            case 's':
+                if (sscanf(optarg, "%ux%u", &options.width, &options.height) != 2) {
+                    ShowHelp(argv[0], EXIT_FAILURE);
+                }
+                break;
+
+            case 'd':
+                options.duration = atof(optarg);
+                break;
+
+            case 'r':
+                options.fps = atof(optarg);
+                break;
+
+            case 'a':
+                options.audio_rate = atoi(optarg);
+                break;
+
+            case 'g':
+                options.gop = atof(optarg);
+                break;
+
+            case 'p':
+                options.p_mean = atof(optarg);
+                break;
+
+            case 'k':
+                options.key_mean = atof(optarg);
+                break;
+
+            case 'v':
+                options.size_variation = atof(optarg);
+                break;
+
+            case 'x':
+                options.corruption_rate = atof(optarg);
+                break;
+
+            case 't':
+                options.ts_initial = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+
+            case 'S':
+                options.seed = strtoull(optarg, NULL, 0);
+                break;
+
+            default:
+                ShowHelp(argv[0], EXIT_FAILURE);
+        }
+    }
+
+    if (optind >= argc || options.duration <= 0 || options.fps <= 0 || options.audio_rate < 0 ||
+        options.gop <= 0 || options.p_mean < 16) {
+        ShowHelp(argv[0], EXIT_FAILURE);
+    }
+    if (options.key_mean <= 0) {
+        options.key_mean = options.p_mean * 8;
+    }
+    rng_state = options.seed ? options.seed : 1;
+
+    Payload_t *video = NULL, *audio = NULL;
+    size_t video_count = 0, audio_count = 0;
+    if (options.source && !LoadSource(&options, &video, &video_count, &audio, &audio_count)) {
+        exit(1);
+    }
+
+    FILE *fp = fopen(argv[optind], "wb");
+    if (!fp) {
+        fprintf(stderr, "Cannot open %s for writing.\n", argv[optind]);
+        exit(1);
+    }
+
+    HXVSFrame_t hxvs = {options.width, options.height, {0}};
+    if (!WriteRecord(fp, options.video_header, &hxvs, sizeof(hxvs), NULL, 0)) {
+        fprintf(stderr, "Write error, aborting.\n");
+        exit(1);
+    }
+
+    uint32_t *key_index = Allocate(HXFI_INDEX_LENGTH);
+    memset(key_index, 0, HXFI_INDEX_LENGTH);
+    size_t key_index_count = 0;
+
+    uint32_t audio_packet_length = (uint32_t) options.audio_rate * AUDIO_PACKET_MS / 1000;
+    uint8_t *buffer = NULL;
+    size_t buffer_size = 0;
+    long frames_count = (long) (options.duration * options.fps);
+    long frames_per_gop = (long) round(options.gop * options.fps);
+    if (frames_per_gop < 1) {
+        frames_per_gop = 1;
+    }
+    long frame = 0, audio_packet = 0;
+    size_t video_next = 0, audio_next = 0;
+    const int param_sets_count = options.video_header == HXVT ? 3 : 2;
+    uint64_t bytes_written = 0;
+    uint32_t last_video_ms = 0;
+
+    while (frame < frames_count) {
+        double video_ms = (double) frame * 1000.0 / options.fps;
+        double audio_ms = (double) audio_packet * AUDIO_PACKET_MS;
+        bool write_audio = audio_packet_length && audio_ms < video_ms;
+        uint32_t timestamp = options.ts_initial + (uint32_t) round(write_audio ? audio_ms : video_ms);
+        off_t offset;
+
+        if (write_audio) {
+            HXAFFrame_t hxaf;
+            uint8_t *payload;
+            memset(&hxaf, 0, sizeof(hxaf));
+
+            if (audio_count) {
+                payload = audio[audio_next].data;
+                hxaf.length = audio[audio_next].length + 4;
+                audio_next = (audio_next + 1) % audio_count;
+            } else {
+                if (buffer_size < audio_packet_length) {
+                    free(buffer);
+                    buffer = Allocate(buffer_size = audio_packet_length);
+                }
+                for (uint32_t i = 0; i < audio_packet_length; i++) { // quiet noise around a-law silence
+                    buffer[i] = (uint8_t) (ALAW_SILENCE ^ (Random() & 0x03));
+                }
+                payload = buffer;
+                hxaf.length = audio_packet_length + 4;
+            }
+            hxaf.timestamp = timestamp;
+            hxaf.padding[5] = 1; // audio frame header: 0x00 0x01, then the payload length in 16 bit words
+            hxaf.padding[6] = (uint8_t) ((hxaf.length - 4) / 2);
+            hxaf.padding[7] = (uint8_t) ((hxaf.length - 4) / 512);
+
+            if (options.corruption_rate > 0 && RandomUniform() < options.corruption_rate) {
+                Corrupt(fp, NULL, 0, &hxaf.timestamp);
+            }
+            if (!WriteRecord(fp, HXAF, &hxaf, sizeof(hxaf), payload, hxaf.length - 4)) {
+                fprintf(stderr, "Write error, aborting.\n");
+                exit(1);
+            }
+            bytes_written += sizeof(uint32_t) + sizeof(hxaf) + hxaf.length - 4;
+            audio_packet++;
+            continue;
+        }
+
+        // One video frame: parameter sets and key frame at the beginning of each GOP, P-frame otherwise
+        bool key_frame;
+        int records = 1;
+        if (video_count) {
+            key_frame = video[video_next].type == HXVF_TYPE_I;
+            while (key_frame && records < (int) video_count &&
+                   video[(video_next + records) % video_count].type == HXVF_TYPE_I) {
+                records++;
+            }
+        } else {
+            key_frame = frame % frames_per_gop == 0;
+            if (key_frame) {
+                records = param_sets_count + 1;
+            }
+        }
+
+        for (int r = 0; r < records; r++) {
+            HXVFFrame_t hxvf;
+            uint8_t *payload;
+
+            if (video_count) {
+                payload = video[video_next].data;
+                hxvf.length = video[video_next].length;
+                hxvf.type = video[video_next].type;
+                video_next = (video_next + 1) % video_count;
+            } else {
+                int nal_type;
+                if (!key_frame) {
+                    hxvf.length = RandomSize(options.p_mean, options.size_variation);
+                    nal_type = 1;
+                } else if (r < param_sets_count) {
+                    hxvf.length = 16;
+                    nal_type = options.video_header == HXVT ? 32 + r : 7 + r;
+                } else {
+                    hxvf.length = RandomSize(options.key_mean, options.size_variation);
+                    nal_type = options.video_header == HXVT ? 19 : 5;
+                }
+                if (buffer_size < hxvf.length) {
+                    free(buffer);
+                    buffer = Allocate(buffer_size = hxvf.length);
+                }
+                SyntheticNal(buffer, hxvf.length, options.video_header, nal_type);
+                payload = buffer;
+                hxvf.type = key_frame ? HXVF_TYPE_I : HXVF_TYPE_P;
+            }
+            hxvf.timestamp = timestamp;
+
+            if (options.corruption_rate > 0 && RandomUniform() < options.corruption_rate) {
+                if (video_count) { // don't damage the source payloads, which are reused
+                    if (buffer_size < hxvf.length) {
+                        free(buffer);
+                        buffer = Allocate(buffer_size = hxvf.length);
+                    }
+                    memcpy(buffer, payload, hxvf.length);
+                    payload = buffer;
+                }
+                Corrupt(fp, payload, hxvf.length, &hxvf.timestamp);
+            }
+
+            // Camera index entries point to every record of a key frame, times are relative to the first frame
+            offset = ftello(fp);
+            if (key_frame && key_index_count < HXFI_INDEX_LENGTH / 8 - 1 && (uint64_t) offset <= UINT32_MAX) {
+                key_index[key_index_count * 2] = (uint32_t) offset;
+                key_index[key_index_count * 2 + 1] = (uint32_t) round(video_ms);
+                key_index_count++;
+            }
+
+            if (!WriteRecord(fp, HXVF, &hxvf, sizeof(hxvf), payload, hxvf.length)) {
+                fprintf(stderr, "Write error, aborting.\n");
+                exit(1);
+            }
+            bytes_written += sizeof(uint32_t) + sizeof(hxvf) + hxvf.length;
+            last_video_ms = (uint32_t) round(video_ms);
+        }
+        frame++;
+    }
+
+    // Trailer: index length, duration in ms, a field of unknown meaning, then offset and time of key frames. Cameras
+    // write the time of the last video frame from the first one as duration.
+    uint32_t hxfi[3] = {HXFI, HXFI_INDEX_LENGTH, last_video_ms};
+    uint32_t unknown = 0;
+    if (fwrite(hxfi, sizeof(hxfi), 1, fp) != 1 || fwrite(&unknown, sizeof(unknown), 1, fp) != 1 ||
+        fwrite(key_index, HXFI_INDEX_LENGTH, 1, fp) != 1 || fclose(fp) != 0) {
+        fprintf(stderr, "Write error, aborting.\n");
+        exit(1);
+    }
+
+    fprintf(stderr, "Generated %ld video frames and %ld audio packets, %.1f MB.\n", frames_count, audio_packet,
+            (double) bytes_written / 1e6);
+
+    for (size_t i = 0; i < video_count; i++) {
+        free(video[i].data);
+    }
+    for (size_t i = 0; i < audio_count; i++) {
+        free(audio[i].data);
+    }
+    free(video);
+    free(audio);
+    free(buffer);
+    free(key_index);
+    return 0;
+}
@@ -0,0 +1,196 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hxindex.h"
+
+#define HEAD_HASH_LENGTH    65536
+
+// FNV-1a over the first bytes of the file: together with size and modification time it tells apart clips that
+// have the same name, like those recorded at the same time by different cameras
+static bool HashHead(int fd, uint64_t *hash) {
+    uint8_t buffer[HEAD_HASH_LENGTH];
+    ssize_t length = pread(fd, buffer, sizeof(buffer), 0);
+    if (length < 0) {
+        return false;
+    }
+
+    *hash = 14695981039346656037ULL;
+    for (ssize_t i = 0; i < length; i++) {
+        *hash ^= buffer[i];
+        *hash *= 1099511628211ULL;
+    }
+    return true;
+}
+
+static bool ReadKey(const char *in_filename, struct stat *st, uint64_t *head_hash) {
+    int fd = open(in_filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool success = fstat(fd, st) == 0 && HashHead(fd, head_hash);
+    close(fd);
+    return success;
+}
+
+// Index path is either "clip.264.idx" next to the input or, when a cache directory is given,
+// "dir/clip.264-<head hash>.idx" so that clips with the same name don't evict each other
+static char *IndexPath(const char *in_filename, const char *index_dir, uint64_t head_hash) {
+    char *path;
+    size_t length;
+
+    if (index_dir) {
+        char *in_copy = strdup(in_filename);
+        if (in_copy == NULL) {
+            return NULL;
+        }
+        const char *name = basename(in_copy);
+        length = strlen(index_dir) + strlen(name) + 18 + sizeof(HXINDEX_EXTENSION) + 1;
+        if ((path = malloc(length))) {
+            snprintf(path, length, "%s/%s-%016llx%s", index_dir, name, (unsigned long long) head_hash,
+                     HXINDEX_EXTENSION);
+        }
+        free(in_copy);
+    } else {
+        length = strlen(in_filename) + sizeof(HXINDEX_EXTENSION);
+        if ((path = malloc(length))) {
+            snprintf(path, length, "%s%s", in_filename, HXINDEX_EXTENSION);
+        }
+    }
+    return path;
+}
+
+bool HXIndexOpen(const char *in_filename, const char *index_dir, HXIndex_t *index) {
+    struct stat in_st, idx_st;
+    uint64_t head_hash;
+
+    memset(index, 0, sizeof(HXIndex_t));
+    if (!ReadKey(in_filename, &in_st, &head_hash)) {
+        return false;
+    }
+
+    char *path = IndexPath(in_filename, index_dir, head_hash);
+    if (path == NULL) {
+        return false;
+    }
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0) {
+        return false;
+    }
+
+    if (fstat(fd, &idx_st) < 0 || (size_t) idx_st.st_size < sizeof(HXIndexHeader_t)) {
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(NULL, idx_st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    const HXIndexHeader_t *header = map;
+    if (memcmp(header->magic, HXINDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != HXINDEX_VERSION ||
+        header->entry_size != sizeof(HXPacketEntry_t) ||
+        header->info_size != sizeof(HXStreamInfo_t) ||
+        header->source_size != (uint64_t) in_st.st_size ||
+        header->source_mtime_sec != (int64_t) in_st.st_mtim.tv_sec ||
+        header->source_mtime_nsec != (int64_t) in_st.st_mtim.tv_nsec ||
+        header->source_head_hash != head_hash ||
+        header->entries_count > (idx_st.st_size - sizeof(HXIndexHeader_t)) / sizeof(HXPacketEntry_t)) {
+        munmap(map, idx_st.st_size);
+        return false;
+    }
+
+    index->map = map;
+    index->map_size = idx_st.st_size;
+    index->header = header;
+    index->entries = (const HXPacketEntry_t *) (header + 1);
+    return true;
+}
+
+void HXIndexClose(HXIndex_t *index) {
+    if (index->map) {
+        munmap(index->map, index->map_size);
+    }
+    memset(index, 0, sizeof(HXIndex_t));
+}
+
+bool HXIndexWrite(const char *in_filename, const char *index_dir, const HXStreamInfo_t *info,
+                  const HXPacketEntry_t *entries, size_t entries_count) {
+    struct stat in_st;
+    HXIndexHeader_t header;
+
+    memset(&header, 0, sizeof(header));
+    if (!ReadKey(in_filename, &in_st, &header.source_head_hash)) {
+        return false;
+    }
+    memcpy(header.magic, HXINDEX_MAGIC, sizeof(header.magic));
+    header.version = HXINDEX_VERSION;
+    header.entry_size = sizeof(HXPacketEntry_t);
+    header.info_size = sizeof(HXStreamInfo_t);
+    header.source_size = in_st.st_size;
+    header.source_mtime_sec = in_st.st_mtim.tv_sec;
+    header.source_mtime_nsec = in_st.st_mtim.tv_nsec;
+    header.info = *info;
+    header.entries_count = entries_count;
+
+    char *path = IndexPath(in_filename, index_dir, header.source_head_hash);
+    if (path == NULL) {
+        return false;
+    }
+
+    // Write to a temporary file first, so that concurrent readers never map a partial index
+    size_t tmp_length = strlen(path) + 8;
+    char *tmp_path = malloc(tmp_length);
+    if (tmp_path == NULL) {
+        free(path);
+        return false;
+    }
+    snprintf(tmp_path, tmp_length, "%s.XXXXXX", path);
+
+    bool success = false;
+    int fd = mkstemp(tmp_path);
+    if (fd >= 0) {
+        FILE *fp = fdopen(fd, "wb");
+        if (fp) {
+            success = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+                      fwrite(entries, sizeof(HXPacketEntry_t), entries_count, fp) == entries_count;
+            success = (fclose(fp) == 0) && success;
+        } else {
+            close(fd);
+        }
+        if (success) {
+            success = chmod(tmp_path, 0644) == 0 && rename(tmp_path, path) == 0;
+        }
+        if (!success) {
+            unlink(tmp_path);
+        }
+    }
+
+    free(tmp_path);
+    free(path);
+    return success;
+}
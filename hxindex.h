@@ -0,0 +1,63 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef HXINDEX_H
+#define HXINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "hxscan.h"
+
+#define HXINDEX_MAGIC       "HXIDX\r\n\032"
+#define HXINDEX_VERSION     1
+#define HXINDEX_EXTENSION   ".idx"
+
+// An index file is this header followed by entries_count HXPacketEntry_t. It is a cache private to the machine
+// that wrote it: fields are stored in native byte order and layout, which the version and sizes below guard.
+typedef struct HXIndexHeader_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t info_size;
+    uint32_t reserved;
+    // Key of the input file the index was generated from
+    uint64_t source_size;
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+    uint64_t source_head_hash;
+    HXStreamInfo_t info;
+    uint64_t entries_count;
+} HXIndexHeader_t;
+
+typedef struct HXIndex_t {
+    void *map;
+    size_t map_size;
+    const HXIndexHeader_t *header;
+    const HXPacketEntry_t *entries;
+} HXIndex_t;
+
+// Maps the index of in_filename, stored next to it or in index_dir if not NULL. Returns false if there is no
+// index or if it doesn't match the current size, modification time and first bytes of the input file.
+bool HXIndexOpen(const char *in_filename, const char *index_dir, HXIndex_t *index);
+
+void HXIndexClose(HXIndex_t *index);
+
+// Writes the index of in_filename, replacing any existing one
+bool HXIndexWrite(const char *in_filename, const char *index_dir, const HXStreamInfo_t *info,
+                  const HXPacketEntry_t *entries, size_t entries_count);
+
+#endif
@@ -0,0 +1,249 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include <sys/types.h>
+#include "hxscan.h"
+
+#define TIMEBASE_MS         1000.0f
+
+static size_t HXFrameDataSize(uint32_t header) {
+    switch (header) {
+        case HXVS:
+            return sizeof(HXVSFrame_t);
+        case HXVT:
+            return sizeof(HXVTFrame_t);
+        case HXVF:
+            return sizeof(HXVFFrame_t);
+        case HXAF:
+            return sizeof(HXAFFrame_t);
+        case HXFI:
+            return sizeof(HXFIFrame_t);
+        default:
+            return 0;
+    }
+}
+
+bool HXReadFrame(FILE *fp, HXFrame_t *frame) {
+    if (fread(&frame->header, 1, sizeof(frame->header), fp) != sizeof(frame->header)) {
+        return false;
+    }
+
+    size_t data_size = HXFrameDataSize(frame->header);
+    if (data_size && fread(&frame->data, 1, data_size, fp) != data_size) {
+        return false;
+    }
+    return true;
+}
+
+size_t HXParseFrame(const uint8_t *data, size_t size, HXFrame_t *frame) {
+    if (size < sizeof(frame->header)) {
+        return 0;
+    }
+    memcpy(&frame->header, data, sizeof(frame->header));
+
+    size_t data_size = HXFrameDataSize(frame->header);
+    if (size < sizeof(frame->header) + data_size) {
+        return 0;
+    }
+    memcpy(&frame->data, data + sizeof(frame->header), data_size);
+    return sizeof(frame->header) + data_size;
+}
+
+long HXPayloadLength(const HXFrame_t *frame) {
+    switch (frame->header) {
+        case HXVF:
+            return frame->data.hxvf.length;
+        case HXAF: // length accounts for the 4 byte audio header at the end of the fixed-size part
+            return frame->data.hxaf.length >= 4 ? frame->data.hxaf.length - 4 : 0;
+        case HXFI:
+            return frame->data.hxfi.length >= 4 ? frame->data.hxfi.length - 4 : 0;
+        default:
+            return 0;
+    }
+}
+
+bool HXSkipPayload(FILE *fp, const HXFrame_t *frame) {
+    long length = HXPayloadLength(frame);
+    if (length == 0) {
+        return true;
+    }
+    return fseek(fp, length, SEEK_CUR) == 0;
+}
+
+// Camera frequencies are nominally standard ones, the average measured from the ms timestamps is only close to them
+int HXNominalSampleRate(double samples_per_ms) {
+    static const int rates[] = {8000, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000};
+    double measured = samples_per_ms * TIMEBASE_MS;
+    for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+        if (fabs(measured - rates[i]) < rates[i] * 0.03) {
+            return rates[i];
+        }
+    }
+    return (int) round(measured);
+}
+
+static void AppendEntry(HXPacketEntry_t **entries, size_t *entries_count, size_t *entries_size, off_t offset,
+                        const HXFrame_t *frame) {
+    if (*entries_count == *entries_size) {
+        *entries_size = *entries_size ? *entries_size * 2 : 4096;
+        *entries = realloc(*entries, *entries_size * sizeof(HXPacketEntry_t));
+        if (*entries == NULL) {
+            fprintf(stderr, "Cannot allocate memory, aborting.\n");
+            exit(1);
+        }
+    }
+
+    HXPacketEntry_t *entry = *entries + (*entries_count)++;
+    entry->offset = (uint64_t) offset;
+    entry->length = (uint32_t) HXPayloadLength(frame);
+    entry->header = frame->header;
+    if (frame->header == HXVF) {
+        entry->timestamp = frame->data.hxvf.timestamp;
+        entry->type = frame->data.hxvf.type;
+    } else {
+        entry->timestamp = frame->data.hxaf.timestamp;
+        entry->type = 0;
+    }
+}
+
+// Scans up to the HXFI trailer, or until sample_ms of video have been seen
+static bool HXScan(FILE *fp, HXStreamInfo_t *info, HXPacketEntry_t **entries, size_t *entries_count, long sample_ms) {
+    bool hxfi_detected = false, sampled = false;
+    HXFrame_t hx_frame;
+    long video_ts_prev = -1, audio_ts_prev = -1;
+    size_t entries_size = 0;
+
+    memset(info, 0, sizeof(HXStreamInfo_t));
+    info->video_ts_initial = info->audio_ts_initial = -1;
+    if (entries) {
+        *entries = NULL;
+        *entries_count = 0;
+    }
+
+    do {
+        off_t offset = ftello(fp);
+        if (!HXReadFrame(fp, &hx_frame)) {
+            fprintf(stderr, "Premature end of file, aborting.\n");
+            free(entries ? *entries : NULL);
+            return false;
+        }
+
+        switch (hx_frame.header) {
+
+            case HXVS:
+            case HXVT:
+                info->video_header = hx_frame.header;
+                info->video_w = (int32_t) hx_frame.data.hxvs.width;
+                info->video_h = (int32_t) hx_frame.data.hxvs.height;
+                break;
+
+            case HXVF:
+                if (info->video_ts_initial == -1) {
+                    info->video_ts_initial = hx_frame.data.hxvf.timestamp;
+                    video_ts_prev = hx_frame.data.hxvf.timestamp;
+                } else {
+                    long elapsed, timestamp;
+                    timestamp = hx_frame.data.hxvf.timestamp - info->video_ts_initial;
+                    if (timestamp > video_ts_prev) {
+                        elapsed = timestamp - video_ts_prev;
+                        if (info->video_packets_count) {
+                            info->video_avg_frame_rate =
+                                    (info->video_avg_frame_rate * (double) info->video_packets_count +
+                                     (TIMEBASE_MS / (double) elapsed)) /
+                                    ((double) info->video_packets_count + 1);
+                        } else {
+                            info->video_avg_frame_rate = TIMEBASE_MS / (double) elapsed;
+                        }
+                        info->video_packets_count++;
+                    }
+                    video_ts_prev = timestamp;
+                }
+                sampled = HXElapsed(hx_frame.data.hxvf.timestamp, (uint32_t) info->video_ts_initial) >= sample_ms;
+
+                if (entries) {
+                    AppendEntry(entries, entries_count, &entries_size, offset, &hx_frame);
+                }
+
+                if (!HXSkipPayload(fp, &hx_frame)) {
+                    fprintf(stderr, "Premature end of file, aborting.\n");
+                    free(entries ? *entries : NULL);
+                    return false;
+                }
+                break;
+
+            case HXAF:
+                if (info->audio_ts_initial == -1) {
+                    info->audio_ts_initial = hx_frame.data.hxaf.timestamp;
+                    audio_ts_prev = hx_frame.data.hxaf.timestamp;
+                } else {
+                    long elapsed, timestamp;
+                    timestamp = hx_frame.data.hxaf.timestamp - info->audio_ts_initial;
+                    if (timestamp > audio_ts_prev) {
+                        elapsed = timestamp - audio_ts_prev;
+                        if (info->audio_packets_count) {
+                            info->audio_avg_sample_rate =
+                                    ((info->audio_avg_sample_rate * (double) info->audio_packets_count) +
+                                     ((hx_frame.data.hxaf.length - 4) / (double) elapsed)) /
+                                    ((double) info->audio_packets_count + 1);
+                        } else {
+                            info->audio_avg_sample_rate = (hx_frame.data.hxaf.length - 4) / (double) elapsed;
+                        }
+                        info->audio_packets_count++;
+                    }
+                    audio_ts_prev = timestamp;
+                }
+
+                if (entries) {
+                    AppendEntry(entries, entries_count, &entries_size, offset, &hx_frame);
+                }
+
+                if (!HXSkipPayload(fp, &hx_frame)) {
+                    fprintf(stderr, "Premature end of file, aborting.\n");
+                    free(entries ? *entries : NULL);
+                    return false;
+                }
+                break;
+
+            case HXFI:
+                hxfi_detected = true;
+                break;
+
+            default:
+                fprintf(stderr, "Unknown audio_frame header: %u.\n", hx_frame.header);
+                break;
+        }
+
+    } while ((!feof(fp)) && (!hxfi_detected) && (!sampled));
+
+    if (fseek(fp, 0, SEEK_SET) < 0) {
+        fprintf(stderr, "Cannot seek back to beginning of file, aborting.\n");
+        free(entries ? *entries : NULL);
+        return false;
+    }
+    return true;
+}
+
+bool HXScanStream(FILE *fp, HXStreamInfo_t *info, HXPacketEntry_t **entries, size_t *entries_count) {
+    return HXScan(fp, info, entries, entries_count, LONG_MAX);
+}
+
+bool HXScanSample(FILE *fp, HXStreamInfo_t *info, long sample_ms) {
+    return HXScan(fp, info, NULL, NULL, sample_ms);
+}
@@ -0,0 +1,76 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef HXSCAN_H
+#define HXSCAN_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "ipcamvideofilefmt.h"
+
+// Stream parameters detected by a full scan of the record headers
+typedef struct HXStreamInfo_t {
+    uint32_t video_header;          // HXVS (h264) or HXVT (h265), 0 if no video header was found
+    int32_t video_w, video_h;
+    double video_avg_frame_rate;    // frames per second
+    double audio_avg_sample_rate;   // samples per millisecond, 0 if no audio
+    int64_t video_ts_initial, audio_ts_initial;
+    int64_t video_packets_count, audio_packets_count;
+} HXStreamInfo_t;
+
+// Location of an audio or video payload in the input file
+typedef struct HXPacketEntry_t {
+    uint64_t offset;    // offset of the record header
+    uint32_t length;    // payload length
+    uint32_t timestamp;
+    uint32_t header;    // HXVF or HXAF
+    uint32_t type;      // HXVF frame type, 0 for audio
+} HXPacketEntry_t;
+
+// Reads the header and the fixed-size part of the next record. Returns false at end of file or if the record is
+// truncated. Unknown headers are returned as they are, with no data, so that callers can report them.
+bool HXReadFrame(FILE *fp, HXFrame_t *frame);
+
+// Same as HXReadFrame, on a record held in memory. Returns the number of bytes of the header and of the fixed-size
+// part, or 0 if the record is truncated.
+size_t HXParseFrame(const uint8_t *data, size_t size, HXFrame_t *frame);
+
+// Number of payload bytes following the fixed-size part of a record
+long HXPayloadLength(const HXFrame_t *frame);
+
+// Skips the payload of a record without reading it
+bool HXSkipPayload(FILE *fp, const HXFrame_t *frame);
+
+// Scans the whole input, seeking past payloads, to detect video size, frame rate and audio sample rate. If entries
+// is not NULL, it is set to a newly allocated array locating every audio and video payload. The file is left
+// positioned at the beginning.
+bool HXScanStream(FILE *fp, HXStreamInfo_t *info, HXPacketEntry_t **entries, size_t *entries_count);
+
+// Same as HXScanStream, stopping after sample_ms of video, for inputs still being written. Packet counts and the
+// rates only cover the sample.
+bool HXScanSample(FILE *fp, HXStreamInfo_t *info, long sample_ms);
+
+// Standard audio sampling frequency closest to the given average number of samples per ms, or the average itself in Hz
+int HXNominalSampleRate(double samples_per_ms);
+
+// Milliseconds elapsed between two camera timestamps, accounting for the 32 bit counter wrapping around. Negative if
+// timestamp comes before origin.
+static inline long HXElapsed(uint32_t timestamp, uint32_t origin) {
+    return (long) (int32_t) (timestamp - origin);
+}
+
+#endif
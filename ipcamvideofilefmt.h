@@ -34,10 +34,12 @@ typedef struct HXVTFrame_t {
 } HXVTFrame_t;
 
 #define HXVF 1180063816
+#define HXVF_TYPE_I 1 // key frame and the parameter sets preceding it
+#define HXVF_TYPE_P 2 // predicted frame
 typedef struct HXVFFrame_t {
     uint32_t length;
     uint32_t timestamp;
-    uint8_t  padding[4];
+    uint32_t type;
 } HXVFFrame_t;
 
 #define HXAF 1178687560
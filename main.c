@@ -20,73 +20,140 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
-#include <stdint.h>
-#include <math.h>
+#include <time.h>
 #include <getopt.h>
 #include <libgen.h>
-#include <libavutil/opt.h>
-#include <libavutil/mathematics.h>
-#include <libavutil/timestamp.h>
-#include <libavcodec/avcodec.h>
-#include <libavformat/avformat.h>
 #include <unistd.h>
-#include "ipcamvideofilefmt.h"
-
-#define MAX_EXTENSION_LEN   12
-#define TIMEBASE_MS         1000.0f
-
-size_t ReadToBuffer(FILE *fp_src, uint8_t **dest, size_t dest_offset, unsigned long length, size_t *dest_size) {
-
-    if (length == 0) {
-        return 0;
-    }
-
-    // Resize the buffer if needed
-    if (*dest && (*dest_size < length + dest_offset)) {
-        if (dest_offset) { // appending data to a previous read, we need to keep the data
-            *dest = realloc(*dest, length + dest_offset);
-            if (*dest == NULL) {
-                fprintf(stderr, "Cannot re-allocate memory, aborting.\n");
-                exit(1);
-            }
-        } else { // we just need a larger buffer, we can discard existing data if any
-            free(*dest);
-            *dest = NULL;
-        }
-    }
-
-    // Allocate the buffer if needed
-    if (*dest == NULL) {
-        *dest = malloc(length + dest_offset);
-        if (*dest == NULL) {
-            fprintf(stderr, "Cannot allocate memory, aborting.\n");
-            exit(1);
-        }
-    }
-
-    *dest_size = length + dest_offset;
-    return fread(*dest + dest_offset, 1, length, fp_src);
-}
-
-bool EndsWith(const char *str, const char *suffix) {
-    if (!str || !suffix) {
-        return false;
-    }
-    size_t lenstr = strlen(str);
-    size_t lensuffix = strlen(suffix);
-    if (lensuffix > lenstr) {
-        return false;
+#include "convert.h"
+#include "batch.h"
+#include "metrics.h"
+#include "timeline.h"
+#include "wav.h"
+#include "rawes.h"
+#include "check.h"
+#include "probe.h"
+#include "serve.h"
+#include "merge.h"
+#include "tee.h"
+#include "follow.h"
+#include "trace.h"
+
+enum LongOptions {
+    OPT_TIMELINE = 256,
+    OPT_INDEX,
+    OPT_METRICS,
+    OPT_AUDIO_CODEC,
+    OPT_WAV,
+    OPT_RAW,
+    OPT_DEDUP_PS,
+    OPT_RESUME,
+    OPT_CHECK,
+    OPT_PROBE,
+    OPT_SERVE,
+    OPT_MERGE,
+    OPT_MEM_LIMIT,
+    OPT_DEVICE_JOBS,
+    OPT_PHYSICAL_ORDER,
+    OPT_EVENT_LOOP,
+    OPT_TEE,
+    OPT_FOLLOW,
+    OPT_TRACE
+};
+
+// Parses a number of bytes with an optional K, M or G suffix, returning 0 if invalid
+static size_t ParseSize(const char *str) {
+    char *end;
+    unsigned long long size = strtoull(str, &end, 10);
+    switch (*end) {
+        case 'G':
+        case 'g':
+            size *= 1024;
+            // fall through
+        case 'M':
+        case 'm':
+            size *= 1024;
+            // fall through
+        case 'K':
+        case 'k':
+            size *= 1024;
+            end++;
+            break;
     }
-    return strncmp(str + lenstr - lensuffix, suffix, lensuffix) == 0;
+    return end == str || *end != '\0' ? 0 : (size_t) size;
 }
 
 void ShowHelp(char *command, int exitcode) {
     fprintf(stderr, "Convert surveillance cameras \".264/.265\" files into any a/v format supported by LibAV/FFMpeg.\n");
-    fprintf(stderr, "Usage: %s [-n] [-f format_name] [-q] input.264 [output.fmt]\n", basename(command));
+    fprintf(stderr, "Usage: %s [-n] [-f format_name] [-q] [--index[=dir]] input.264 [output.fmt]\n", basename(command));
+    fprintf(stderr, "       %s -b [-j jobs] [--metrics [host:]port] [options] input.264... | -\n", basename(command));
+    fprintf(stderr, "       %s --timeline input.264 [output.json]\n", basename(command));
+    fprintf(stderr, "       %s --wav alaw|pcm input.264 [output.wav]\n", basename(command));
+    fprintf(stderr, "       %s --raw input.264 [output.h264]\n", basename(command));
+    fprintf(stderr, "       %s --check [-j jobs] [-q] input.264...\n", basename(command));
+    fprintf(stderr, "       %s --probe [-j jobs] [--index[=dir]] input.264...\n", basename(command));
+    fprintf(stderr, "       %s --serve [host:]port [--event-loop] [-n] [--index=dir] directory\n", basename(command));
+    fprintf(stderr, "       %s --merge output.fmt [-n] [-f format_name] [-q] [-y] input.264...\n", basename(command));
+    fprintf(stderr, "       %s --tee 'output.fmt|[f=fmt:opt=value]output...' [-n] [-q] [-y] input.264\n",
+            basename(command));
     fprintf(stderr, "  -n              Ignore audio data\n");
     fprintf(stderr, "  -f format_name  Force output format to format_name (default: -f matroska)\n");
     fprintf(stderr, "  -q              Quiet output. Only print errors.\n");
     fprintf(stderr, "  -y              Overwrite output file if it exists.\n");
+    fprintf(stderr, "  --audio-codec copy|aac|opus\n");
+    fprintf(stderr, "                  Transcode a-law audio to AAC or Opus, for MP4 and browser playback.\n");
+    fprintf(stderr, "                  Video is always copied. (default: copy)\n");
+    fprintf(stderr, "  --dedup-ps      Only keep video parameter sets repeated before key frames when they\n");
+    fprintf(stderr, "                  change. Players read them from the container header instead.\n");
+    fprintf(stderr, "  --resume        Write fragmented output with periodic checkpoints, and if a previous\n");
+    fprintf(stderr, "                  run was interrupted continue from its last checkpoint.\n");
+    fprintf(stderr, "  --mem-limit size\n");
+    fprintf(stderr, "                  Keep each conversion within size bytes (K, M or G suffix, at least\n");
+    fprintf(stderr, "                  8M) using fixed buffers, and fail on packets that don't fit.\n");
+    fprintf(stderr, "  --follow[=seconds]\n");
+    fprintf(stderr, "                  Convert an input the camera is still writing as it grows, until its\n");
+    fprintf(stderr, "                  trailer shows up or it stops growing for seconds (default: 30).\n");
+    fprintf(stderr, "  -b              Batch mode: convert every input file, generating output names. With\n");
+    fprintf(stderr, "                  \"-\" input names are also read from standard input, one per line.\n");
+    fprintf(stderr, "  -j jobs         Number of conversions to run at the same time in batch mode (default: 1)\n");
+    fprintf(stderr, "  --device-jobs hdd[,ssd]\n");
+    fprintf(stderr, "                  Most conversions reading from the same rotational disk, and from the\n");
+    fprintf(stderr, "                  same other device, at the same time in batch mode (default: 1,jobs)\n");
+    fprintf(stderr, "  --physical-order\n");
+    fprintf(stderr, "                  Convert inputs on rotational disks in the order they are laid out on\n");
+    fprintf(stderr, "                  the disk rather than largest first, in batch mode.\n");
+    fprintf(stderr, "  --metrics [host:]port\n");
+    fprintf(stderr, "                  Serve conversion metrics in Prometheus text format over HTTP. If no\n");
+    fprintf(stderr, "                  host is given, only the loopback interface is used.\n");
+    fprintf(stderr, "  --trace out.json\n");
+    fprintf(stderr, "                  Record how long each stage of the conversions takes, and sampled\n");
+    fprintf(stderr, "                  packets, as a Chrome trace for Perfetto, a track per batch worker.\n");
+    fprintf(stderr, "  --index[=dir]   Cache stream parameters and packet locations in input.26x.idx, or in\n");
+    fprintf(stderr, "                  dir if given, so that later runs on the same file skip the first pass.\n");
+    fprintf(stderr, "  --timeline      Don't convert, write a per-second activity timeline (video bitrate,\n");
+    fprintf(stderr, "                  P-frame sizes, key frame interval, audio presence) as JSON to\n");
+    fprintf(stderr, "                  output.json or standard output. Only record headers are read.\n");
+    fprintf(stderr, "  --wav alaw|pcm  Don't convert, extract audio as an a-law or 16 bit PCM WAV file to\n");
+    fprintf(stderr, "                  output.wav or standard output. Video data is skipped, not read.\n");
+    fprintf(stderr, "  --raw           Don't convert, write the bare h264/h265 Annex-B video stream to\n");
+    fprintf(stderr, "                  output.h264 (.hevc) or standard output, without using LibAV.\n");
+    fprintf(stderr, "  --check         Don't convert, verify the structure of every input file (records,\n");
+    fprintf(stderr, "                  timestamps, NAL start codes, trailer index) and print a verdict for\n");
+    fprintf(stderr, "                  each. With -q only failing files are listed.\n");
+    fprintf(stderr, "  --probe         Don't convert, print codec, dimensions, rates, duration, packet counts\n");
+    fprintf(stderr, "                  and timestamps of every input file as a line of JSON. Only the first\n");
+    fprintf(stderr, "                  seconds and the trailer are read, counts are estimated from them.\n");
+    fprintf(stderr, "  --serve [host:]port\n");
+    fprintf(stderr, "                  Serve the clips in directory over HTTP, remuxed on request to\n");
+    fprintf(stderr, "                  fragmented MP4: /dir/clip.264.mp4 is directory/dir/clip.264. If no\n");
+    fprintf(stderr, "                  host is given, only the loopback interface is used.\n");
+    fprintf(stderr, "  --event-loop    With --serve, remux all requests in a single thread instead of a\n");
+    fprintf(stderr, "                  process per request.\n");
+    fprintf(stderr, "  --merge output.fmt\n");
+    fprintf(stderr, "                  Mux clips of several cameras into output.fmt, a video and an audio\n");
+    fprintf(stderr, "                  track per clip, aligned on the start time in their names.\n");
+    fprintf(stderr, "  --tee outputs   Write several outputs reading input.26x once: file names separated by\n");
+    fprintf(stderr, "                  '|', each optionally preceded by [opt=value:...] muxer options, f=fmt\n");
+    fprintf(stderr, "                  setting its format.\n");
     fprintf(stderr, "  input.26x       Input video file as produced by camera\n");
     fprintf(stderr, "  output.fmt      Output file. Format is guessed by extension (ex: output.mkv\n");
     fprintf(stderr, "                  will produce a Matroska file). If no output file is specified\n");
@@ -95,489 +162,257 @@ void ShowHelp(char *command, int exitcode) {
     exit(exitcode);
 }
 
-bool InitAVStreams(AVFormatContext *format_ctx, int video_w, int video_h, enum AVCodecID video_id,
-                   double video_avg_frame_rate, long video_packets_count, double audio_avg_sample_rate) {
-    int retval;
-
-    // Video stream. Video codec is only used to generate a valid header, not for actual encoding
-    const AVCodec *v_codec = avcodec_find_encoder(video_id);
-    AVStream *v_stream = avformat_new_stream(format_ctx, v_codec);
-    if (!v_stream) {
-        fprintf(stderr, "Could not allocate stream.\n");
-        return false;
-    }
-
-    AVCodecContext *v_encoder = avcodec_alloc_context3(v_codec);
-    v_encoder->time_base = (AVRational) {1, TIMEBASE_MS}; // Raw stream timestamps are in milliseconds
-    v_encoder->framerate = (AVRational) {(int) round(video_avg_frame_rate), 1};
-    v_encoder->pix_fmt = AV_PIX_FMT_YUV420P;
-    v_encoder->width = video_w;
-    v_encoder->height = video_h;
-    if (format_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
-        v_encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-    }
-
-    if ((retval = avcodec_open2(v_encoder, v_codec, NULL)) < 0) {
-        fprintf(stderr, "Could not open codec: %s\n", av_err2str(retval));
-        return false;
-    }
-
-    if ((retval = avcodec_parameters_from_context(v_stream->codecpar, v_encoder)) < 0) {
-        fprintf(stderr, "Could not set video stream parameters: %s\n", av_err2str(retval));
-        return false;
-    }
-
-    // We only need the encoder for parameters
-    avcodec_free_context(&v_encoder);
-
-    v_stream->avg_frame_rate = (AVRational) {(int) round(video_avg_frame_rate), 1};
-    v_stream->nb_frames = video_packets_count;
-    v_stream->id = 0;
-
-    if (audio_avg_sample_rate <= 0) {
-        return true;
-    }
-
-    // Audio stream
-    const AVCodec *a_codec = avcodec_find_encoder(AV_CODEC_ID_PCM_ALAW);
-    AVStream *a_stream = avformat_new_stream(format_ctx, a_codec);
-    if (!a_stream) {
-        fprintf(stderr, "Could not allocate stream.\n");
-        return false;
-    }
-
-    AVCodecContext *a_encoder = avcodec_alloc_context3(a_codec);
-    a_encoder->time_base = (AVRational) {1, TIMEBASE_MS}; // Raw stream timestamps are in milliseconds
-    a_encoder->sample_rate = (int) round(audio_avg_sample_rate * TIMEBASE_MS);
-    a_encoder->sample_fmt = AV_SAMPLE_FMT_S16;
-    a_encoder->channel_layout = AV_CH_LAYOUT_MONO;
-    a_encoder->channels = 1;
-
-    if (format_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
-        a_encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-    }
-
-    if ((retval = avcodec_open2(a_encoder, a_codec, NULL)) < 0) {
-        fprintf(stderr, "Could not open codec: %s\n", av_err2str(retval));
-        return false;
-    }
-
-    if ((retval = avcodec_parameters_from_context(a_stream->codecpar, a_encoder)) < 0) {
-        fprintf(stderr, "Could not set audio stream parameters: %s\n", av_err2str(retval));
-        return false;
-    }
-
-    // We only need the encoder for parameters
-    avcodec_free_context(&a_encoder);
-    a_stream->id = 1;
-    return true;
-}
-
 int main(int argc, char *argv[]) {
     int opt;
-    bool skip_audio = false;
-    bool quiet = false;
-    bool overwrite_existing = false;
-    char *format_name = NULL;
-    while ((opt = getopt(argc, argv, ":nqyf:")) != -1) {
+    ConvertOptions_t options;
+    bool timeline = false;
+    const char *wav_format = NULL;
+    bool raw = false;
+    bool check = false;
+    bool probe = false;
+    const char *serve_address = NULL;
+    const char *merge_filename = NULL;
+    const char *tee_outputs = NULL;
+    bool batch = false;
+    int jobs = 1;
+    int rotational_jobs = 1, other_jobs = 0;
+    bool physical_order = false;
+    bool event_loop = false;
+    char *metrics_address = NULL;
+    const char *trace_filename = NULL;
+    static const struct option long_options[] = {
+            {"timeline", no_argument, NULL, OPT_TIMELINE},
+            {"index", optional_argument, NULL, OPT_INDEX},
+            {"metrics", required_argument, NULL, OPT_METRICS},
+            {"audio-codec", required_argument, NULL, OPT_AUDIO_CODEC},
+            {"wav", required_argument, NULL, OPT_WAV},
+            {"raw", no_argument, NULL, OPT_RAW},
+            {"dedup-ps", no_argument, NULL, OPT_DEDUP_PS},
+            {"resume", no_argument, NULL, OPT_RESUME},
+            {"check", no_argument, NULL, OPT_CHECK},
+            {"probe", no_argument, NULL, OPT_PROBE},
+            {"serve", required_argument, NULL, OPT_SERVE},
+            {"merge", required_argument, NULL, OPT_MERGE},
+            {"mem-limit", required_argument, NULL, OPT_MEM_LIMIT},
+            {"device-jobs", required_argument, NULL, OPT_DEVICE_JOBS},
+            {"physical-order", no_argument, NULL, OPT_PHYSICAL_ORDER},
+            {"event-loop", no_argument, NULL, OPT_EVENT_LOOP},
+            {"tee", required_argument, NULL, OPT_TEE},
+            {"follow", optional_argument, NULL, OPT_FOLLOW},
+            {"trace", required_argument, NULL, OPT_TRACE},
+            {NULL, 0, NULL, 0}
+    };
+
+    memset(&options, 0, sizeof(options));
+    while ((opt = getopt_long(argc, argv, ":nqyf:bj:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'n':
-                skip_audio = true;
+                options.skip_audio = true;
                 break;
 
             case 'q':
-                quiet = true;
+                options.quiet = true;
                 break;
 
             case 'y':
-                overwrite_existing = true;
+                options.overwrite_existing = true;
                 break;
 
             case 'f':
-                format_name = optarg;
+                options.format_name = optarg;
                 break;
 
-            default:
-                ShowHelp(argv[0], EXIT_FAILURE);
-        }
-    }
-
-    // Not enough params
-    if (optind >= argc) {
-        ShowHelp(argv[0], EXIT_FAILURE);
-    }
+            case 'b':
+                batch = true;
+                break;
 
-    char *in_filename = argv[optind++];
-    if ((optind >= argc) && !format_name) format_name="matroska";
+            case 'j':
+                if ((jobs = atoi(optarg)) < 1) {
+                    ShowHelp(argv[0], EXIT_FAILURE);
+                }
+                break;
 
-    av_log_set_level(AV_LOG_ERROR);
-    //av_register_all();
-    int retval;
+            case OPT_TIMELINE:
+                timeline = true;
+                break;
 
-    // Init format_ctx based on format name
-    AVFormatContext *format_ctx;
-    if (format_name) {
-        if ((retval = avformat_alloc_output_context2(&format_ctx, NULL, format_name, NULL)) < 0) {
-            fprintf(stderr, "Could not allocate an output context: %s\n", av_err2str(retval));
-            exit(1);
-        }
+            case OPT_INDEX:
+                options.use_index = true;
+                options.index_dir = optarg;
+                break;
 
-        if (!format_ctx->url && !(format_ctx->url=av_malloc(strlen(in_filename)+1))) {   
-                fprintf(stderr, "Could not allocate memory\n");
-                exit(1);
-        } else {
-                memset(format_ctx->url, 0, strlen(in_filename));
-        }
+            case OPT_METRICS:
+                metrics_address = optarg;
+                break;
 
-        if (optind < argc) {
-            sprintf(format_ctx->url, "%s", argv[optind]);
-        } else {
-            // Generate output file name based on default format extension
-            char ext[MAX_EXTENSION_LEN] = ".";
-            size_t extensions_length;
-            if ((extensions_length = strlen(format_ctx->oformat->extensions)) > 0) {
-                char *extensions = malloc(extensions_length + 1);
-                char *extension_orig = extensions;
-                strcpy(extensions, format_ctx->oformat->extensions);
-                extensions = strtok(extensions, ",");
-                strncpy(&ext[1], extensions, MAX_EXTENSION_LEN - 1);
-                free(extension_orig);
-            } else {
-                sprintf(&ext[1], "out");
-                if (!quiet) {
-                    fprintf(stderr, "No default extension for the selected format, using '.out'\n");
+            case OPT_AUDIO_CODEC:
+                if (strcmp(optarg, "copy") != 0 && strcmp(optarg, "aac") != 0 && strcmp(optarg, "opus") != 0) {
+                    ShowHelp(argv[0], EXIT_FAILURE);
                 }
-            }
-
-            if (EndsWith(in_filename, ".264") || EndsWith(in_filename, ".265")) {
-                strncpy(format_ctx->url, in_filename, strlen(in_filename) - 4);
-            } else {
-                strcat(format_ctx->url, in_filename);
-            }
-            strcat(format_ctx->url, ext);
-            if (!quiet) {
-                fprintf(stderr, "Output file is %s\n", format_ctx->url);
-            }
-        }
-    } else {
-        if ((retval = avformat_alloc_output_context2(&format_ctx, NULL, NULL, argv[optind])) < 0) {
-            fprintf(stderr, "Could not allocate an output context: %s\n", av_err2str(retval));
-            exit(1);
-        }
-    }
-
-    FILE *in_file;
-    if (!(in_file = fopen(in_filename, "rb"))) {
-        fprintf(stderr, "Cannot open %s for reading.\n", in_filename);
-        exit(1);
-    }
+                options.audio_codec = optarg;
+                break;
 
-    // First pass over input file to detect video frame and audio sample rates and video size
-    bool hxfi_detected = false;
-    HXFrame_t hx_frame;
-    int video_w, video_h;
-    enum AVCodecID video_id;
-    double video_avg_frame_rate = 0;
-    double audio_avg_sample_rate = 0;
-    long video_ts_initial = -1, audio_ts_initial = -1;
-    long video_ts_prev = -1, audio_ts_prev = -1;
-    long audio_packets_count = 0, video_packets_count = 0;
-    do {
-
-        if (fread(&hx_frame.header, 1, sizeof(hx_frame.header), in_file) != sizeof(hx_frame.header)) {
-            fprintf(stderr, "Premature end of file, aborting.\n");
-            exit(1);
-        }
+            case OPT_WAV:
+                if (strcmp(optarg, "alaw") != 0 && strcmp(optarg, "pcm") != 0) {
+                    ShowHelp(argv[0], EXIT_FAILURE);
+                }
+                wav_format = optarg;
+                break;
 
-        switch (hx_frame.header) {
+            case OPT_RAW:
+                raw = true;
+                break;
 
-            case HXVS:
-                if (fread(&hx_frame.data, 1, sizeof(HXVSFrame_t), in_file) != sizeof(HXVSFrame_t)) {
-                    fprintf(stderr, "Premature end of file, aborting.\n");
-                    exit(1);
-                }
+            case OPT_DEDUP_PS:
+                options.dedup_param_sets = true;
+                break;
 
-                video_id = AV_CODEC_ID_H264;
-                video_w = (int) hx_frame.data.hxvs.width;
-                video_h = (int) hx_frame.data.hxvs.height;
+            case OPT_RESUME:
+                options.resumable = true;
+                break;
 
-                if (!quiet) {
-                    fprintf(stderr, "Detected h264 video dimensions: %d x %d\n", video_w, video_h);
-                }
+            case OPT_CHECK:
+                check = true;
                 break;
 
-            case HXVT:
-                if (fread(&hx_frame.data, 1, sizeof(HXVTFrame_t), in_file) != sizeof(HXVTFrame_t)) {
-                    fprintf(stderr, "Premature end of file, aborting.\n");
-                    exit(1);
-                }
+            case OPT_PROBE:
+                probe = true;
+                break;
 
-                video_id = AV_CODEC_ID_H265;
-                video_w = (int) hx_frame.data.hxvt.width;
-                video_h = (int) hx_frame.data.hxvt.height;
+            case OPT_SERVE:
+                serve_address = optarg;
+                break;
 
-                if (!quiet) {
-                    fprintf(stderr, "Detected h265 video dimensions: %d x %d\n", video_w, video_h);
-                }
+            case OPT_MERGE:
+                merge_filename = optarg;
                 break;
 
-            case HXVF:
-                if (fread(&hx_frame.data, 1, sizeof(HXVFFrame_t), in_file) != sizeof(HXVFFrame_t)) {
-                    fprintf(stderr, "Premature end of file, aborting.\n");
-                    exit(1);
+            case OPT_DEVICE_JOBS:
+                other_jobs = 0;
+                if (sscanf(optarg, "%d,%d", &rotational_jobs, &other_jobs) < 1 || rotational_jobs < 1 ||
+                    other_jobs < 0) {
+                    ShowHelp(argv[0], EXIT_FAILURE);
                 }
+                break;
 
-                if (video_ts_initial == -1) {
-                    video_ts_initial = hx_frame.data.hxvf.timestamp;
-                    video_ts_prev = hx_frame.data.hxvf.timestamp;
-                } else {
-                    long elapsed, timestamp;
-                    timestamp = hx_frame.data.hxvf.timestamp - video_ts_initial;
-                    if (timestamp > video_ts_prev) {
-                        elapsed = timestamp - video_ts_prev;
-                        if (video_packets_count) {
-                            video_avg_frame_rate =
-                                    (video_avg_frame_rate * (double) video_packets_count +
-                                     (TIMEBASE_MS / (double) elapsed)) /
-                                    ((double) video_packets_count + 1);
-                        } else {
-                            video_avg_frame_rate = TIMEBASE_MS / (double) elapsed;
-                        }
-                        video_packets_count++;
-                    }
-                    video_ts_prev = timestamp;
-                }
+            case OPT_PHYSICAL_ORDER:
+                physical_order = true;
+                break;
 
-                if (fseek(in_file, hx_frame.data.hxvf.length, SEEK_CUR) < 0) {
-                    fprintf(stderr, "Premature end of file, aborting.\n");
-                    exit(1);
-                }
+            case OPT_TRACE:
+                trace_filename = optarg;
                 break;
 
-            case HXAF:
-                if (fread(&hx_frame.data, 1, sizeof(HXAFFrame_t), in_file) != sizeof(HXAFFrame_t)) {
-                    fprintf(stderr, "Premature end of file, aborting.\n");
-                    exit(1);
+            case OPT_FOLLOW:
+                options.follow_ms = optarg ? atol(optarg) * 1000 : FOLLOW_IDLE_MS;
+                if (options.follow_ms <= 0) {
+                    ShowHelp(argv[0], EXIT_FAILURE);
                 }
+                break;
 
-                if (audio_ts_initial == -1) {
-                    audio_ts_initial = hx_frame.data.hxaf.timestamp;
-                    audio_ts_prev = hx_frame.data.hxaf.timestamp;
-                } else {
-                    long elapsed, timestamp;
-                    timestamp = hx_frame.data.hxaf.timestamp - audio_ts_initial;
-                    if (timestamp > audio_ts_prev) {
-                        elapsed = timestamp - audio_ts_prev;
-                        if (audio_packets_count) {
-                            audio_avg_sample_rate = ((audio_avg_sample_rate * (double) audio_packets_count) +
-                                                     ((hx_frame.data.hxaf.length - 4) / (double) elapsed)) /
-                                                    ((double) audio_packets_count + 1);
-                        } else {
-                            audio_avg_sample_rate = (hx_frame.data.hxaf.length - 4) / (double) elapsed;
-                        }
-                        audio_packets_count++;
-                    }
-                    audio_ts_prev = timestamp;
-                }
+            case OPT_TEE:
+                tee_outputs = optarg;
+                break;
 
-                if (fseek(in_file, hx_frame.data.hxaf.length - 4, SEEK_CUR) < 0) {
-                    fprintf(stderr, "Premature end of file, aborting.\n");
-                    exit(1);
-                }
+            case OPT_EVENT_LOOP:
+                event_loop = true;
                 break;
 
-            case HXFI:
-                hxfi_detected = true;
+            case OPT_MEM_LIMIT:
+                if ((options.memory_limit = ParseSize(optarg)) < MEMORY_LIMIT_MIN) {
+                    ShowHelp(argv[0], EXIT_FAILURE);
+                }
                 break;
 
             default:
-                fprintf(stderr, "Unknown audio_frame header: %u.\n", hx_frame.header);
-                break;
+                ShowHelp(argv[0], EXIT_FAILURE);
         }
+    }
 
-    } while ((!feof(in_file)) && (!hxfi_detected));
+    // Not enough params
+    if (optind >= argc) {
+        ShowHelp(argv[0], EXIT_FAILURE);
+    }
 
-    if (fseek(in_file, 0, SEEK_SET) < 0) {
-        fprintf(stderr, "Cannot seek back to beginning of file, aborting.\n");
+    // The encoder thread muxes into the output between fragment cuts, and its state isn't in checkpoints
+    if (options.resumable && options.audio_codec && strcmp(options.audio_codec, "copy") != 0) {
+        fprintf(stderr, "--resume can't be combined with --audio-codec %s.\n", options.audio_codec);
         exit(1);
     }
 
-    if (video_avg_frame_rate <= 0) {
-        fprintf(stderr, "No video detected, aborting.\n");
+    if (metrics_address && !MetricsStart(metrics_address)) {
         exit(1);
     }
-
-    const AVOutputFormat *out_fmt = format_ctx->oformat;
-    if (!quiet) {
-        if (format_ctx->oformat->mime_type) {
-            fprintf(stderr, "Selected output format: %s (%s)\n", format_ctx->oformat->long_name,
-                    format_ctx->oformat->mime_type);
-        } else {
-            fprintf(stderr, "Selected output format: %s\n", format_ctx->oformat->long_name);
-        }
+    if (trace_filename && !TraceStart(trace_filename)) {
+        exit(1);
     }
 
-    if (!quiet) {
-        fprintf(stderr, "Detected video frame rate: %d\n", (int) round(video_avg_frame_rate));
+    if (check) {
+        return RunCheck(&argv[optind], argc - optind, jobs, options.quiet) ? 1 : 0;
     }
 
-    if (skip_audio) {
-        if (!quiet) {
-            fprintf(stderr, "Audio processing is disabled.\n");
-        }
-        audio_avg_sample_rate = 0;
-    } else {
-        if (!quiet) {
-            if (audio_avg_sample_rate <= 0) {
-                fprintf(stderr, "Warning! No audio detected.\n");
-            } else {
-                fprintf(stderr, "Detected audio PCM frequency: %d\n", (int) round(audio_avg_sample_rate * TIMEBASE_MS));
-            }
-        }
+    if (probe) {
+        return RunProbe(&argv[optind], argc - optind, jobs, options.use_index, options.index_dir) ? 1 : 0;
     }
 
-    // Init streams
-    if (!InitAVStreams(format_ctx, video_w, video_h, video_id, video_avg_frame_rate, video_packets_count,
-                       audio_avg_sample_rate)) {
-        exit(1);
+    if (serve_address) {
+        return RunServer(serve_address, argv[optind], &options, event_loop);
     }
 
-    if (!overwrite_existing) {
-        if (access(format_ctx->url, F_OK) == 0) {
-            fprintf(stderr, "Output file %s already exists but can't overwrite it, exiting.\n",
-                    format_ctx->url);
-            exit(0);
-        }
+    if (merge_filename) {
+        return MergeFiles(&argv[optind], argc - optind, merge_filename, &options);
     }
 
-    // Open output file and write header
-    if (!(out_fmt->flags & AVFMT_NOFILE)) {
-        if ((retval = avio_open(&(format_ctx->pb), format_ctx->url, AVIO_FLAG_WRITE)) < 0) {
-            fprintf(stderr, "Could not open output file: %s\n", av_err2str(retval));
-            exit(1);
-        }
+    if (tee_outputs) {
+        return TeeFile(argv[optind], tee_outputs, &options);
     }
-    if ((retval = avformat_write_header(format_ctx, NULL)) < 0) {
-        fprintf(stderr, "Error occurred when opening output file: %s\n", av_err2str(retval));
-        exit(1);
+
+    if (batch) {
+        return RunBatch(&argv[optind], argc - optind, jobs, rotational_jobs, other_jobs ? other_jobs : jobs,
+                        physical_order, &options) ? 1 : 0;
     }
 
-    // Main extraction loop
-    uint8_t *packet_buffer = NULL;
-    size_t packet_buffer_length = 0;
-    int packet_buffer_offset = 0;
-    hxfi_detected = false;
-    AVPacket packet;
-    av_init_packet(&packet);
-    do {
-        if (fread(&hx_frame.header, 1, sizeof(hx_frame.header), in_file) != sizeof(hx_frame.header)) {
-            fprintf(stderr, "Premature end of file, aborting.\n");
+    char *in_filename = argv[optind++];
+    char *out_filename = optind < argc ? argv[optind] : NULL;
+
+    if (timeline || wav_format || raw) {
+        FILE *in_file, *out_file = stdout;
+        if (!(in_file = fopen(in_filename, "rb"))) {
+            fprintf(stderr, "Cannot open %s for reading.\n", in_filename);
             exit(1);
         }
-
-        switch (hx_frame.header) {
-
-            case HXVS:
-                if (fseek(in_file, sizeof(HXVSFrame_t), SEEK_CUR) < 0) {
-                    fprintf(stderr, "Seek error, aborting.\n");
-                    exit(1);
-                }
-                break;
-
-            case HXVT:
-                if (fseek(in_file, sizeof(HXVTFrame_t), SEEK_CUR) < 0) {
-                    fprintf(stderr, "Seek error, aborting.\n");
-                    exit(1);
-                }
-                break;
-
-            case HXVF:
-                if (fread(&hx_frame.data, 1, sizeof(HXVFFrame_t), in_file) != sizeof(HXVFFrame_t)) {
-                    fprintf(stderr, "Premature end of file, aborting.\n");
-                    exit(1);
-                }
-
-                retval = (int) ReadToBuffer(in_file, &packet_buffer, packet_buffer_offset,
-                                            hx_frame.data.hxvf.length, &packet_buffer_length);
-
-                if (retval < hx_frame.data.hxvf.length) {
-                    fprintf(stderr, "Premature end of file, aborting.\n");
-                    exit(1);
-                }
-
-                H26X_Nal_Header_t *nal_header = (H26X_Nal_Header_t *) (packet_buffer + packet_buffer_offset);
-
-                if (nal_header->unit_type == 7 || nal_header->unit_type == 8) {
-                    packet_buffer_offset += retval; // enqueue data in buffer, wait for a different type to write a packet
-                } else {
-                    packet.data = packet_buffer;
-                    packet.size = retval + packet_buffer_offset;
-                    packet_buffer_offset = 0;
-                    packet.stream_index = 0;
-                    packet.pts = packet.dts = (int) round((double) (hx_frame.data.hxvf.timestamp - video_ts_initial));
-                    if ((retval = av_interleaved_write_frame(format_ctx, &packet)) < 0) {
-                        fprintf(stderr, "Error while writing output packet: %s\n", av_err2str(retval));
-                        exit(1);
-                    }
-                }
-                break;
-
-            case HXAF:
-                if (fread(&hx_frame.data, 1, sizeof(HXAFFrame_t), in_file) != sizeof(HXAFFrame_t)) {
-                    fprintf(stderr, "Premature end of file, aborting.\n");
-                    exit(1);
-                }
-
-                if (audio_avg_sample_rate > 0) {
-                    retval = (int) ReadToBuffer(in_file, &packet_buffer, 0,
-                                                hx_frame.data.hxaf.length - 4, &packet_buffer_length);
-
-                    if (retval < hx_frame.data.hxaf.length - 4) {
-                        fprintf(stderr, "Premature end of file, aborting.\n");
-                        exit(1);
-                    }
-
-                    packet.data = packet_buffer;
-                    packet.size = retval;
-                    packet.stream_index = 1;
-                    packet.pts = packet.dts = (int) round((double) (hx_frame.data.hxaf.timestamp - audio_ts_initial));
-                    if ((retval = av_interleaved_write_frame(format_ctx, &packet)) < 0) {
-                        fprintf(stderr, "Error while writing output packet: %s\n", av_err2str(retval));
-                        exit(1);
-                    }
-                } else {
-                    if (fseek(in_file, hx_frame.data.hxaf.length - 4, SEEK_CUR) < 0) {
-                        fprintf(stderr, "Seek error, aborting");
-                        exit(1);
-                    }
-                }
-                break;
-
-            case HXFI:
-                hxfi_detected = true;
-                break;
-
-            default:
-                fprintf(stderr, "Unknown audio_frame header: %u\n", hx_frame.header);
-                break;
+        if (out_filename) {
+            if (!options.overwrite_existing && access(out_filename, F_OK) == 0) {
+                fprintf(stderr, "Output file %s already exists but can't overwrite it, exiting.\n", out_filename);
+                exit(0);
+            }
+            if (!(out_file = fopen(out_filename, "wb"))) {
+                fprintf(stderr, "Cannot open %s for writing.\n", out_filename);
+                exit(1);
+            }
         }
-    } while ((!feof(in_file)) && (!hxfi_detected));
-    fclose(in_file);
-
-    av_write_trailer(format_ctx);
-    if (!(out_fmt->flags & AVFMT_NOFILE)) {
-        avio_closep(&format_ctx->pb);
-    }
-    avformat_free_context(format_ctx);
-
-    if (packet_buffer) {
-        free(packet_buffer);
+        bool success;
+        if (timeline) {
+            success = WriteTimeline(in_file, in_filename, out_file);
+        } else if (wav_format) {
+            success = WriteWav(in_file, in_filename, out_file, strcmp(wav_format, "pcm") == 0);
+        } else {
+            success = WriteRawStream(in_file, in_filename, out_file);
+        }
+        fclose(in_file);
+        if (out_file != stdout) {
+            fclose(out_file);
+        }
+        return success ? 0 : 1;
     }
 
-    if (!quiet) {
-        fprintf(stderr, "Done! Parsed %lu video packet and %lu audio packets.\n", video_packets_count,
-                audio_packets_count);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int retval = ConvertFile(in_filename, out_filename, &options);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (retval == 0) {
+        METRICS_ADD(files_converted, 1);
+        MetricsObserveLatency((double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9);
     }
-
-    return 0;
+    return retval;
 }
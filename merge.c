@@ -0,0 +1,355 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <libavutil/mathematics.h>
+#include "merge.h"
+#include "hxscan.h"
+#include "metrics.h"
+#include "nal.h"
+
+// A camera clip being read, holding its next packet until the merge writes it
+typedef struct MergeInput_t {
+    const char *filename;
+    FILE *fp;
+    HXStreamInfo_t info;
+    bool hevc, length_prefixed;
+    int64_t start_ms;       // wall clock start of the clip relative to the earliest one
+    long video_origin, audio_origin;
+    bool lost;              // skipping unknown headers
+    int video_index, audio_index, audio_sample_rate;
+    AudioClock_t audio_clock;
+    uint8_t *buffer, *length_buffer, *audio_buffer;
+    size_t buffer_size, length_buffer_size, audio_buffer_size;
+    size_t buffer_offset;   // parameter sets read ahead of their key frame
+    AVPacket packet;        // next packet, with pts in the stream time base
+    int64_t packet_ms;      // its time on the merged timeline
+    bool finished;
+} MergeInput_t;
+
+// Seconds since the epoch of the clip start in names like "A201026_142939_142953.264", as if the camera was in UTC,
+// which doesn't matter as only differences are used
+static bool ParseClipStart(const char *in_filename, time_t *start) {
+    char *copy = strdup(in_filename);
+    if (copy == NULL) {
+        return false;
+    }
+    const char *name = basename(copy);
+    int digits[12], count = 0;
+    bool valid = isalpha((unsigned char) name[0]);
+    for (const char *p = name + 1; valid && count < 12; p++) {
+        if (count == 6 && *p == '_') {
+            continue;
+        }
+        valid = isdigit((unsigned char) *p);
+        digits[count++] = *p - '0';
+    }
+    valid = valid && name[7] == '_';
+    free(copy);
+    if (!valid) {
+        return false;
+    }
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = 100 + digits[0] * 10 + digits[1];
+    tm.tm_mon = digits[2] * 10 + digits[3] - 1;
+    tm.tm_mday = digits[4] * 10 + digits[5];
+    tm.tm_hour = digits[6] * 10 + digits[7];
+    tm.tm_min = digits[8] * 10 + digits[9];
+    tm.tm_sec = digits[10] * 10 + digits[11];
+    *start = timegm(&tm);
+    return *start != (time_t) -1;
+}
+
+static void ConvertToLengthPrefixed(MergeInput_t *input) {
+    if (NalAnnexBToLengthPrefixed(input->packet.data, input->packet.size)) {
+        return;
+    }
+    size_t length_size = NAL_LENGTH_PREFIXED_SIZE((size_t) input->packet.size);
+    if (length_size > input->length_buffer_size) {
+        if (!(input->length_buffer = realloc(input->length_buffer, length_size))) {
+            fprintf(stderr, "Cannot allocate memory, aborting.\n");
+            exit(1);
+        }
+        MetricsBufferResize((long) length_size - (long) input->length_buffer_size);
+        input->length_buffer_size = length_size;
+    }
+    input->packet.size = (int) NalAnnexBToLengthPrefixedCopy(input->packet.data, input->packet.size,
+                                                             input->length_buffer);
+    input->packet.data = input->length_buffer;
+}
+
+// Reads records up to the next complete packet of the clip, gluing parameter sets to their key frame. Returns false
+// at the end of the clip.
+static bool ReadPacket(MergeInput_t *input, AVFormatContext *format_ctx) {
+    HXFrame_t hx_frame;
+
+    while (HXReadFrame(input->fp, &hx_frame)) {
+        CountRecordHeader(hx_frame.header, &input->lost, true);
+        size_t length = (size_t) HXPayloadLength(&hx_frame);
+        switch (hx_frame.header) {
+            case HXVF:
+                if (ReadToBuffer(input->fp, &input->buffer, input->buffer_offset, length, &input->buffer_size, 0) <
+                    length) {
+                    fprintf(stderr, "Premature end of file, aborting.\n");
+                    exit(1);
+                }
+                uint8_t *nal = input->buffer + input->buffer_offset;
+                if (NalIsParameterSet(input->hevc, NalUnitType(input->hevc, nal, length))) {
+                    input->buffer_offset += length;
+                    break;
+                }
+
+                av_init_packet(&input->packet);
+                input->packet.data = input->buffer;
+                input->packet.size = (int) (input->buffer_offset + length);
+                input->buffer_offset = 0;
+                if (input->length_prefixed) {
+                    ConvertToLengthPrefixed(input);
+                }
+                input->packet.flags = hx_frame.data.hxvf.type == HXVF_TYPE_I ? AV_PKT_FLAG_KEY : 0;
+                input->packet.stream_index = input->video_index;
+                input->packet_ms = input->start_ms + HXElapsed(hx_frame.data.hxvf.timestamp, input->video_origin);
+                input->packet.pts = input->packet.dts = input->packet_ms;
+                av_packet_rescale_ts(&input->packet, (AVRational) {1, TIMEBASE_MS},
+                                     format_ctx->streams[input->video_index]->time_base);
+                return true;
+
+            case HXAF:
+                if (input->audio_index < 0) {
+                    if (!HXSkipPayload(input->fp, &hx_frame)) {
+                        fprintf(stderr, "Seek error, aborting.\n");
+                        exit(1);
+                    }
+                    break;
+                }
+                // In a buffer of its own, as it may come between parameter sets and their key frame
+                if (ReadToBuffer(input->fp, &input->audio_buffer, 0, length, &input->audio_buffer_size, 0) < length) {
+                    fprintf(stderr, "Premature end of file, aborting.\n");
+                    exit(1);
+                }
+
+                int64_t pts;
+                long camera_ms = input->start_ms + HXElapsed(hx_frame.data.hxaf.timestamp, input->audio_origin);
+                if (!AudioClockNext(&input->audio_clock, camera_ms, length, &pts)) {
+                    break;
+                }
+                av_init_packet(&input->packet);
+                input->packet.data = input->audio_buffer;
+                input->packet.size = (int) length;
+                input->packet.flags = AV_PKT_FLAG_KEY;
+                input->packet.stream_index = input->audio_index;
+                input->packet.pts = input->packet.dts = pts;
+                input->packet.duration = (int64_t) length;
+                input->packet_ms = pts * TIMEBASE_MS / input->audio_sample_rate;
+                av_packet_rescale_ts(&input->packet, (AVRational) {1, input->audio_sample_rate},
+                                     format_ctx->streams[input->audio_index]->time_base);
+                return true;
+
+            case HXFI:
+                return false;
+
+            case HXVS:
+            case HXVT:
+                break;
+
+            default: // counted by CountRecordHeader
+                break;
+        }
+    }
+    return false;
+}
+
+// Binary min-heap of the inputs by time of their next packet
+static void HeapSiftDown(MergeInput_t **heap, int count, int i) {
+    for (;;) {
+        int smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < count && heap[left]->packet_ms < heap[smallest]->packet_ms) {
+            smallest = left;
+        }
+        if (right < count && heap[right]->packet_ms < heap[smallest]->packet_ms) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        MergeInput_t *swap = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = swap;
+        i = smallest;
+    }
+}
+
+// Opens and scans a clip, and adds its streams to format_ctx
+static void OpenInput(MergeInput_t *input, AVFormatContext *format_ctx, const ConvertOptions_t *options) {
+    if (!(input->fp = fopen(input->filename, "rb"))) {
+        fprintf(stderr, "Cannot open %s for reading.\n", input->filename);
+        exit(1);
+    }
+    if (!HXScanStream(input->fp, &input->info, NULL, NULL)) {
+        exit(1);
+    }
+    if (input->info.video_avg_frame_rate <= 0) {
+        fprintf(stderr, "No video detected in %s, aborting.\n", input->filename);
+        exit(1);
+    }
+
+    input->hevc = input->info.video_header == HXVT;
+    input->audio_sample_rate = input->info.audio_avg_sample_rate > 0 && !options->skip_audio ?
+                               HXNominalSampleRate(input->info.audio_avg_sample_rate) : 0;
+    input->video_index = (int) format_ctx->nb_streams;
+    input->audio_index = input->audio_sample_rate > 0 ? input->video_index + 1 : -1;
+    if (!InitAVStreams(format_ctx, input->info.video_w, input->info.video_h,
+                       input->hevc ? AV_CODEC_ID_H265 : AV_CODEC_ID_H264, input->info.video_avg_frame_rate,
+                       (long) input->info.video_packets_count, input->audio_sample_rate, NULL, NULL)) {
+        exit(1);
+    }
+
+    // Tracks are named after the clip, and numbered in order, as formats like MPEG-TS use ids as stream PIDs
+    char *copy = strdup(input->filename);
+    for (int i = input->video_index; i < (int) format_ctx->nb_streams; i++) {
+        format_ctx->streams[i]->id = i;
+        if (copy) {
+            av_dict_set(&format_ctx->streams[i]->metadata, "title", basename(copy), 0);
+        }
+    }
+    free(copy);
+
+    input->length_prefixed = IsLengthPrefixedFormat(format_ctx->oformat) &&
+                             SetVideoExtradata(format_ctx, input->video_index, input->hevc, input->fp);
+    ComputeOrigins(&input->info, input->audio_sample_rate, &input->video_origin, &input->audio_origin);
+    input->audio_clock.sample_rate = input->audio_sample_rate;
+}
+
+int MergeFiles(char **in_filenames, int inputs_count, const char *out_filename, const ConvertOptions_t *options) {
+    av_log_set_level(AV_LOG_ERROR);
+    int retval;
+
+    MergeInput_t *inputs = calloc(inputs_count, sizeof(MergeInput_t));
+    MergeInput_t **heap = calloc(inputs_count, sizeof(MergeInput_t *));
+    time_t *starts = calloc(inputs_count, sizeof(time_t));
+    if (!inputs || !heap || !starts) {
+        fprintf(stderr, "Cannot allocate memory, aborting.\n");
+        exit(1);
+    }
+
+    time_t earliest = 0;
+    for (int i = 0; i < inputs_count; i++) {
+        inputs[i].filename = in_filenames[i];
+        if (!ParseClipStart(in_filenames[i], &starts[i])) {
+            fprintf(stderr, "Cannot tell the start time of %s from its name, expected AYYMMDD_HHMMSS_HHMMSS.\n",
+                    in_filenames[i]);
+            exit(1);
+        }
+        if (i == 0 || starts[i] < earliest) {
+            earliest = starts[i];
+        }
+    }
+
+    AVFormatContext *format_ctx;
+    if ((retval = avformat_alloc_output_context2(&format_ctx, NULL, options->format_name, out_filename)) < 0) {
+        fprintf(stderr, "Could not allocate an output context: %s\n", av_err2str(retval));
+        exit(1);
+    }
+
+    for (int i = 0; i < inputs_count; i++) {
+        inputs[i].start_ms = (int64_t) (starts[i] - earliest) * TIMEBASE_MS;
+        OpenInput(&inputs[i], format_ctx, options);
+        if (!options->quiet) {
+            fprintf(stderr, "Track %d: %s, %s %d x %d, starting at %.0f s%s\n", inputs[i].video_index,
+                    inputs[i].filename, inputs[i].hevc ? "h265" : "h264", inputs[i].info.video_w,
+                    inputs[i].info.video_h, inputs[i].start_ms / 1000.0, inputs[i].audio_index >= 0 ? ", audio" : "");
+        }
+    }
+    free(starts);
+
+    if (!options->overwrite_existing && access(out_filename, F_OK) == 0) {
+        fprintf(stderr, "Output file %s already exists but can't overwrite it, exiting.\n", out_filename);
+        exit(0);
+    }
+    if (!(format_ctx->oformat->flags & AVFMT_NOFILE) &&
+        (retval = avio_open(&format_ctx->pb, out_filename, AVIO_FLAG_WRITE)) < 0) {
+        fprintf(stderr, "Could not open output file: %s\n", av_err2str(retval));
+        exit(1);
+    }
+    if ((retval = avformat_write_header(format_ctx, NULL)) < 0) {
+        fprintf(stderr, "Error occurred when opening output file: %s\n", av_err2str(retval));
+        exit(1);
+    }
+
+    // K-way merge: write the earliest pending packet of all clips, then read the next one of that clip
+    int heap_count = 0;
+    for (int i = 0; i < inputs_count; i++) {
+        if (ReadPacket(&inputs[i], format_ctx)) {
+            heap[heap_count++] = &inputs[i];
+        }
+    }
+    for (int i = heap_count / 2 - 1; i >= 0; i--) {
+        HeapSiftDown(heap, heap_count, i);
+    }
+
+    long packets_count = 0;
+    while (heap_count > 0) {
+        MergeInput_t *input = heap[0];
+        bool video = input->packet.stream_index == input->video_index;
+        if ((retval = av_interleaved_write_frame(format_ctx, &input->packet)) < 0) {
+            fprintf(stderr, "Error while writing output packet: %s\n", av_err2str(retval));
+            exit(1);
+        }
+        if (video) {
+            METRICS_ADD(video_packets, 1);
+        } else {
+            METRICS_ADD(audio_packets, 1);
+        }
+        packets_count++;
+
+        if (!ReadPacket(input, format_ctx)) {
+            heap[0] = heap[--heap_count];
+        }
+        HeapSiftDown(heap, heap_count, 0);
+    }
+
+    av_write_trailer(format_ctx);
+    if (!(format_ctx->oformat->flags & AVFMT_NOFILE)) {
+        METRICS_ADD(bytes_out, avio_tell(format_ctx->pb));
+        avio_closep(&format_ctx->pb);
+    }
+    avformat_free_context(format_ctx);
+
+    for (int i = 0; i < inputs_count; i++) {
+        METRICS_ADD(bytes_in, ftello(inputs[i].fp));
+        fclose(inputs[i].fp);
+        free(inputs[i].buffer);
+        free(inputs[i].length_buffer);
+        free(inputs[i].audio_buffer);
+        MetricsBufferResize(-(long) (inputs[i].buffer_size + inputs[i].length_buffer_size +
+                                     inputs[i].audio_buffer_size));
+    }
+    free(heap);
+    free(inputs);
+
+    if (!options->quiet) {
+        fprintf(stderr, "Done! Merged %d clips, %ld packets.\n", inputs_count, packets_count);
+    }
+    return 0;
+}
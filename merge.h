@@ -0,0 +1,27 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef MERGE_H
+#define MERGE_H
+
+#include "convert.h"
+
+// Muxes clips of several cameras into out_filename, each camera getting a video track and an audio track of its
+// own. Clips are aligned on the wall clock time of their "AYYMMDD_HHMMSS_HHMMSS" names, then follow their camera
+// timestamps, and their packets are merged by time in a single pass. Errors are fatal, like in ConvertFile.
+int MergeFiles(char **in_filenames, int inputs_count, const char *out_filename, const ConvertOptions_t *options);
+
+#endif
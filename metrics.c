@@ -0,0 +1,178 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include "metrics.h"
+#include "net.h"
+
+#define METRICS_BODY_SIZE       8192
+
+Metrics_t *metrics = NULL;
+
+// Upper bounds of the conversion latency histogram buckets, in seconds
+static const double latency_bounds[METRICS_LATENCY_BUCKETS] = {0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 120, 300};
+
+static uint64_t Load(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static size_t FormatMetrics(char *body, size_t size) {
+    size_t length = 0;
+
+#define APPEND(...) do { \
+    if (length < size) length += snprintf(body + length, size - length, __VA_ARGS__); \
+} while (0)
+#define METRIC(name, type, help, field) do { \
+    APPEND("# HELP ipcam_" name " " help "\n# TYPE ipcam_" name " " type "\n"); \
+    APPEND("ipcam_" name " %llu\n", (unsigned long long) Load(&metrics->field)); \
+} while (0)
+
+    METRIC("files_converted_total", "counter", "Input files converted successfully.", files_converted);
+    METRIC("files_failed_total", "counter", "Input files whose conversion failed.", files_failed);
+    METRIC("input_bytes_total", "counter", "Bytes read from input files.", bytes_in);
+    METRIC("output_bytes_total", "counter", "Bytes written to output files.", bytes_out);
+    METRIC("video_packets_total", "counter", "Video packets written.", video_packets);
+    METRIC("audio_packets_total", "counter", "Audio packets written.", audio_packets);
+    METRIC("queue_depth", "gauge", "Input files waiting for conversion.", queue_depth);
+    METRIC("conversions_running", "gauge", "Conversions in progress.", conversions_running);
+    METRIC("resync_events_total", "counter", "Known records found after a run of unknown headers.", resync_events);
+    METRIC("unknown_headers_total", "counter", "Records with an unknown header.", unknown_headers);
+    METRIC("buffer_bytes", "gauge", "Bytes allocated to packet buffers.", buffer_bytes);
+    METRIC("buffer_bytes_peak", "gauge", "Peak of bytes allocated to packet buffers.", buffer_bytes_peak);
+
+    APPEND("# HELP ipcam_conversion_duration_seconds Time taken by successful conversions.\n"
+           "# TYPE ipcam_conversion_duration_seconds histogram\n");
+    uint64_t cumulative = 0;
+    for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++) {
+        cumulative += Load(&metrics->latency_buckets[i]);
+        APPEND("ipcam_conversion_duration_seconds_bucket{le=\"%g\"} %llu\n", latency_bounds[i],
+               (unsigned long long) cumulative);
+    }
+    uint64_t count = Load(&metrics->latency_count);
+    APPEND("ipcam_conversion_duration_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long) count);
+    APPEND("ipcam_conversion_duration_seconds_sum %.3f\n", (double) Load(&metrics->latency_sum_ms) / 1000.0);
+    APPEND("ipcam_conversion_duration_seconds_count %llu\n", (unsigned long long) count);
+
+#undef METRIC
+#undef APPEND
+    return length < size ? length : size - 1;
+}
+
+static void *MetricsThread(void *arg) {
+    int listen_fd = (int) (intptr_t) arg;
+    char request[1024];
+    char header[256];
+    char *body = malloc(METRICS_BODY_SIZE);
+    if (body == NULL) {
+        fprintf(stderr, "Cannot allocate memory, metrics disabled.\n");
+        return NULL;
+    }
+
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            fprintf(stderr, "Cannot accept metrics connection: %s\n", strerror(errno));
+            break;
+        }
+
+        // Requests are tiny, the first segment is enough to tell the path
+        ssize_t length = recv(fd, request, sizeof(request) - 1, 0);
+        if (length > 0) {
+            request[length] = '\0';
+            if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0) {
+                size_t body_length = FormatMetrics(body, METRICS_BODY_SIZE);
+                int header_length = snprintf(header, sizeof(header),
+                                             "HTTP/1.0 200 OK\r\n"
+                                             "Content-Type: text/plain; version=0.0.4\r\n"
+                                             "Content-Length: %zu\r\n\r\n", body_length);
+                NetSendAll(fd, header, header_length);
+                NetSendAll(fd, body, body_length);
+            } else {
+                const char *not_found = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+                NetSendAll(fd, not_found, strlen(not_found));
+            }
+        }
+        close(fd);
+    }
+
+    free(body);
+    return NULL;
+}
+
+bool MetricsStart(const char *address) {
+    int listen_fd = NetListen(address, "metrics");
+    if (listen_fd < 0) {
+        return false;
+    }
+
+    metrics = mmap(NULL, sizeof(Metrics_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (metrics == MAP_FAILED) {
+        fprintf(stderr, "Cannot allocate metrics: %s\n", strerror(errno));
+        metrics = NULL;
+        close(listen_fd);
+        return false;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, MetricsThread, (void *) (intptr_t) listen_fd) != 0) {
+        fprintf(stderr, "Cannot start metrics thread.\n");
+        munmap(metrics, sizeof(Metrics_t));
+        metrics = NULL;
+        close(listen_fd);
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+void MetricsBufferResize(long delta) {
+    if (!metrics || delta == 0) {
+        return;
+    }
+
+    uint64_t current = __atomic_add_fetch(&metrics->buffer_bytes, (uint64_t) delta, __ATOMIC_RELAXED);
+    uint64_t peak = Load(&metrics->buffer_bytes_peak);
+    while (delta > 0 && current > peak &&
+           !__atomic_compare_exchange_n(&metrics->buffer_bytes_peak, &peak, current, true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+    }
+}
+
+void MetricsObserveLatency(double seconds) {
+    if (!metrics) {
+        return;
+    }
+
+    int bucket = 0;
+    while (bucket < METRICS_LATENCY_BUCKETS && seconds > latency_bounds[bucket]) {
+        bucket++;
+    }
+    if (bucket < METRICS_LATENCY_BUCKETS) {
+        METRICS_ADD(latency_buckets[bucket], 1);
+    }
+    METRICS_ADD(latency_count, 1);
+    METRICS_ADD(latency_sum_ms, (uint64_t) (seconds * 1000.0));
+}
@@ -0,0 +1,65 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define METRICS_LATENCY_BUCKETS 11
+
+// Counters live in memory shared with the worker processes of batch conversions, which update them directly
+typedef struct Metrics_t {
+    uint64_t files_converted;
+    uint64_t files_failed;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t video_packets;
+    uint64_t audio_packets;
+    uint64_t queue_depth;
+    uint64_t conversions_running;
+    uint64_t resync_events;
+    uint64_t unknown_headers;
+    uint64_t buffer_bytes;
+    uint64_t buffer_bytes_peak;
+    uint64_t latency_buckets[METRICS_LATENCY_BUCKETS];
+    uint64_t latency_count;
+    uint64_t latency_sum_ms;
+} Metrics_t;
+
+// NULL unless metrics are enabled, in which case the macros below update it atomically
+extern Metrics_t *metrics;
+
+#define METRICS_ADD(field, value) do { \
+    if (metrics) __atomic_add_fetch(&metrics->field, (uint64_t) (value), __ATOMIC_RELAXED); \
+} while (0)
+
+#define METRICS_SUB(field, value) do { \
+    if (metrics) __atomic_sub_fetch(&metrics->field, (uint64_t) (value), __ATOMIC_RELAXED); \
+} while (0)
+
+// Allocates the shared counters and starts serving them in Prometheus text format on address, which is either a
+// port number, bound to the loopback interface, or host:port
+bool MetricsStart(const char *address);
+
+// Adds a buffer allocation change to the current usage, keeping track of the peak
+void MetricsBufferResize(long delta);
+
+// Records the duration of a successful conversion
+void MetricsObserveLatency(double seconds);
+
+#endif
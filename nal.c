@@ -0,0 +1,407 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "nal.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#define NAL_MAX_UNITS   32  // parameter sets and other units preceding a key frame considered for extradata
+
+typedef struct NalUnit_t {
+    const uint8_t *data;    // NAL unit header, start code excluded
+    size_t size;
+    int type;
+} NalUnit_t;
+
+typedef struct NalBitReader_t {
+    const uint8_t *data;
+    size_t size;
+    size_t position;        // in bits
+    bool overrun;
+} NalBitReader_t;
+
+const uint8_t *NalFindStartCode(const uint8_t *p, const uint8_t *end) {
+    // 16 positions at a time: the bytes at p, p + 1 and p + 2 are compared with 0, 0 and 1
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+    for (; end - p >= 18; p += 16) {
+        __m128i zero0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), zero);
+        __m128i zero1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 1)), zero);
+        __m128i one2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 2)), one);
+        int mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(zero0, zero1), one2));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__aarch64__)
+    for (; end - p >= 18; p += 16) {
+        uint8x16_t match = vandq_u8(vandq_u8(vceqzq_u8(vld1q_u8(p)), vceqzq_u8(vld1q_u8(p + 1))),
+                                    vceqq_u8(vld1q_u8(p + 2), vdupq_n_u8(1)));
+        // Narrowing shift packs the comparison into 4 bits per byte
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(match), 4)), 0);
+        if (mask) {
+            return p + (__builtin_ctzll(mask) >> 2);
+        }
+    }
+#endif
+    for (; end - p >= 3; p++) {
+        if (p[0] == 0 && p[1] == 0 && p[2] == 1) {
+            return p;
+        }
+    }
+    return end;
+}
+
+int NalUnitType(bool hevc, const uint8_t *data, size_t size) {
+    if (size >= 4 && data[0] == 0 && data[1] == 0 && data[2] == 0 && data[3] == 1) {
+        data += 4;
+        size -= 4;
+    } else if (size >= 3 && data[0] == 0 && data[1] == 0 && data[2] == 1) {
+        data += 3;
+        size -= 3;
+    }
+    if (size < 1) {
+        return -1;
+    }
+    return hevc ? (data[0] >> 1) & 0x3f : data[0] & 0x1f;
+}
+
+bool NalIsParameterSet(bool hevc, int type) {
+    if (hevc) {
+        return type == NAL_HEVC_VPS || type == NAL_HEVC_SPS || type == NAL_HEVC_PPS;
+    }
+    return type == NAL_H264_SPS || type == NAL_H264_PPS;
+}
+
+static void PutBE16(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t) (v >> 8);
+    p[1] = (uint8_t) v;
+}
+
+static void PutBE32(uint8_t *p, uint32_t v) {
+    PutBE16(p, v >> 16);
+    PutBE16(p + 2, v);
+}
+
+bool NalAnnexBToLengthPrefixed(uint8_t *data, size_t size) {
+    static const uint8_t start_code[4] = {0, 0, 0, 1};
+    uint8_t *end = data + size;
+    uint8_t *code = data;
+
+    if (size < 4 || memcmp(data, start_code, 4) != 0) {
+        return false;
+    }
+
+    while (code < end) {
+        uint8_t *nal = code + 4;
+        uint8_t *next = (uint8_t *) NalFindStartCode(nal, end);
+        if (next < end) {
+            if (next == nal || next[-1] != 0) {
+                // 3 byte start code: put back the ones already replaced, walking the lengths written so far
+                for (uint8_t *p = data; p < code;) {
+                    size_t length = ((size_t) p[0] << 24) | ((size_t) p[1] << 16) | ((size_t) p[2] << 8) | p[3];
+                    memcpy(p, start_code, 4);
+                    p += 4 + length;
+                }
+                return false;
+            }
+            next--;
+        }
+        PutBE32(code, (uint32_t) (next - nal));
+        code = next;
+    }
+    return true;
+}
+
+// Splits an Annex-B buffer into NAL units, dropping the zero bytes trailing each of them
+static int NalSplit(bool hevc, const uint8_t *data, size_t size, NalUnit_t *units, int max_units) {
+    const uint8_t *end = data + size;
+    const uint8_t *code = NalFindStartCode(data, end);
+    int count = 0;
+
+    while (code < end && count < max_units) {
+        const uint8_t *nal = code + 3;
+        const uint8_t *next = NalFindStartCode(nal, end);
+        const uint8_t *nal_end = next;
+        while (nal_end > nal && nal_end[-1] == 0) {
+            nal_end--;
+        }
+        if (nal_end > nal) {
+            units[count].data = nal;
+            units[count].size = (size_t) (nal_end - nal);
+            units[count].type = hevc ? (nal[0] >> 1) & 0x3f : nal[0] & 0x1f;
+            count++;
+        }
+        code = next;
+    }
+    return count;
+}
+
+size_t NalAnnexBToLengthPrefixedCopy(const uint8_t *src, size_t size, uint8_t *dst) {
+    const uint8_t *end = src + size;
+    const uint8_t *code = NalFindStartCode(src, end);
+    uint8_t *out = dst;
+
+    while (code < end) {
+        const uint8_t *nal = code + 3;
+        const uint8_t *next = NalFindStartCode(nal, end);
+        const uint8_t *nal_end = next;
+        while (nal_end > nal && nal_end[-1] == 0) {
+            nal_end--;
+        }
+        PutBE32(out, (uint32_t) (nal_end - nal));
+        memcpy(out + 4, nal, (size_t) (nal_end - nal));
+        out += 4 + (nal_end - nal);
+        code = next;
+    }
+    return (size_t) (out - dst);
+}
+
+// Removes emulation prevention bytes (00 00 03) so that the syntax elements can be read
+static size_t NalUnescape(const uint8_t *src, size_t size, uint8_t *dst) {
+    size_t zeros = 0, count = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (zeros >= 2 && src[i] == 3) {
+            zeros = 0;
+            continue;
+        }
+        dst[count++] = src[i];
+        zeros = src[i] == 0 ? zeros + 1 : 0;
+    }
+    return count;
+}
+
+static uint32_t ReadBits(NalBitReader_t *br, int count) {
+    uint32_t value = 0;
+    for (int i = 0; i < count; i++) {
+        if (br->position >= br->size * 8) {
+            br->overrun = true;
+            return 0;
+        }
+        value = (value << 1) | ((br->data[br->position >> 3] >> (7 - (br->position & 7))) & 1);
+        br->position++;
+    }
+    return value;
+}
+
+// Unsigned Exp-Golomb code
+static uint32_t ReadUE(NalBitReader_t *br) {
+    int zeros = 0;
+    while (!ReadBits(br, 1)) {
+        if (br->overrun || ++zeros > 31) {
+            br->overrun = true;
+            return 0;
+        }
+    }
+    return ((1u << zeros) - 1) + ReadBits(br, zeros);
+}
+
+static uint8_t *BuildAvcC(const NalUnit_t *units, int count, size_t *extradata_size) {
+    const NalUnit_t *sps = NULL;
+    int sps_count = 0, pps_count = 0;
+    size_t size = 7;
+
+    for (int i = 0; i < count; i++) {
+        if (units[i].type == NAL_H264_SPS || units[i].type == NAL_H264_PPS) {
+            if (units[i].type == NAL_H264_SPS) {
+                sps = sps ? sps : &units[i];
+                sps_count++;
+            } else {
+                pps_count++;
+            }
+            size += 2 + units[i].size;
+        }
+    }
+    if (!sps || sps->size < 4 || !pps_count || sps_count > 31 || pps_count > 255) {
+        return NULL;
+    }
+
+    uint8_t rbsp[sps->size];
+    NalBitReader_t br = {rbsp, NalUnescape(sps->data, sps->size, rbsp), 8, false};
+    uint32_t profile = ReadBits(&br, 8), compatibility = ReadBits(&br, 8), level = ReadBits(&br, 8);
+    uint32_t chroma_format = 1, bit_depth_luma = 0, bit_depth_chroma = 0;
+    ReadUE(&br); // seq_parameter_set_id
+    if (profile == 100 || profile == 110 || profile == 122 || profile == 244 || profile == 44 || profile == 83 ||
+        profile == 86 || profile == 118 || profile == 128 || profile == 138 || profile == 139 || profile == 134 ||
+        profile == 135) {
+        chroma_format = ReadUE(&br);
+        if (chroma_format == 3) {
+            ReadBits(&br, 1); // separate_colour_plane_flag
+        }
+        bit_depth_luma = ReadUE(&br);
+        bit_depth_chroma = ReadUE(&br);
+    }
+    if (br.overrun) {
+        return NULL;
+    }
+
+    // High profiles carry chroma format and bit depths at the end of the record
+    bool extended = profile != 66 && profile != 77 && profile != 88;
+    size += extended ? 4 : 0;
+    uint8_t *record = malloc(size), *p = record;
+    if (record == NULL) {
+        return NULL;
+    }
+    *p++ = 1;
+    *p++ = (uint8_t) profile;
+    *p++ = (uint8_t) compatibility;
+    *p++ = (uint8_t) level;
+    *p++ = 0xfc | 3; // 4 byte NAL unit lengths
+    *p++ = 0xe0 | sps_count;
+    for (int type = NAL_H264_SPS; type <= NAL_H264_PPS; type++) {
+        if (type == NAL_H264_PPS) {
+            *p++ = (uint8_t) pps_count;
+        }
+        for (int i = 0; i < count; i++) {
+            if (units[i].type == type) {
+                PutBE16(p, (uint32_t) units[i].size);
+                memcpy(p + 2, units[i].data, units[i].size);
+                p += 2 + units[i].size;
+            }
+        }
+    }
+    if (extended) {
+        *p++ = 0xfc | (chroma_format & 3);
+        *p++ = 0xf8 | (bit_depth_luma & 7);
+        *p++ = 0xf8 | (bit_depth_chroma & 7);
+        *p++ = 0; // no SPS extensions
+    }
+
+    *extradata_size = size;
+    return record;
+}
+
+static uint8_t *BuildHvcC(const NalUnit_t *units, int count, size_t *extradata_size) {
+    static const int types[] = {NAL_HEVC_VPS, NAL_HEVC_SPS, NAL_HEVC_PPS};
+    const NalUnit_t *sps = NULL;
+    int type_counts[3] = {0, 0, 0};
+    size_t size = 23;
+
+    for (int i = 0; i < count; i++) {
+        for (int t = 0; t < 3; t++) {
+            if (units[i].type == types[t]) {
+                if (types[t] == NAL_HEVC_SPS && !sps) {
+                    sps = &units[i];
+                }
+                type_counts[t]++;
+                size += 2 + units[i].size;
+            }
+        }
+    }
+    if (!sps || !type_counts[0] || !type_counts[2]) {
+        return NULL;
+    }
+    size += 3 * 3;
+
+    uint8_t rbsp[sps->size];
+    NalBitReader_t br = {rbsp, NalUnescape(sps->data, sps->size, rbsp), 16, false};
+    ReadBits(&br, 4); // sps_video_parameter_set_id
+    uint32_t max_sub_layers_minus1 = ReadBits(&br, 3);
+    uint32_t temporal_id_nesting = ReadBits(&br, 1);
+
+    // General profile, tier and level are copied to the record as they are
+    uint32_t profile = ReadBits(&br, 8);
+    uint32_t compatibility = ReadBits(&br, 32);
+    uint32_t constraints_high = ReadBits(&br, 16), constraints_low = ReadBits(&br, 32);
+    uint32_t level = ReadBits(&br, 8);
+
+    bool sub_layer_profile[8], sub_layer_level[8];
+    for (uint32_t i = 0; i < max_sub_layers_minus1; i++) {
+        sub_layer_profile[i] = ReadBits(&br, 1);
+        sub_layer_level[i] = ReadBits(&br, 1);
+    }
+    if (max_sub_layers_minus1 > 0) {
+        ReadBits(&br, 2 * (8 - max_sub_layers_minus1)); // reserved
+    }
+    for (uint32_t i = 0; i < max_sub_layers_minus1; i++) {
+        if (sub_layer_profile[i]) {
+            ReadBits(&br, 32);
+            ReadBits(&br, 32);
+            ReadBits(&br, 24);
+        }
+        if (sub_layer_level[i]) {
+            ReadBits(&br, 8);
+        }
+    }
+
+    ReadUE(&br); // sps_seq_parameter_set_id
+    uint32_t chroma_format = ReadUE(&br);
+    if (chroma_format == 3) {
+        ReadBits(&br, 1); // separate_colour_plane_flag
+    }
+    ReadUE(&br); // pic_width_in_luma_samples
+    ReadUE(&br); // pic_height_in_luma_samples
+    if (ReadBits(&br, 1)) { // conformance window offsets
+        for (int i = 0; i < 4; i++) {
+            ReadUE(&br);
+        }
+    }
+    uint32_t bit_depth_luma = ReadUE(&br);
+    uint32_t bit_depth_chroma = ReadUE(&br);
+    if (br.overrun) {
+        return NULL;
+    }
+
+    uint8_t *record = malloc(size), *p = record;
+    if (record == NULL) {
+        return NULL;
+    }
+    *p++ = 1;
+    *p++ = (uint8_t) profile;
+    PutBE32(p, compatibility);
+    PutBE16(p + 4, constraints_high);
+    PutBE32(p + 6, constraints_low);
+    p += 10;
+    *p++ = (uint8_t) level;
+    *p++ = 0xf0; // no min_spatial_segmentation_idc
+    *p++ = 0x00;
+    *p++ = 0xfc; // unknown parallelism
+    *p++ = 0xfc | (chroma_format & 3);
+    *p++ = 0xf8 | (bit_depth_luma & 7);
+    *p++ = 0xf8 | (bit_depth_chroma & 7);
+    *p++ = 0; // unknown average frame rate
+    *p++ = 0;
+    *p++ = (uint8_t) (((max_sub_layers_minus1 + 1) & 7) << 3 | (temporal_id_nesting & 1) << 2 | 3);
+    *p++ = 3;
+    for (int t = 0; t < 3; t++) {
+        // Parameter sets are repeated in band before every key frame, so the arrays are not marked complete
+        *p++ = (uint8_t) types[t];
+        PutBE16(p, (uint32_t) type_counts[t]);
+        p += 2;
+        for (int i = 0; i < count; i++) {
+            if (units[i].type == types[t]) {
+                PutBE16(p, (uint32_t) units[i].size);
+                memcpy(p + 2, units[i].data, units[i].size);
+                p += 2 + units[i].size;
+            }
+        }
+    }
+
+    *extradata_size = size;
+    return record;
+}
+
+uint8_t *NalBuildExtradata(bool hevc, const uint8_t *param_sets, size_t size, size_t *extradata_size) {
+    NalUnit_t units[NAL_MAX_UNITS];
+    int count = NalSplit(hevc, param_sets, size, units, NAL_MAX_UNITS);
+    return hevc ? BuildHvcC(units, count, extradata_size) : BuildAvcC(units, count, extradata_size);
+}
@@ -0,0 +1,52 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef NAL_H
+#define NAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define NAL_H264_SPS    7
+#define NAL_H264_PPS    8
+#define NAL_HEVC_VPS    32
+#define NAL_HEVC_SPS    33
+#define NAL_HEVC_PPS    34
+
+// Returns the first 00 00 01 start code prefix in [p, end), or end if there is none
+const uint8_t *NalFindStartCode(const uint8_t *p, const uint8_t *end);
+
+// Type of the NAL unit at data, which may begin with a start code, or -1 if data is too short
+int NalUnitType(bool hevc, const uint8_t *data, size_t size);
+
+// True for SPS and PPS, and VPS in h265
+bool NalIsParameterSet(bool hevc, int type);
+
+// Replaces the 4 byte start codes of an Annex-B buffer with big endian NAL unit lengths, as MP4 wants them. Returns
+// false, leaving the buffer as it was, if a start code is 3 bytes long and there is no room for the length.
+bool NalAnnexBToLengthPrefixed(uint8_t *data, size_t size);
+
+// Same as NalAnnexBToLengthPrefixed, writing to dst, which must hold at least NAL_LENGTH_PREFIXED_SIZE(size) bytes.
+// Returns the converted size.
+#define NAL_LENGTH_PREFIXED_SIZE(size) ((size) + (size) / 3 + 4)
+size_t NalAnnexBToLengthPrefixedCopy(const uint8_t *src, size_t size, uint8_t *dst);
+
+// Builds the avcC (h264) or hvcC (h265) decoder configuration record from the Annex-B parameter sets preceding a key
+// frame. Returns a newly allocated record, or NULL if a parameter set is missing or can't be parsed.
+uint8_t *NalBuildExtradata(bool hevc, const uint8_t *param_sets, size_t size, size_t *extradata_size);
+
+#endif
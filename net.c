@@ -0,0 +1,86 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include "net.h"
+
+#define NET_DEFAULT_HOST    "127.0.0.1"
+
+int NetListen(const char *address, const char *purpose) {
+    char host[256];
+    const char *port = strrchr(address, ':');
+    if (port) {
+        size_t host_length = port - address;
+        if (host_length >= sizeof(host)) {
+            fprintf(stderr, "Invalid %s address %s\n", purpose, address);
+            return -1;
+        }
+        memcpy(host, address, host_length);
+        host[host_length] = '\0';
+        port++;
+    } else {
+        strcpy(host, NET_DEFAULT_HOST);
+        port = address;
+    }
+
+    struct addrinfo hints, *addresses;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    int retval = getaddrinfo(host[0] ? host : NULL, port, &hints, &addresses);
+    if (retval != 0) {
+        fprintf(stderr, "Invalid %s address %s: %s\n", purpose, address, gai_strerror(retval));
+        return -1;
+    }
+
+    int listen_fd = socket(addresses->ai_family, addresses->ai_socktype | SOCK_CLOEXEC, addresses->ai_protocol);
+    int reuse = 1;
+    if (listen_fd < 0 ||
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 ||
+        bind(listen_fd, addresses->ai_addr, addresses->ai_addrlen) < 0 ||
+        listen(listen_fd, 16) < 0) {
+        fprintf(stderr, "Cannot listen for %s on %s: %s\n", purpose, address, strerror(errno));
+        freeaddrinfo(addresses);
+        if (listen_fd >= 0) {
+            close(listen_fd);
+        }
+        return -1;
+    }
+    freeaddrinfo(addresses);
+    return listen_fd;
+}
+
+bool NetSendAll(int fd, const void *data, size_t length) {
+    const char *p = data;
+    while (length > 0) {
+        ssize_t sent = send(fd, p, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        p += sent;
+        length -= sent;
+    }
+    return true;
+}
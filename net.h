@@ -0,0 +1,30 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef NET_H
+#define NET_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Returns a socket listening on address, which is either a port number, bound to the loopback interface, or
+// host:port. Errors are reported on stderr mentioning what the socket is for, and -1 is returned.
+int NetListen(const char *address, const char *purpose);
+
+// Sends all of data, returns false if the connection failed
+bool NetSendAll(int fd, const void *data, size_t length);
+
+#endif
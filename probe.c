@@ -0,0 +1,288 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <sys/stat.h>
+#include "probe.h"
+#include "hxscan.h"
+#include "hxindex.h"
+#include "timeline.h"
+#include "workers.h"
+
+#define PROBE_SAMPLE_MS     2000    // video time sampled at the beginning of a clip to measure rates
+#define PROBE_SAMPLE_RECORDS 1024   // at most this many records are sampled, whatever their timestamps
+#define HXFI_INDEX_LENGTH   200000  // size of the key frame index written by cameras, in bytes
+#define HXFI_HEADER_SIZE    16      // header, index length, duration in ms and a field of unknown meaning
+
+typedef struct ProbeInfo_t {
+    uint32_t video_header;
+    uint32_t video_w, video_h;
+    long video_packets, audio_packets;  // video packets are frames, the records sharing a timestamp
+    uint32_t video_ts_first, video_ts_last;
+    uint32_t audio_ts_first, audio_ts_last;
+    uint64_t audio_samples, audio_samples_last;
+    long audio_start_ms;                // video time at the first audio packet, as clocks may be unrelated
+    int audio_rate;
+    const char *source;                 // what the counts and last timestamps come from
+    bool exact;
+} ProbeInfo_t;
+
+typedef struct ProbeQueue_t {
+    char **inputs;
+    int inputs_count;
+    int next;       // index of the next input to probe, taken atomically by workers
+    int failures;   // updated atomically
+    bool use_index;
+    const char *index_dir;
+} ProbeQueue_t;
+
+static void ProbeVideo(ProbeInfo_t *info, uint32_t timestamp) {
+    if (info->video_packets == 0) {
+        info->video_ts_first = timestamp;
+    } else if (timestamp == info->video_ts_last) {
+        return;
+    }
+    info->video_ts_last = timestamp;
+    info->video_packets++;
+}
+
+static void ProbeAudio(ProbeInfo_t *info, uint32_t timestamp, uint32_t samples) {
+    if (info->audio_packets == 0) {
+        info->audio_ts_first = timestamp;
+        info->audio_start_ms = info->video_packets ? HXElapsed(info->video_ts_last, info->video_ts_first) : 0;
+    }
+    info->audio_ts_last = timestamp;
+    info->audio_samples += samples;
+    info->audio_samples_last = samples;
+    info->audio_packets++;
+}
+
+// Where ProbeWalk stopped
+enum ProbeWalkEnd {
+    PROBE_SAMPLED,      // enough video or records seen
+    PROBE_COMPLETE,     // HXFI trailer, or end of the file after a whole record
+    PROBE_BROKEN        // truncated record or unknown header, what follows wasn't counted
+};
+
+// Walks record headers from the current position of fp, of size bytes, skipping payloads, until the HXFI trailer or
+// the end of the file, or until sample_ms of video or sample_records records have been seen
+static enum ProbeWalkEnd ProbeWalk(FILE *fp, off_t size, ProbeInfo_t *info, long sample_ms, long sample_records) {
+    HXFrame_t hx_frame;
+    bool sampled = false;
+
+    for (long records = 0; records < sample_records && !sampled; records++) {
+        off_t offset = ftello(fp);
+        if (!HXReadFrame(fp, &hx_frame)) {
+            return offset == size ? PROBE_COMPLETE : PROBE_BROKEN;
+        }
+
+        switch (hx_frame.header) {
+            case HXVS:
+            case HXVT:
+                info->video_header = hx_frame.header;
+                info->video_w = hx_frame.data.hxvs.width;
+                info->video_h = hx_frame.data.hxvs.height;
+                break;
+
+            case HXVF:
+                ProbeVideo(info, hx_frame.data.hxvf.timestamp);
+                sampled = HXElapsed(info->video_ts_last, info->video_ts_first) >= sample_ms;
+                break;
+
+            case HXAF:
+                ProbeAudio(info, hx_frame.data.hxaf.timestamp, (uint32_t) HXPayloadLength(&hx_frame));
+                break;
+
+            case HXFI:
+                return PROBE_COMPLETE;
+
+            default: // can't find the next record
+                return PROBE_BROKEN;
+        }
+
+        // Seeking past the end succeeds, the truncated payload shows up as a partial record next
+        if (!HXSkipPayload(fp, &hx_frame)) {
+            return PROBE_BROKEN;
+        }
+    }
+    return PROBE_SAMPLED;
+}
+
+// Reads the clip duration from the HXFI trailer, looked for where cameras put it
+static bool ProbeTrailer(FILE *fp, off_t size, uint32_t *duration) {
+    uint32_t fields[3];
+    if (size < HXFI_HEADER_SIZE + HXFI_INDEX_LENGTH ||
+        fseeko(fp, size - HXFI_HEADER_SIZE - HXFI_INDEX_LENGTH, SEEK_SET) < 0 ||
+        fread(fields, sizeof(fields), 1, fp) != 1) {
+        return false;
+    }
+    if (fields[0] != HXFI || fields[1] != HXFI_INDEX_LENGTH) {
+        return false;
+    }
+    *duration = fields[2];
+    return true;
+}
+
+static void ProbeAudioRate(ProbeInfo_t *info) {
+    long audio_ms = HXElapsed(info->audio_ts_last, info->audio_ts_first);
+    if (info->audio_packets > 1 && audio_ms > 0) {
+        info->audio_rate =
+                HXNominalSampleRate((double) (info->audio_samples - info->audio_samples_last) / (double) audio_ms);
+    }
+}
+
+// Extrapolates the sample to the duration of the clip
+static void ProbeEstimate(ProbeInfo_t *info, uint32_t duration) {
+    long sampled_ms = HXElapsed(info->video_ts_last, info->video_ts_first);
+    if (info->video_packets > 1 && sampled_ms > 0) {
+        info->video_packets = lround((double) duration * (double) (info->video_packets - 1) / (double) sampled_ms) + 1;
+    }
+    info->video_ts_last = info->video_ts_first + duration;
+
+    // Audio is assumed to stop with video, packets keep the interval seen in the sample
+    long audio_sampled_ms = HXElapsed(info->audio_ts_last, info->audio_ts_first);
+    if (info->audio_packets > 1 && audio_sampled_ms > 0) {
+        double interval = (double) audio_sampled_ms / (double) (info->audio_packets - 1);
+        long audio_ms = (long) duration - info->audio_start_ms;
+        info->audio_packets = audio_ms > 0 ? (long) floor((double) audio_ms / interval) + 1 : 1;
+        info->audio_ts_last = info->audio_ts_first + (uint32_t) lround((double) (info->audio_packets - 1) * interval);
+    }
+}
+
+static void ProbeFromIndex(const HXIndex_t *index, ProbeInfo_t *info) {
+    info->video_header = index->header->info.video_header;
+    info->video_w = (uint32_t) index->header->info.video_w;
+    info->video_h = (uint32_t) index->header->info.video_h;
+    for (uint64_t i = 0; i < index->header->entries_count; i++) {
+        const HXPacketEntry_t *entry = &index->entries[i];
+        if (entry->header == HXVF) {
+            ProbeVideo(info, entry->timestamp);
+        } else {
+            ProbeAudio(info, entry->timestamp, entry->length);
+        }
+    }
+}
+
+static void WriteProbe(FILE *out, const char *in_filename, const ProbeInfo_t *info) {
+    long video_ms = HXElapsed(info->video_ts_last, info->video_ts_first);
+    double fps = video_ms > 0 ? (double) (info->video_packets - 1) * 1000.0 / (double) video_ms : 0;
+
+    flockfile(out);
+    fprintf(out, "{\"file\":");
+    WriteJsonString(out, in_filename);
+    fprintf(out, ",\"codec\":\"%s\",\"width\":%u,\"height\":%u,\"fps\":%.2f,\"audio_rate\":%d,\"duration_ms\":%ld,"
+                 "\"video_packets\":%ld,\"audio_packets\":%ld,",
+            info->video_header == HXVT ? "h265" : "h264", info->video_w, info->video_h, fps, info->audio_rate,
+            info->video_packets ? video_ms : 0, info->video_packets, info->audio_packets);
+    if (info->video_packets) {
+        fprintf(out, "\"video_ts_first\":%u,\"video_ts_last\":%u,", info->video_ts_first, info->video_ts_last);
+    } else {
+        fprintf(out, "\"video_ts_first\":null,\"video_ts_last\":null,");
+    }
+    if (info->audio_packets) {
+        fprintf(out, "\"audio_ts_first\":%u,\"audio_ts_last\":%u,", info->audio_ts_first, info->audio_ts_last);
+    } else {
+        fprintf(out, "\"audio_ts_first\":null,\"audio_ts_last\":null,");
+    }
+    fprintf(out, "\"source\":\"%s\",\"exact\":%s}\n", info->source, info->exact ? "true" : "false");
+    funlockfile(out);
+}
+
+static void WriteProbeError(FILE *out, const char *in_filename, const char *error) {
+    flockfile(out);
+    fprintf(out, "{\"file\":");
+    WriteJsonString(out, in_filename);
+    fprintf(out, ",\"error\":\"%s\"}\n", error);
+    funlockfile(out);
+}
+
+static bool ProbeFile(const char *in_filename, bool use_index, const char *index_dir) {
+    ProbeInfo_t info;
+    memset(&info, 0, sizeof(info));
+
+    HXIndex_t index;
+    if (use_index && HXIndexOpen(in_filename, index_dir, &index)) {
+        ProbeFromIndex(&index, &info);
+        HXIndexClose(&index);
+        ProbeAudioRate(&info);
+        info.source = "index";
+        info.exact = true;
+        WriteProbe(stdout, in_filename, &info);
+        return true;
+    }
+
+    FILE *fp = fopen(in_filename, "rb");
+    struct stat st;
+    if (fp == NULL || fstat(fileno(fp), &st) < 0) {
+        WriteProbeError(stdout, in_filename, "cannot read file");
+        if (fp) {
+            fclose(fp);
+        }
+        return false;
+    }
+
+    // Clips without a trailer, not closed by the camera, or whose trailer isn't where expected are walked to the end.
+    // Counts are only exact if the walk got there.
+    uint32_t duration;
+    enum ProbeWalkEnd end = ProbeWalk(fp, st.st_size, &info, PROBE_SAMPLE_MS, PROBE_SAMPLE_RECORDS);
+    if (end == PROBE_SAMPLED) {
+        ProbeAudioRate(&info);
+        off_t position = ftello(fp);
+        if (ProbeTrailer(fp, st.st_size, &duration)) {
+            ProbeEstimate(&info, duration);
+            info.source = "trailer";
+        } else if (fseeko(fp, position, SEEK_SET) == 0) {
+            end = ProbeWalk(fp, st.st_size, &info, LONG_MAX, LONG_MAX);
+        } else {
+            end = PROBE_BROKEN;
+        }
+    }
+    fclose(fp);
+    if (end != PROBE_SAMPLED) {
+        ProbeAudioRate(&info);
+        info.source = "scan";
+        info.exact = end == PROBE_COMPLETE;
+    }
+
+    if (info.video_header == 0 || info.video_packets == 0) {
+        WriteProbeError(stdout, in_filename, "no video detected");
+        return false;
+    }
+    WriteProbe(stdout, in_filename, &info);
+    return true;
+}
+
+static void *ProbeWorker(void *arg) {
+    ProbeQueue_t *queue = arg;
+    int i;
+
+    while ((i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED)) < queue->inputs_count) {
+        if (!ProbeFile(queue->inputs[i], queue->use_index, queue->index_dir)) {
+            __atomic_add_fetch(&queue->failures, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+int RunProbe(char **inputs, int inputs_count, int jobs, bool use_index, const char *index_dir) {
+    ProbeQueue_t queue = {inputs, inputs_count, 0, 0, use_index, index_dir};
+    RunWorkers(jobs < inputs_count ? jobs : inputs_count, ProbeWorker, &queue);
+    return queue.failures;
+}
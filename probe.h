@@ -0,0 +1,29 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <stdbool.h>
+
+// Prints a line of JSON per input describing the clip: codec, dimensions, frame rate, audio rate, duration, packet
+// counts and first and last timestamps. Only the stream header, the first seconds of records and the HXFI trailer
+// are read, so counts and last timestamps are estimated unless the whole file has been scanned, or its index is
+// available in index_dir (next to the input if NULL) and use_index is set. Up to jobs files are probed at the same
+// time. Returns the number of files which couldn't be probed.
+int RunProbe(char **inputs, int inputs_count, int jobs, bool use_index, const char *index_dir);
+
+#endif
@@ -0,0 +1,140 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "rawes.h"
+#include "hxscan.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX             1024
+#endif
+#define RAWES_BATCH_BYTES   (4 * 1024 * 1024)   // flush the batch when this much payload is queued
+
+// Writes every queued range, resuming after partial writes
+static bool FlushBatch(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        while (count > 0 && (size_t) written >= iov->iov_len) {
+            written -= (ssize_t) iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + written;
+            iov->iov_len -= (size_t) written;
+        }
+    }
+    return true;
+}
+
+bool WriteRawStream(FILE *in_file, const char *in_filename, FILE *out_file) {
+    int in_fd = fileno(in_file), out_fd = fileno(out_file);
+    struct stat st;
+    if (fstat(in_fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "Cannot read %s.\n", in_filename);
+        return false;
+    }
+
+    size_t size = (size_t) st.st_size;
+    uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, in_fd, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Cannot map %s in memory.\n", in_filename);
+        return false;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    // Payloads are never adjacent, there is at least a record header between two of them, so each one is a range
+    struct iovec iov[IOV_MAX];
+    int iov_count = 0;
+    size_t batch_bytes = 0;
+    size_t offset = 0;
+    bool video_detected = false, hxfi_detected = false;
+    bool success = true;
+    HXFrame_t hx_frame;
+
+    while (success && !hxfi_detected && offset < size) {
+        size_t frame_size = HXParseFrame(data + offset, size - offset, &hx_frame);
+        if (frame_size == 0) {
+            fprintf(stderr, "Premature end of file, aborting.\n");
+            success = false;
+            break;
+        }
+        offset += frame_size;
+
+        size_t payload_length = (size_t) HXPayloadLength(&hx_frame);
+        if (payload_length > size - offset) {
+            fprintf(stderr, "Premature end of file, aborting.\n");
+            success = false;
+            break;
+        }
+
+        switch (hx_frame.header) {
+            case HXVS:
+            case HXVT:
+            case HXAF:
+                break;
+
+            case HXVF:
+                video_detected = true;
+                iov[iov_count].iov_base = data + offset;
+                iov[iov_count].iov_len = payload_length;
+                iov_count++;
+                batch_bytes += payload_length;
+                if (iov_count == IOV_MAX || batch_bytes >= RAWES_BATCH_BYTES) {
+                    if (!(success = FlushBatch(out_fd, iov, iov_count))) {
+                        fprintf(stderr, "Cannot write output file.\n");
+                    }
+                    iov_count = 0;
+                    batch_bytes = 0;
+                }
+                break;
+
+            case HXFI:
+                hxfi_detected = true;
+                break;
+
+            default:
+                fprintf(stderr, "Unknown audio_frame header: %u.\n", hx_frame.header);
+                break;
+        }
+        offset += payload_length;
+    }
+
+    if (success && iov_count > 0 && !(success = FlushBatch(out_fd, iov, iov_count))) {
+        fprintf(stderr, "Cannot write output file.\n");
+    }
+    munmap(data, size);
+
+    if (success && !video_detected) {
+        fprintf(stderr, "No video detected in %s.\n", in_filename);
+        return false;
+    }
+    return success;
+}
@@ -0,0 +1,28 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef RAWES_H
+#define RAWES_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+// Writes the video payloads of the input one after the other, as the Annex-B elementary stream the camera encoded
+// (.h264 or .hevc). The input is memory mapped and payloads are written straight from the mapping in batches of
+// vectored writes, without going through LibAV.
+bool WriteRawStream(FILE *in_file, const char *in_filename, FILE *out_file);
+
+#endif
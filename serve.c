@@ -0,0 +1,871 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include "serve.h"
+#include "net.h"
+#include "session.h"
+
+#define SERVE_REQUEST_SIZE      8192
+#define SERVE_TABLE_MAGIC       "HXFRAG\r\n"
+#define SERVE_TABLE_VERSION     1
+#define SERVE_TABLE_EXTENSION   ".frag"
+#define SERVE_EVENTS_MAX        64
+#define SERVE_STEP_RECORDS      64          // input records remuxed for a client before moving to the next one
+#define SERVE_OUTPUT_BUFFERED   (256 << 10) // output held for a client before waiting for it to read some
+
+// Start of a fragment of the MP4 output and the state needed to start remuxing from it
+typedef struct ServeFragment_t {
+    Checkpoint_t state;
+    int64_t time_ms;    // key frame time from the first video frame
+} ServeFragment_t;
+
+// A fragment table file is this header followed by entries_count ServeFragment_t. Like the index, it is a cache
+// private to the machine that wrote it.
+typedef struct ServeTableHeader_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t source_size;
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+    uint32_t skip_audio;
+    uint32_t reserved;
+    uint64_t output_size;
+    uint64_t header_size;
+    uint64_t entries_count;
+} ServeTableHeader_t;
+
+typedef struct ServeTable_t {
+    ServeFragment_t *fragments;
+    size_t count, size;
+    int64_t output_size;
+    int64_t header_size;
+} ServeTable_t;
+
+typedef struct ServeRequest_t {
+    char method[8];
+    char path[1024];        // decoded, without query
+    double time;            // ?t= in seconds, negative if not given
+    bool range;
+    int64_t range_first;    // negative for a suffix range, the last -range_first bytes
+    int64_t range_last;     // -1 up to the end
+} ServeRequest_t;
+
+// Table path is "clip.264.frag" next to the input, or "dir/clip.264.frag" when an index directory is given
+static char *TablePath(const char *in_filename, const char *index_dir) {
+    char *path, *in_copy = strdup(in_filename);
+    if (in_copy == NULL) {
+        return NULL;
+    }
+    const char *name = index_dir ? basename(in_copy) : in_filename;
+    size_t length = (index_dir ? strlen(index_dir) + 1 : 0) + strlen(name) + sizeof(SERVE_TABLE_EXTENSION);
+    if ((path = malloc(length))) {
+        snprintf(path, length, "%s%s%s%s", index_dir ? index_dir : "", index_dir ? "/" : "", name,
+                 SERVE_TABLE_EXTENSION);
+    }
+    free(in_copy);
+    return path;
+}
+
+static bool TableLoad(const char *in_filename, const ConvertOptions_t *options, ServeTable_t *table) {
+    struct stat in_st;
+    ServeTableHeader_t header;
+    char *path = TablePath(in_filename, options->index_dir);
+    if (path == NULL || stat(in_filename, &in_st) < 0) {
+        free(path);
+        return false;
+    }
+    FILE *fp = fopen(path, "rb");
+    free(path);
+    if (fp == NULL) {
+        return false;
+    }
+
+    bool success = fread(&header, sizeof(header), 1, fp) == 1 &&
+                   memcmp(header.magic, SERVE_TABLE_MAGIC, sizeof(header.magic)) == 0 &&
+                   header.version == SERVE_TABLE_VERSION && header.entry_size == sizeof(ServeFragment_t) &&
+                   header.source_size == (uint64_t) in_st.st_size &&
+                   header.source_mtime_sec == in_st.st_mtim.tv_sec &&
+                   header.source_mtime_nsec == in_st.st_mtim.tv_nsec &&
+                   header.skip_audio == options->skip_audio && header.entries_count > 0 &&
+                   header.entries_count < SIZE_MAX / sizeof(ServeFragment_t);
+    if (success) {
+        table->fragments = malloc(header.entries_count * sizeof(ServeFragment_t));
+        success = table->fragments &&
+                  fread(table->fragments, sizeof(ServeFragment_t), header.entries_count, fp) == header.entries_count;
+        table->count = table->size = success ? header.entries_count : 0;
+        table->output_size = (int64_t) header.output_size;
+        table->header_size = (int64_t) header.header_size;
+    }
+    fclose(fp);
+    return success;
+}
+
+static bool TableSave(const char *in_filename, const ConvertOptions_t *options, const ServeTable_t *table) {
+    struct stat in_st;
+    if (stat(in_filename, &in_st) < 0) {
+        return false;
+    }
+
+    ServeTableHeader_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SERVE_TABLE_MAGIC, sizeof(header.magic));
+    header.version = SERVE_TABLE_VERSION;
+    header.entry_size = sizeof(ServeFragment_t);
+    header.source_size = in_st.st_size;
+    header.source_mtime_sec = in_st.st_mtim.tv_sec;
+    header.source_mtime_nsec = in_st.st_mtim.tv_nsec;
+    header.skip_audio = options->skip_audio;
+    header.output_size = (uint64_t) table->output_size;
+    header.header_size = (uint64_t) table->header_size;
+    header.entries_count = table->count;
+
+    // Concurrent requests may build the same table, each writes a file of its own and the last rename wins
+    char *path = TablePath(in_filename, options->index_dir);
+    size_t tmp_length = path ? strlen(path) + 8 : 0;
+    char *tmp_path = path ? malloc(tmp_length) : NULL;
+    bool success = false;
+    if (tmp_path) {
+        snprintf(tmp_path, tmp_length, "%s.XXXXXX", path);
+        int fd = mkstemp(tmp_path);
+        if (fd >= 0) {
+            size_t fragments_size = table->count * sizeof(ServeFragment_t);
+            success = write(fd, &header, sizeof(header)) == (ssize_t) sizeof(header) &&
+                      write(fd, table->fragments, fragments_size) == (ssize_t) fragments_size;
+            success = (close(fd) == 0) && success;
+            success = success && chmod(tmp_path, 0644) == 0 && rename(tmp_path, path) == 0;
+            if (!success) {
+                unlink(tmp_path);
+            }
+        }
+    }
+    free(tmp_path);
+    free(path);
+    return success;
+}
+
+static bool CollectFragment(void *opaque, const Checkpoint_t *checkpoint, long time_ms) {
+    ServeTable_t *table = opaque;
+    if (table->count == table->size) {
+        table->size = table->size ? table->size * 2 : 256;
+        if (!(table->fragments = realloc(table->fragments, table->size * sizeof(ServeFragment_t)))) {
+            fprintf(stderr, "Cannot allocate memory, aborting.\n");
+            exit(1);
+        }
+    }
+    table->fragments[table->count].state = *checkpoint;
+    table->fragments[table->count++].time_ms = time_ms;
+    return true;
+}
+
+// Completes the table with the sizes found by the remux that collected its fragments, and saves it
+static void TableFinish(const char *in_filename, const ConvertOptions_t *options, ServeTable_t *table,
+                        const ConvertStream_t *stream) {
+    table->output_size = stream->size;
+    table->header_size = stream->header_size;
+    if (table->count > 0 && !TableSave(in_filename, options, table)) {
+        fprintf(stderr, "Warning! Cannot save fragment table of %s.\n", in_filename);
+    }
+}
+
+// Remuxes the whole clip without writing anything, to find out where each fragment starts and how long the output is
+static void TableBuild(const char *in_filename, const char *url, const ConvertOptions_t *options,
+                       ServeTable_t *table) {
+    ConvertStream_t stream = {.fd = -1, .range_start = INT64_MAX, .range_end = -1, .on_fragment = CollectFragment,
+                              .opaque = table};
+    ConvertOptions_t build_options = *options;
+    build_options.stream = &stream;
+    memset(table, 0, sizeof(ServeTable_t));
+    ConvertFile(in_filename, url, &build_options);
+    TableFinish(in_filename, options, table, &stream);
+}
+
+// Last fragment starting at or before offset, NULL if offset is within the header
+static const ServeFragment_t *FragmentAtOffset(const ServeTable_t *table, int64_t offset) {
+    const ServeFragment_t *found = NULL;
+    size_t low = 0, high = table->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if ((int64_t) table->fragments[middle].state.output_offset <= offset) {
+            found = &table->fragments[middle];
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return found;
+}
+
+static const ServeFragment_t *FragmentAtTime(const ServeTable_t *table, double time) {
+    const ServeFragment_t *found = &table->fragments[0];
+    for (size_t i = 1; i < table->count && (double) table->fragments[i].time_ms <= time * 1000.0; i++) {
+        found = &table->fragments[i];
+    }
+    return found;
+}
+
+static int HexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c = (char) tolower((unsigned char) c);
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+// Percent-decodes the path of target, rejecting paths which would leave the served directory
+static bool DecodePath(const char *target, size_t length, char *path, size_t path_size) {
+    size_t j = 0;
+    for (size_t i = 0; i < length; i++) {
+        char c = target[i];
+        if (c == '%') {
+            int high, low;
+            if (i + 2 >= length || (high = HexValue(target[i + 1])) < 0 || (low = HexValue(target[i + 2])) < 0) {
+                return false;
+            }
+            c = (char) (high * 16 + low);
+            i += 2;
+        }
+        if (c == '\0' || j + 1 >= path_size) {
+            return false;
+        }
+        path[j++] = c;
+    }
+    path[j] = '\0';
+
+    if (path[0] != '/') {
+        return false;
+    }
+    for (const char *segment = path; segment; segment = strchr(segment + 1, '/')) {
+        if (strncmp(segment, "/../", 4) == 0 || strcmp(segment, "/..") == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool ParseRange(const char *value, ServeRequest_t *request) {
+    while (*value == ' ') {
+        value++;
+    }
+    if (strncmp(value, "bytes=", 6) != 0 || strchr(value, ',')) { // multiple ranges are answered with everything
+        return false;
+    }
+
+    char *end;
+    value += 6;
+    if (*value == '-') {
+        long long suffix = strtoll(value + 1, &end, 10);
+        if (end == value + 1 || suffix <= 0) {
+            return false;
+        }
+        request->range_first = -suffix;
+        request->range_last = -1;
+    } else {
+        request->range_first = strtoll(value, &end, 10);
+        if (end == value || *end != '-' || request->range_first < 0) {
+            return false;
+        }
+        value = end + 1;
+        request->range_last = *value >= '0' && *value <= '9' ? strtoll(value, &end, 10) : -1;
+        if (request->range_last >= 0 && request->range_last < request->range_first) {
+            return false;
+        }
+    }
+    request->range = true;
+    return true;
+}
+
+// Parses the parts we care about of a complete request head
+static int ParseRequest(char *buffer, ServeRequest_t *request) {
+    memset(request, 0, sizeof(ServeRequest_t));
+    request->time = -1;
+    char *target = strchr(buffer, ' ');
+    if (target == NULL || target - buffer >= (long) sizeof(request->method)) {
+        return 400;
+    }
+    memcpy(request->method, buffer, target - buffer);
+    target++;
+    char *target_end = strchr(target, ' ');
+    if (target_end == NULL || strncmp(target_end, " HTTP/1.", 8) != 0) {
+        return 400;
+    }
+
+    char *query = memchr(target, '?', target_end - target);
+    if (!DecodePath(target, (query ? query : target_end) - target, request->path, sizeof(request->path))) {
+        return 400;
+    }
+    for (char *param = query; param && param < target_end; param = memchr(param + 1, '&', target_end - param - 1)) {
+        if (strncmp(param + 1, "t=", 2) == 0) {
+            request->time = strtod(param + 3, NULL);
+        }
+    }
+
+    for (char *line = strstr(target_end, "\r\n"); line && line[2] != '\r'; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, "Range:", 6) == 0) {
+            ParseRange(line + 8, request);
+        }
+    }
+
+    if (strcmp(request->method, "GET") != 0 && strcmp(request->method, "HEAD") != 0) {
+        return 405;
+    }
+    return 200;
+}
+
+// Reads the request head, up to the empty line, and parses it
+static int ReadRequest(int fd, ServeRequest_t *request) {
+    char buffer[SERVE_REQUEST_SIZE];
+    size_t length = 0;
+    buffer[0] = '\0';
+    while (!strstr(buffer, "\r\n\r\n")) {
+        if (length == sizeof(buffer) - 1) {
+            return 431;
+        }
+        ssize_t received = recv(fd, buffer + length, sizeof(buffer) - 1 - length, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return 0;
+        }
+        length += received;
+        buffer[length] = '\0';
+    }
+    return ParseRequest(buffer, request);
+}
+
+// Status line and headers of an error response
+static int StatusHead(int status, char *head, size_t head_size) {
+    const char *reason;
+    switch (status) {
+        case 400:
+            reason = "Bad Request";
+            break;
+        case 404:
+            reason = "Not Found";
+            break;
+        case 405:
+            reason = "Method Not Allowed";
+            break;
+        case 431:
+            reason = "Request Header Fields Too Large";
+            break;
+        default:
+            reason = "Internal Server Error";
+            break;
+    }
+
+    return snprintf(head, head_size, "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status,
+                    reason);
+}
+
+static void SendStatus(int fd, int status) {
+    char response[256];
+    NetSendAll(fd, response, StatusHead(status, response, sizeof(response)));
+}
+
+// "/dir/clip.264.mp4" is the MP4 version of root/dir/clip.264. Sets *in_filename to a newly allocated path if found.
+static int ResolveClip(const char *root, const ServeRequest_t *request, char **in_filename) {
+    size_t path_length = strlen(request->path);
+    struct stat in_st;
+    if (!(*in_filename = malloc(strlen(root) + path_length + 1))) {
+        return 500;
+    }
+    sprintf(*in_filename, "%s%s", root, request->path);
+    size_t in_length = strlen(*in_filename);
+    if (path_length < 8 || strcmp(request->path + path_length - 4, ".mp4") != 0) {
+        free(*in_filename);
+        return 404;
+    }
+    (*in_filename)[in_length - 4] = '\0';
+    if ((strcmp(*in_filename + in_length - 8, ".264") != 0 && strcmp(*in_filename + in_length - 8, ".265") != 0) ||
+        stat(*in_filename, &in_st) < 0 || !S_ISREG(in_st.st_mode)) {
+        free(*in_filename);
+        return 404;
+    }
+    return 200;
+}
+
+// Sets where remuxing starts and which part of the output is sent, and writes the response head. Byte ranges restart
+// the muxer from the fragment holding their first byte, time seeks from the fragment of the last key frame before
+// that time, which follows a header of its own. Returns the response status, with no body to send if it is 416.
+static int PrepareResponse(const ServeRequest_t *request, const ServeTable_t *table, ConvertStream_t *stream,
+                           char *head, size_t head_size, int *head_length, int64_t *content_length) {
+    const ServeFragment_t *fragment = NULL;
+    int status = 200;
+    *content_length = table->output_size;
+    stream->range_start = 0;
+    stream->range_end = -1;
+    if (request->time >= 0) {
+        fragment = FragmentAtTime(table, request->time);
+        if (fragment == &table->fragments[0]) {
+            fragment = NULL; // from the beginning, including what precedes the first key frame
+        } else {
+            *content_length = table->header_size + table->output_size - (int64_t) fragment->state.output_offset;
+        }
+    } else if (request->range) {
+        int64_t first = request->range_first, last = request->range_last;
+        if (first < 0) {
+            first = table->output_size + first > 0 ? table->output_size + first : 0;
+        }
+        if (last < 0 || last >= table->output_size) {
+            last = table->output_size - 1;
+        }
+        if (first >= table->output_size) {
+            *head_length = snprintf(head, head_size, "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                                                     "Content-Range: bytes */%lld\r\nContent-Length: 0\r\n"
+                                                     "Connection: close\r\n\r\n",
+                                    (long long) table->output_size);
+            *content_length = 0;
+            return 416;
+        }
+        fragment = FragmentAtOffset(table, first);
+        stream->range_start = first;
+        stream->range_end = last + 1;
+        *content_length = last + 1 - first;
+        status = 206;
+    }
+    stream->start = fragment ? &fragment->state : NULL;
+
+    *head_length = snprintf(head, head_size, "HTTP/1.1 %d %s\r\nContent-Type: video/mp4\r\n"
+                                             "Content-Length: %lld\r\nAccept-Ranges: bytes\r\n",
+                            status, status == 206 ? "Partial Content" : "OK", (long long) *content_length);
+    if (status == 206) {
+        *head_length += snprintf(head + *head_length, head_size - *head_length,
+                                 "Content-Range: bytes %lld-%lld/%lld\r\n", (long long) stream->range_start,
+                                 (long long) stream->range_end - 1, (long long) table->output_size);
+    }
+    *head_length += snprintf(head + *head_length, head_size - *head_length, "Connection: close\r\n\r\n");
+    return status;
+}
+
+static void ServeConnection(int fd, const char *root, const ConvertOptions_t *options, bool verbose) {
+    ServeRequest_t request;
+    char *in_filename;
+    int status = ReadRequest(fd, &request);
+    if (status == 200) {
+        status = ResolveClip(root, &request, &in_filename);
+    }
+    if (status != 200) {
+        if (status) {
+            SendStatus(fd, status);
+        }
+        return;
+    }
+
+    ServeTable_t table;
+    if (!TableLoad(in_filename, options, &table)) {
+        TableBuild(in_filename, request.path, options, &table);
+    }
+    if (table.count == 0 || table.output_size <= 0) {
+        SendStatus(fd, 500);
+        free(table.fragments);
+        free(in_filename);
+        return;
+    }
+
+    ConvertStream_t stream = {.fd = fd};
+    char head[512];
+    int head_length;
+    int64_t content_length;
+    status = PrepareResponse(&request, &table, &stream, head, sizeof(head), &head_length, &content_length);
+    if (verbose) {
+        fprintf(stderr, "%s %s %d %lld\n", request.method, request.path, status, (long long) content_length);
+    }
+    if (NetSendAll(fd, head, head_length) && status != 416 && strcmp(request.method, "GET") == 0) {
+        ConvertOptions_t stream_options = *options;
+        stream_options.stream = &stream;
+        ConvertFile(in_filename, request.path, &stream_options);
+    }
+    free(table.fragments);
+    free(in_filename);
+}
+
+// Where a connection is at in the event loop: reading the request, building the fragment table of the clip, or
+// sending the response head and then the output of its session as the client reads it
+enum ServeClientState {
+    CLIENT_REQUEST,
+    CLIENT_TABLE,
+    CLIENT_SEND
+};
+
+typedef struct ServeClient_t {
+    int fd;
+    enum ServeClientState state;
+    char buffer[SERVE_REQUEST_SIZE];
+    size_t buffer_length;
+    ServeRequest_t request;
+    char *in_filename;
+    ServeTable_t table;
+    ConvertStream_t stream;
+    ConvertSession_t *session;
+    char head[512];
+    int head_length, head_sent;
+    bool writable; // until a send would block, then again once epoll reports the socket writable
+    struct ServeClient_t *prev, *next;
+} ServeClient_t;
+
+typedef struct ServeLoop_t {
+    int epoll_fd;
+    const char *root;
+    const ConvertOptions_t *options;
+    bool verbose;
+    ServeClient_t *clients;
+} ServeLoop_t;
+
+static void ClientClose(ServeLoop_t *loop, ServeClient_t *client) {
+    if (client->prev) {
+        client->prev->next = client->next;
+    } else {
+        loop->clients = client->next;
+    }
+    if (client->next) {
+        client->next->prev = client->prev;
+    }
+    ConvertSessionClose(client->session);
+    close(client->fd); // also removes it from the epoll set
+    free(client->table.fragments);
+    free(client->in_filename);
+    free(client);
+}
+
+// Moves to sending head, followed by the output of the session if there is one
+static bool ClientSend(ServeClient_t *client) {
+    client->state = CLIENT_SEND;
+    client->head_sent = 0;
+    return true;
+}
+
+static bool ClientStatus(ServeClient_t *client, int status) {
+    client->head_length = StatusHead(status, client->head, sizeof(client->head));
+    return ClientSend(client);
+}
+
+// Same response as ServeConnection, with the remux run by a session instead of ConvertFile
+static bool ClientRespond(ServeLoop_t *loop, ServeClient_t *client) {
+    if (client->table.count == 0 || client->table.output_size <= 0) {
+        return ClientStatus(client, 500);
+    }
+
+    // The stream may still hold the callback that collected the table, which mustn't see the fragments again
+    client->stream = (ConvertStream_t) {.fd = -1};
+    int64_t content_length;
+    int status = PrepareResponse(&client->request, &client->table, &client->stream, client->head,
+                                 sizeof(client->head), &client->head_length, &content_length);
+    if (loop->verbose) {
+        fprintf(stderr, "%s %s %d %lld\n", client->request.method, client->request.path, status,
+                (long long) content_length);
+    }
+    if (status != 416 && strcmp(client->request.method, "GET") == 0) {
+        ConvertOptions_t stream_options = *loop->options;
+        stream_options.stream = &client->stream;
+        if (!(client->session = ConvertSessionOpen(client->in_filename, client->request.path, &stream_options))) {
+            return false;
+        }
+    }
+    return ClientSend(client);
+}
+
+// Reads what has arrived of the request, and once it is complete looks up the clip and its fragment table
+static bool ClientRead(ServeLoop_t *loop, ServeClient_t *client) {
+    ssize_t received = recv(client->fd, client->buffer + client->buffer_length,
+                            sizeof(client->buffer) - 1 - client->buffer_length, 0);
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return true;
+    }
+    if (received <= 0) {
+        return false;
+    }
+    client->buffer_length += received;
+    client->buffer[client->buffer_length] = '\0';
+    if (!strstr(client->buffer, "\r\n\r\n") && client->buffer_length < sizeof(client->buffer) - 1) {
+        return true;
+    }
+
+    // Nothing more is read from the client, only written to it
+    struct epoll_event event = {.events = EPOLLOUT | EPOLLET, .data.ptr = client};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, client->fd, &event) < 0) {
+        return false;
+    }
+    client->writable = true;
+    if (!strstr(client->buffer, "\r\n\r\n")) {
+        return ClientStatus(client, 431);
+    }
+
+    int status = ParseRequest(client->buffer, &client->request);
+    if (status == 200) {
+        status = ResolveClip(loop->root, &client->request, &client->in_filename);
+    }
+    if (status != 200) {
+        client->in_filename = NULL;
+        return ClientStatus(client, status);
+    }
+    if (TableLoad(client->in_filename, loop->options, &client->table)) {
+        return ClientRespond(loop, client);
+    }
+
+    // Like TableBuild, a remux that writes nothing
+    ConvertOptions_t build_options = *loop->options;
+    memset(&client->table, 0, sizeof(ServeTable_t));
+    client->stream = (ConvertStream_t) {.fd = -1, .range_start = INT64_MAX, .range_end = -1,
+                                        .on_fragment = CollectFragment, .opaque = &client->table};
+    build_options.stream = &client->stream;
+    if (!(client->session = ConvertSessionOpen(client->in_filename, client->request.path, &build_options))) {
+        return ClientStatus(client, 500);
+    }
+    client->state = CLIENT_TABLE;
+    return true;
+}
+
+// Sends what can be sent without blocking, first the head and then the output of the session
+static bool ClientWrite(ServeClient_t *client) {
+    while (client->writable) {
+        const uint8_t *data;
+        size_t length;
+        if (client->head_sent < client->head_length) {
+            data = (const uint8_t *) client->head + client->head_sent;
+            length = client->head_length - client->head_sent;
+        } else if (client->session) {
+            data = ConvertSessionOutput(client->session, &length);
+        } else {
+            length = 0;
+        }
+        if (length == 0) {
+            return true;
+        }
+
+        ssize_t sent = send(client->fd, data, length, MSG_NOSIGNAL);
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            client->writable = false;
+        } else if (sent < 0 && errno != EINTR) {
+            return false; // the client went away
+        } else if (sent > 0 && client->head_sent < client->head_length) {
+            client->head_sent += (int) sent;
+        } else if (sent > 0) {
+            ConvertSessionConsume(client->session, sent);
+        }
+    }
+    return true;
+}
+
+// Advances a client by a bounded amount of work, so that the others get their turn. Returns false once it is done
+// with, or on errors, which only affect that client.
+static bool ClientRun(ServeLoop_t *loop, ServeClient_t *client) {
+    switch (client->state) {
+        case CLIENT_REQUEST:
+            return true;
+
+        case CLIENT_TABLE:
+            if (!ConvertSessionStep(client->session, SERVE_STEP_RECORDS, SIZE_MAX)) {
+                return ClientStatus(client, 500);
+            }
+            if (!ConvertSessionFinished(client->session)) {
+                return true;
+            }
+            ConvertSessionClose(client->session);
+            client->session = NULL;
+            TableFinish(client->in_filename, loop->options, &client->table, &client->stream);
+            return ClientRespond(loop, client);
+
+        case CLIENT_SEND:
+            if (!ClientWrite(client)) {
+                return false;
+            }
+            if (client->session && !ConvertSessionFinished(client->session) &&
+                !ConvertSessionStep(client->session, SERVE_STEP_RECORDS, SERVE_OUTPUT_BUFFERED)) {
+                return false; // the head is out already, all that can be done is ending the response early
+            }
+            if (!ClientWrite(client)) {
+                return false;
+            }
+            size_t pending = 0;
+            if (client->session) {
+                ConvertSessionOutput(client->session, &pending);
+            }
+            return client->head_sent < client->head_length || pending > 0 ||
+                   (client->session && !ConvertSessionFinished(client->session));
+    }
+    return false;
+}
+
+// Whether a client has work to do without waiting for its socket
+static bool ClientRunnable(const ServeClient_t *client) {
+    if (client->state == CLIENT_TABLE) {
+        return true;
+    }
+    if (client->state != CLIENT_SEND || !client->writable) {
+        return false;
+    }
+    size_t pending = 0;
+    if (client->session) {
+        ConvertSessionOutput(client->session, &pending);
+    }
+    return pending < SERVE_OUTPUT_BUFFERED && client->session && !ConvertSessionFinished(client->session);
+}
+
+static void ClientAccept(ServeLoop_t *loop, int listen_fd) {
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd >= 0 && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "Cannot accept HTTP connection: %s\n", strerror(errno));
+            }
+            return;
+        }
+
+        ServeClient_t *client = calloc(1, sizeof(ServeClient_t));
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = client};
+        if (!client || epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            fprintf(stderr, "Cannot serve HTTP connection: %s\n", strerror(errno ? errno : ENOMEM));
+            free(client);
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        client->next = loop->clients;
+        if (loop->clients) {
+            loop->clients->prev = client;
+        }
+        loop->clients = client;
+    }
+}
+
+// All connections in this thread: epoll reports readable requests and writable sockets, and in between every client
+// with work to do gets a few records remuxed, its output being held in memory until the socket takes it. Reading
+// the clips is left blocking, as regular files are always reported ready anyway.
+static int RunEventLoop(int listen_fd, ServeLoop_t *loop) {
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL}, events[SERVE_EVENTS_MAX];
+    if ((loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK) < 0 ||
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) < 0) {
+        fprintf(stderr, "Cannot start the event loop: %s\n", strerror(errno));
+        close(listen_fd);
+        return 1;
+    }
+
+    for (;;) {
+        bool runnable = false;
+        for (ServeClient_t *client = loop->clients; client && !runnable; client = client->next) {
+            runnable = ClientRunnable(client);
+        }
+        int count = epoll_wait(loop->epoll_fd, events, SERVE_EVENTS_MAX, runnable ? 0 : -1);
+        if (count < 0 && errno != EINTR) {
+            fprintf(stderr, "Cannot wait for HTTP connections: %s\n", strerror(errno));
+            close(loop->epoll_fd);
+            close(listen_fd);
+            return 1;
+        }
+
+        for (int i = 0; i < count; i++) {
+            ServeClient_t *client = events[i].data.ptr;
+            if (!client) {
+                ClientAccept(loop, listen_fd);
+            } else if (client->state != CLIENT_REQUEST) {
+                client->writable = true; // or in error, which the next send reports
+            } else if (!ClientRead(loop, client)) {
+                ClientClose(loop, client);
+            }
+        }
+
+        ServeClient_t *next;
+        for (ServeClient_t *client = loop->clients; client; client = next) {
+            next = client->next;
+            if (!ClientRun(loop, client)) {
+                ClientClose(loop, client);
+            }
+        }
+    }
+}
+
+int RunServer(const char *address, const char *root, const ConvertOptions_t *options, bool event_loop) {
+    if (options->audio_codec && strcmp(options->audio_codec, "copy") != 0) {
+        fprintf(stderr, "The server can't transcode audio.\n");
+        return 1;
+    }
+
+    int listen_fd = NetListen(address, "HTTP");
+    if (listen_fd < 0) {
+        return 1;
+    }
+
+    // Every remux runs in a process of its own, as conversion errors terminate the process, and isn't waited for
+    signal(SIGCHLD, SIG_IGN);
+    ConvertOptions_t serve_options = *options;
+    serve_options.format_name = "mp4";
+    serve_options.quiet = true;
+    serve_options.use_index = true;
+    serve_options.dedup_param_sets = false; // which parameter sets were dropped depends on where remuxing started
+    serve_options.resumable = false;
+    serve_options.overwrite_existing = true;
+    serve_options.memory_limit = 0; // a packet over the limit would end the event loop, and every client with it
+    serve_options.follow_ms = 0;    // refused by sessions, clips are served as they are when requested
+    serve_options.audio_codec = NULL;
+
+    if (!options->quiet) {
+        fprintf(stderr, "Serving %s on %s\n", root, address);
+    }
+    if (event_loop) {
+        ServeLoop_t loop = {.root = root, .options = &serve_options, .verbose = !options->quiet};
+        return RunEventLoop(listen_fd, &loop);
+    }
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            fprintf(stderr, "Cannot accept HTTP connection: %s\n", strerror(errno));
+            close(listen_fd);
+            return 1;
+        }
+
+        fflush(NULL);
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(listen_fd);
+            signal(SIGCHLD, SIG_DFL);
+            // Clients closing the connection end the remux
+            signal(SIGPIPE, SIG_DFL);
+            ServeConnection(fd, root, &serve_options, !options->quiet);
+            close(fd);
+            exit(0);
+        }
+        if (pid < 0) {
+            fprintf(stderr, "Cannot serve HTTP connection: %s\n", strerror(errno));
+        }
+        close(fd);
+    }
+}
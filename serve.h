@@ -0,0 +1,28 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef SERVE_H
+#define SERVE_H
+
+#include "convert.h"
+
+// Serves the clips found under root over HTTP on address, a port number bound to the loopback interface or
+// host:port. "GET /dir/clip.264.mp4" remuxes root/dir/clip.264 to fragmented MP4 on the fly, in a process of its own,
+// or with event_loop in a session driven by a single epoll loop along with all the others, honouring byte ranges, and
+// "?t=seconds" starts playback from the last key frame before that time. Only returns if the server can't be started.
+int RunServer(const char *address, const char *root, const ConvertOptions_t *options, bool event_loop);
+
+#endif
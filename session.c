@@ -0,0 +1,448 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libavutil/mathematics.h>
+#include "session.h"
+#include "hxscan.h"
+#include "hxindex.h"
+#include "metrics.h"
+#include "nal.h"
+#include "fdsink.h"
+#include "trace.h"
+
+// Where the parser is within the input: about to read a record header, its payload, or to mux the packet read
+enum SessionState {
+    SESSION_HEADER,
+    SESSION_BODY,
+    SESSION_EMIT,
+    SESSION_TRAILER,
+    SESSION_FINISHED
+};
+
+struct ConvertSession_t {
+    enum SessionState state;
+    ConvertStream_t *stream;
+    FILE *in_file;
+    AVFormatContext *format_ctx;
+    FdSink_t sink;
+    HXStreamInfo_t info;
+    HXFrame_t hx_frame;
+    bool hevc, length_prefixed;
+    bool dedup_param_sets;
+    uint64_t param_sets_hash;
+    bool param_sets_hash_set;
+    int audio_sample_rate;
+    long video_origin, audio_origin;
+    AudioClock_t audio_clock;
+    uint32_t fragment_index;
+    bool fragment_empty;
+    bool lost;                  // skipping unknown headers
+    uint8_t *packet_buffer, *length_buffer;
+    size_t packet_buffer_length, length_buffer_size, packet_buffer_offset;
+    uint8_t *audio_buffer;      // apart, as audio may come between parameter sets and their key frame
+    size_t audio_buffer_length;
+    size_t packet_buffer_max;   // 0 for no limit
+    AVPacket packet;
+};
+
+// First pass results, from the index if it is up to date, or from a scan of the record headers
+static bool SessionStreamInfo(ConvertSession_t *session, const char *in_filename, const ConvertOptions_t *options) {
+    HXIndex_t index;
+    if (options->use_index && HXIndexOpen(in_filename, options->index_dir, &index)) {
+        session->info = index.header->info;
+        HXIndexClose(&index);
+        return true;
+    }
+
+    HXPacketEntry_t *entries = NULL;
+    size_t entries_count = 0;
+    if (!HXScanStream(session->in_file, &session->info, options->use_index ? &entries : NULL, &entries_count)) {
+        return false;
+    }
+    if (options->use_index) {
+        if (!HXIndexWrite(in_filename, options->index_dir, &session->info, entries, entries_count)) {
+            fprintf(stderr, "Warning! Cannot write index of %s.\n", in_filename);
+        }
+        free(entries);
+    }
+    return true;
+}
+
+ConvertSession_t *ConvertSessionOpen(const char *in_filename, const char *out_filename,
+                                     const ConvertOptions_t *options) {
+    if ((options->audio_codec && strcmp(options->audio_codec, "copy") != 0) || options->follow_ms) {
+        fprintf(stderr, "Streamed output can't transcode audio or follow a growing input.\n");
+        return NULL;
+    }
+    ConvertSession_t *session = calloc(1, sizeof(ConvertSession_t));
+    if (!session) {
+        return NULL;
+    }
+    ConvertStream_t *stream = options->stream;
+    const Checkpoint_t *start = stream->start;
+    session->stream = stream;
+    session->sink.fd = stream->fd;
+    session->sink.range_start = stream->range_start;
+    session->sink.range_end = stream->range_end;
+    session->fragment_index = 1;
+    session->fragment_empty = true;
+    session->packet_buffer_max = options->memory_limit / MEMORY_PACKET_SHARE;
+    av_init_packet(&session->packet);
+
+    // Same format as ConvertFile would pick
+    int retval;
+    const char *format_name = options->format_name || out_filename ? options->format_name : "matroska";
+    if ((retval = avformat_alloc_output_context2(&session->format_ctx, NULL, format_name, out_filename)) < 0) {
+        fprintf(stderr, "Could not allocate an output context: %s\n", av_err2str(retval));
+        ConvertSessionClose(session);
+        return NULL;
+    }
+    const AVOutputFormat *out_fmt = session->format_ctx->oformat;
+    if (!IsFragmentableFormat(out_fmt)) {
+        fprintf(stderr, "Fragmented output needs MP4, MOV, Matroska or WebM format.\n");
+        ConvertSessionClose(session);
+        return NULL;
+    }
+    if (!(session->in_file = fopen(in_filename, "rb"))) {
+        fprintf(stderr, "Cannot open %s for reading.\n", in_filename);
+        ConvertSessionClose(session);
+        return NULL;
+    }
+    TRACE_BEGIN(trace_scan);
+    if (start) {
+        session->info = start->info;
+    } else if (!SessionStreamInfo(session, in_filename, options)) {
+        ConvertSessionClose(session);
+        return NULL;
+    }
+    TRACE_END(trace_scan, "scan", NULL);
+    if (session->info.video_avg_frame_rate <= 0) {
+        fprintf(stderr, "No video detected in %s.\n", in_filename);
+        ConvertSessionClose(session);
+        return NULL;
+    }
+
+    session->hevc = session->info.video_header == HXVT;
+    session->audio_sample_rate = session->info.audio_avg_sample_rate > 0 && !options->skip_audio ?
+                                 HXNominalSampleRate(session->info.audio_avg_sample_rate) : 0;
+    if (!InitAVStreams(session->format_ctx, session->info.video_w, session->info.video_h,
+                       session->hevc ? AV_CODEC_ID_H265 : AV_CODEC_ID_H264, session->info.video_avg_frame_rate,
+                       (long) session->info.video_packets_count, session->audio_sample_rate, NULL, NULL)) {
+        ConvertSessionClose(session);
+        return NULL;
+    }
+    // Left to LibAV if the parameter sets can't be parsed, and repeated ones are kept if there are none to put in the
+    // header instead
+    if (IsLengthPrefixedFormat(out_fmt) || options->dedup_param_sets) {
+        bool extradata = SetVideoExtradata(session->format_ctx, 0, session->hevc, session->in_file);
+        session->length_prefixed = extradata && IsLengthPrefixedFormat(out_fmt);
+        session->dedup_param_sets = extradata && options->dedup_param_sets;
+    }
+
+    ComputeOrigins(&session->info, session->audio_sample_rate, &session->video_origin, &session->audio_origin);
+    session->audio_clock.sample_rate = session->audio_sample_rate;
+
+    AVDictionary *muxer_options = NULL;
+    if (!(session->format_ctx->pb = FdSinkOpen(&session->sink))) {
+        ConvertSessionClose(session);
+        return NULL;
+    }
+    if (IsLengthPrefixedFormat(out_fmt)) {
+        av_dict_set(&muxer_options, "movflags", "frag_custom+empty_moov+default_base_moof+frag_discont+skip_trailer",
+                    0);
+        if (start) {
+            av_dict_set_int(&muxer_options, "fragment_index", start->fragment_index, 0);
+        }
+    }
+    if (options->memory_limit) {
+        // Fragments already bound what MP4 holds, Matroska clusters are kept small as ConvertFile does
+        if (strcmp(out_fmt->name, "matroska") == 0 || strcmp(out_fmt->name, "webm") == 0) {
+            av_dict_set_int(&muxer_options, "cluster_size_limit", (int64_t) session->packet_buffer_max, 0);
+            av_dict_set_int(&muxer_options, "cluster_time_limit", 1000, 0);
+        }
+        session->format_ctx->max_interleave_delta = MEMORY_INTERLEAVE_US;
+    }
+    TRACE_BEGIN(trace_header);
+    retval = avformat_write_header(session->format_ctx, &muxer_options);
+    av_dict_free(&muxer_options);
+    if (retval < 0) {
+        fprintf(stderr, "Error occurred when writing header: %s\n", av_err2str(retval));
+        ConvertSessionClose(session);
+        return NULL;
+    }
+    TRACE_END(trace_header, "write header", out_fmt->name);
+
+    avio_flush(session->format_ctx->pb);
+    stream->header_size = session->sink.position;
+    if (start) {
+        session->sink.position = (int64_t) start->output_offset;
+        session->fragment_index = start->fragment_index;
+        session->audio_clock.started = start->audio_clock_started;
+        session->audio_clock.next_pts = start->audio_next_pts;
+        if (fseeko(session->in_file, (off_t) start->input_offset, SEEK_SET) < 0) {
+            fprintf(stderr, "Seek error in %s.\n", in_filename);
+            ConvertSessionClose(session);
+            return NULL;
+        }
+    }
+    return session;
+}
+
+// A key frame, or its parameter sets, starts here: ends the fragment and tells the caller where the next one starts.
+// Returns false when the output range has been written.
+static bool SessionFragment(ConvertSession_t *session) {
+    int retval;
+    TRACE_BEGIN(trace_flush);
+    if (!session->fragment_empty) {
+        if ((retval = av_interleaved_write_frame(session->format_ctx, NULL)) < 0 ||
+            (retval = av_write_frame(session->format_ctx, NULL)) < 0) {
+            fprintf(stderr, "Error while writing output packet: %s\n", av_err2str(retval));
+            return false;
+        }
+        session->fragment_index++;
+        session->fragment_empty = true;
+    }
+    avio_flush(session->format_ctx->pb);
+    TRACE_END(trace_flush, "flush fragment", NULL);
+
+    Checkpoint_t checkpoint;
+    memset(&checkpoint, 0, sizeof(checkpoint));
+    checkpoint.info = session->info;
+    checkpoint.input_offset = ftello(session->in_file) - sizeof(session->hx_frame.header) - sizeof(HXVFFrame_t);
+    checkpoint.output_offset = session->sink.position;
+    checkpoint.fragment_index = session->fragment_index;
+    checkpoint.audio_clock_started = session->audio_clock.started;
+    checkpoint.audio_next_pts = session->audio_clock.next_pts;
+
+    ConvertStream_t *stream = session->stream;
+    long time_ms = HXElapsed(session->hx_frame.data.hxvf.timestamp, (uint32_t) session->info.video_ts_initial);
+    if (stream->on_fragment && !stream->on_fragment(stream->opaque, &checkpoint, time_ms)) {
+        session->sink.range_end = session->sink.position;
+        return false;
+    }
+    return session->sink.range_end < 0 || session->sink.position < session->sink.range_end;
+}
+
+// Reads a record header, moving to SESSION_BODY for payloads to read, or to SESSION_TRAILER at the end of the input
+static bool SessionHeader(ConvertSession_t *session) {
+    HXFrame_t *hx_frame = &session->hx_frame;
+    if (!HXReadFrame(session->in_file, hx_frame) || hx_frame->header == HXFI) {
+        session->state = SESSION_TRAILER;
+        return true;
+    }
+    CountRecordHeader(hx_frame->header, &session->lost, false);
+
+    switch (hx_frame->header) {
+        case HXVF:
+            if (session->packet_buffer_offset == 0 && hx_frame->data.hxvf.type == HXVF_TYPE_I &&
+                !SessionFragment(session)) {
+                session->state = SESSION_TRAILER;
+                return true;
+            }
+            session->state = SESSION_BODY;
+            return true;
+
+        case HXAF:
+            if (session->audio_sample_rate > 0) {
+                session->state = SESSION_BODY;
+                return true;
+            }
+            return HXSkipPayload(session->in_file, hx_frame);
+
+        case HXVS:
+        case HXVT:
+            return true;
+
+        default: // counted by CountRecordHeader
+            return true;
+    }
+}
+
+// Reads a record payload, moving to SESSION_EMIT once it completes a packet
+static bool SessionBody(ConvertSession_t *session) {
+    HXFrame_t *hx_frame = &session->hx_frame;
+    size_t length = (size_t) HXPayloadLength(hx_frame);
+    if (hx_frame->header == HXAF) {
+        if (ReadToBuffer(session->in_file, &session->audio_buffer, 0, length, &session->audio_buffer_length,
+                         session->packet_buffer_max) < length) {
+            fprintf(stderr, "Premature end of file.\n");
+            return false;
+        }
+
+        // A-law, one byte per sample
+        int64_t pts;
+        if (!AudioClockNext(&session->audio_clock, HXElapsed(hx_frame->data.hxaf.timestamp, session->audio_origin),
+                            length, &pts)) {
+            session->state = SESSION_HEADER;
+            return true;
+        }
+        session->packet.data = session->audio_buffer;
+        session->packet.size = (int) length;
+        session->packet.stream_index = 1;
+        session->packet.pts = session->packet.dts = pts;
+        session->packet.duration = (int64_t) length;
+        session->packet.flags = AV_PKT_FLAG_KEY;
+        av_packet_rescale_ts(&session->packet, (AVRational) {1, session->audio_sample_rate},
+                             session->format_ctx->streams[1]->time_base);
+        session->state = SESSION_EMIT;
+        return true;
+    }
+
+    if (ReadToBuffer(session->in_file, &session->packet_buffer, session->packet_buffer_offset, length,
+                     &session->packet_buffer_length, session->packet_buffer_max) < length) {
+        fprintf(stderr, "Premature end of file.\n");
+        return false;
+    }
+    uint8_t *nal = session->packet_buffer + session->packet_buffer_offset;
+    if (NalIsParameterSet(session->hevc, NalUnitType(session->hevc, nal, length))) {
+        session->packet_buffer_offset += length; // glued to the key frame following them
+        session->state = SESSION_HEADER;
+        return true;
+    }
+
+    session->packet.data = session->packet_buffer;
+    session->packet.size = (int) (session->packet_buffer_offset + length);
+    if (session->dedup_param_sets && session->packet_buffer_offset > 0) {
+        uint64_t hash = HashBytes(session->packet_buffer, session->packet_buffer_offset);
+        if (session->param_sets_hash_set && hash == session->param_sets_hash) {
+            session->packet.data += session->packet_buffer_offset; // same as last time, drop them
+            session->packet.size -= (int) session->packet_buffer_offset;
+        }
+        session->param_sets_hash = hash;
+        session->param_sets_hash_set = true;
+    }
+    session->packet_buffer_offset = 0;
+    if (session->length_prefixed && !NalAnnexBToLengthPrefixed(session->packet.data, session->packet.size)) {
+        size_t length_size = NAL_LENGTH_PREFIXED_SIZE((size_t) session->packet.size);
+        if (length_size > session->length_buffer_size) {
+            if (!(session->length_buffer = realloc(session->length_buffer, length_size))) {
+                return false;
+            }
+            MetricsBufferResize((long) length_size - (long) session->length_buffer_size);
+            session->length_buffer_size = length_size;
+        }
+        session->packet.size = (int) NalAnnexBToLengthPrefixedCopy(session->packet.data, session->packet.size,
+                                                                   session->length_buffer);
+        session->packet.data = session->length_buffer;
+    }
+    session->packet.flags = hx_frame->data.hxvf.type == HXVF_TYPE_I ? AV_PKT_FLAG_KEY : 0;
+    session->packet.stream_index = 0;
+    session->packet.pts = session->packet.dts = HXElapsed(hx_frame->data.hxvf.timestamp, session->video_origin);
+    session->packet.duration = 0;
+    av_packet_rescale_ts(&session->packet, (AVRational) {1, TIMEBASE_MS},
+                         session->format_ctx->streams[0]->time_base);
+    session->state = SESSION_EMIT;
+    return true;
+}
+
+static bool SessionEmit(ConvertSession_t *session) {
+    bool video = session->packet.stream_index == 0;
+    int retval = av_interleaved_write_frame(session->format_ctx, &session->packet);
+    if (retval < 0) {
+        fprintf(stderr, "Error while writing output packet: %s\n", av_err2str(retval));
+        return false;
+    }
+    if (video) {
+        METRICS_ADD(video_packets, 1);
+    } else {
+        METRICS_ADD(audio_packets, 1);
+    }
+    session->fragment_empty = false;
+    session->state = SESSION_HEADER;
+    return true;
+}
+
+static bool SessionTrailer(ConvertSession_t *session) {
+    TRACE_BEGIN(trace_trailer);
+    av_write_trailer(session->format_ctx);
+    avio_flush(session->format_ctx->pb);
+    TRACE_END(trace_trailer, "write trailer", NULL);
+    bool range_written = session->sink.range_end >= 0 && session->sink.position >= session->sink.range_end;
+    session->stream->size = range_written ? -1 : session->sink.position;
+    METRICS_ADD(bytes_in, ftello(session->in_file));
+    METRICS_ADD(bytes_out, session->sink.written);
+    session->state = SESSION_FINISHED;
+    return true;
+}
+
+bool ConvertSessionStep(ConvertSession_t *session, int records, size_t output_limit) {
+    while (session->state != SESSION_FINISHED && session->sink.data_length < output_limit) {
+        bool success = true;
+        switch (session->state) {
+            case SESSION_HEADER:
+                if (records-- == 0) {
+                    return true;
+                }
+                success = SessionHeader(session);
+                break;
+
+            case SESSION_BODY:
+                success = SessionBody(session);
+                break;
+
+            case SESSION_EMIT:
+                success = SessionEmit(session);
+                break;
+
+            case SESSION_TRAILER:
+                success = SessionTrailer(session);
+                break;
+
+            case SESSION_FINISHED:
+                break;
+        }
+        if (!success) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ConvertSessionFinished(const ConvertSession_t *session) {
+    return session->state == SESSION_FINISHED;
+}
+
+const uint8_t *ConvertSessionOutput(const ConvertSession_t *session, size_t *length) {
+    *length = session->sink.data_length;
+    return session->sink.data;
+}
+
+void ConvertSessionConsume(ConvertSession_t *session, size_t length) {
+    FdSinkConsume(&session->sink, length);
+}
+
+void ConvertSessionClose(ConvertSession_t *session) {
+    if (!session) {
+        return;
+    }
+    if (session->format_ctx) {
+        FdSinkClose(&session->format_ctx->pb);
+        avformat_free_context(session->format_ctx);
+    }
+    if (session->in_file) {
+        fclose(session->in_file);
+    }
+    free(session->sink.data);
+    free(session->packet_buffer);
+    free(session->length_buffer);
+    free(session->audio_buffer);
+    MetricsBufferResize(-(long) (session->packet_buffer_length + session->length_buffer_size +
+                                 session->audio_buffer_length));
+    free(session);
+}
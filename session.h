@@ -0,0 +1,48 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "convert.h"
+
+// The fragmented remux of options->stream, run as a state machine a few records at a time, so that a single thread can
+// drive many of them. ConvertFile runs one to the end for its streamed output, which is why the server gets the same
+// bytes and fragment tables whichever way it runs. Errors end the session rather than the process, except for packets
+// over options->memory_limit. Audio can't be transcoded, nor a growing input followed.
+typedef struct ConvertSession_t ConvertSession_t;
+
+// Starts a session with the start, range and callback of options->stream, in the format ConvertFile would write.
+// Output is written to its fd, or kept in memory until the caller takes it if fd is negative. Returns NULL on error.
+ConvertSession_t *ConvertSessionOpen(const char *in_filename, const char *out_filename,
+                                     const ConvertOptions_t *options);
+
+// Parses and muxes up to records input records, stopping early once output_limit bytes are waiting to be taken.
+// Returns false on error.
+bool ConvertSessionStep(ConvertSession_t *session, int records, size_t output_limit);
+
+// Whether the whole output has been produced, the last of it possibly still waiting to be taken
+bool ConvertSessionFinished(const ConvertSession_t *session);
+
+// Output waiting to be taken, and marking length bytes of it as taken
+const uint8_t *ConvertSessionOutput(const ConvertSession_t *session, size_t *length);
+void ConvertSessionConsume(ConvertSession_t *session, size_t length);
+
+void ConvertSessionClose(ConvertSession_t *session);
+
+#endif
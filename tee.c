@@ -0,0 +1,315 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libavutil/mathematics.h>
+#include "tee.h"
+#include "hxscan.h"
+#include "hxindex.h"
+#include "metrics.h"
+#include "nal.h"
+
+typedef struct TeeOutput_t {
+    char *filename;
+    const char *format_name;
+    AVDictionary *muxer_options;
+    AVFormatContext *format_ctx;
+    bool length_prefixed;   // MP4 like, getting the length prefixed version of video packets
+} TeeOutput_t;
+
+// Splits "[opt=value:...]file|..." into outputs, whose names point into *strings. Options are applied when opening
+// them, f= picks the format.
+static TeeOutput_t *ParseOutputs(const char *spec, int *count, char **strings) {
+    char *copy = *strings = strdup(spec);
+    TeeOutput_t *outputs = calloc(strlen(spec) / 2 + 1, sizeof(TeeOutput_t));
+    if (!copy || !outputs) {
+        fprintf(stderr, "Cannot allocate memory, aborting.\n");
+        exit(1);
+    }
+
+    *count = 0;
+    char *save_item, *save_option;
+    for (char *item = strtok_r(copy, "|", &save_item); item; item = strtok_r(NULL, "|", &save_item)) {
+        TeeOutput_t *output = &outputs[*count];
+        if (item[0] == '[') {
+            char *end = strchr(item, ']');
+            if (!end) {
+                fprintf(stderr, "Missing ']' in output %s.\n", item);
+                exit(1);
+            }
+            *end = '\0';
+            for (char *option = strtok_r(item + 1, ":", &save_option); option;
+                 option = strtok_r(NULL, ":", &save_option)) {
+                char *value = strchr(option, '=');
+                if (!value) {
+                    fprintf(stderr, "Invalid muxer option %s, expected name=value.\n", option);
+                    exit(1);
+                }
+                *value++ = '\0';
+                if (strcmp(option, "f") == 0) {
+                    output->format_name = value;
+                } else {
+                    av_dict_set(&output->muxer_options, option, value, 0);
+                }
+            }
+            item = end + 1;
+        }
+        if (!*item) {
+            fprintf(stderr, "Missing output file name in %s.\n", spec);
+            exit(1);
+        }
+        output->filename = item;
+        (*count)++;
+    }
+    if (*count == 0) {
+        fprintf(stderr, "No output given.\n");
+        exit(1);
+    }
+    return outputs;
+}
+
+// Allocates the muxer of an output, with the same streams as ConvertFile would create, and writes its header
+static void OpenOutput(TeeOutput_t *output, const HXStreamInfo_t *info, int audio_sample_rate, FILE *in_file,
+                       const ConvertOptions_t *options) {
+    int retval;
+    bool hevc = info->video_header == HXVT;
+    if ((retval = avformat_alloc_output_context2(&output->format_ctx, NULL, output->format_name,
+                                                 output->filename)) < 0) {
+        fprintf(stderr, "Could not allocate an output context for %s: %s\n", output->filename, av_err2str(retval));
+        exit(1);
+    }
+    AVFormatContext *format_ctx = output->format_ctx;
+    if (!InitAVStreams(format_ctx, info->video_w, info->video_h, hevc ? AV_CODEC_ID_H265 : AV_CODEC_ID_H264,
+                       info->video_avg_frame_rate, (long) info->video_packets_count, audio_sample_rate, NULL, NULL)) {
+        exit(1);
+    }
+
+    if (IsLengthPrefixedFormat(format_ctx->oformat)) {
+        output->length_prefixed = SetVideoExtradata(format_ctx, 0, hevc, in_file);
+        if (!output->length_prefixed && !options->quiet) {
+            fprintf(stderr, "Warning! Cannot parse video parameter sets, leaving NAL conversion to LibAV.\n");
+        }
+    }
+
+    if (!options->overwrite_existing && access(output->filename, F_OK) == 0) {
+        fprintf(stderr, "Output file %s already exists but can't overwrite it, exiting.\n", output->filename);
+        exit(0);
+    }
+    if (!(format_ctx->oformat->flags & AVFMT_NOFILE) &&
+        (retval = avio_open(&format_ctx->pb, output->filename, AVIO_FLAG_WRITE)) < 0) {
+        fprintf(stderr, "Could not open output file %s: %s\n", output->filename, av_err2str(retval));
+        exit(1);
+    }
+    if ((retval = avformat_write_header(format_ctx, &output->muxer_options)) < 0) {
+        fprintf(stderr, "Error occurred when opening output file %s: %s\n", output->filename, av_err2str(retval));
+        exit(1);
+    }
+    av_dict_free(&output->muxer_options);
+    if (!options->quiet) {
+        fprintf(stderr, "Output file %s: %s\n", output->filename, format_ctx->oformat->long_name);
+    }
+}
+
+// Hands a reference to the packet, or to its length prefixed version for MP4 like outputs, to every muxer
+static void WritePacket(TeeOutput_t *outputs, int outputs_count, const AVPacket *annexb,
+                        const AVPacket *length_prefixed, AVRational time_base) {
+    for (int i = 0; i < outputs_count; i++) {
+        AVPacket packet;
+        int retval;
+        AVFormatContext *format_ctx = outputs[i].format_ctx;
+        if ((retval = av_packet_ref(&packet, outputs[i].length_prefixed ? length_prefixed : annexb)) < 0) {
+            fprintf(stderr, "Cannot allocate memory, aborting.\n");
+            exit(1);
+        }
+        av_packet_rescale_ts(&packet, time_base, format_ctx->streams[packet.stream_index]->time_base);
+        if ((retval = av_interleaved_write_frame(format_ctx, &packet)) < 0) {
+            fprintf(stderr, "Error while writing output packet to %s: %s\n", outputs[i].filename,
+                    av_err2str(retval));
+            exit(1);
+        }
+    }
+}
+
+// Reads a payload of length bytes into a new refcounted packet, after the prefix_size bytes of prefix
+static void ReadPacket(FILE *in_file, AVPacket *packet, const uint8_t *prefix, size_t prefix_size, size_t length) {
+    if (av_new_packet(packet, (int) (prefix_size + length)) < 0) {
+        fprintf(stderr, "Cannot allocate memory, aborting.\n");
+        exit(1);
+    }
+    memcpy(packet->data, prefix, prefix_size);
+    if (fread(packet->data + prefix_size, 1, length, in_file) != length) {
+        fprintf(stderr, "Premature end of file, aborting.\n");
+        exit(1);
+    }
+}
+
+int TeeFile(const char *in_filename, const char *outputs_spec, const ConvertOptions_t *options) {
+    av_log_set_level(AV_LOG_ERROR);
+    if (options->audio_codec && strcmp(options->audio_codec, "copy") != 0) {
+        fprintf(stderr, "Multiple outputs can't transcode audio.\n");
+        exit(1);
+    }
+
+    char *strings;
+    int outputs_count;
+    TeeOutput_t *outputs = ParseOutputs(outputs_spec, &outputs_count, &strings);
+
+    FILE *in_file;
+    if (!(in_file = fopen(in_filename, "rb"))) {
+        fprintf(stderr, "Cannot open %s for reading.\n", in_filename);
+        exit(1);
+    }
+    HXStreamInfo_t info;
+    HXIndex_t index;
+    if (options->use_index && HXIndexOpen(in_filename, options->index_dir, &index)) {
+        info = index.header->info;
+        HXIndexClose(&index);
+    } else if (!HXScanStream(in_file, &info, NULL, NULL)) {
+        exit(1);
+    }
+    if (info.video_avg_frame_rate <= 0) {
+        fprintf(stderr, "No video detected, aborting.\n");
+        exit(1);
+    }
+    bool hevc = info.video_header == HXVT;
+    int audio_sample_rate = info.audio_avg_sample_rate > 0 && !options->skip_audio ?
+                            HXNominalSampleRate(info.audio_avg_sample_rate) : 0;
+
+    bool annexb_needed = false, length_prefixed_needed = false;
+    for (int i = 0; i < outputs_count; i++) {
+        OpenOutput(&outputs[i], &info, audio_sample_rate, in_file, options);
+        length_prefixed_needed |= outputs[i].length_prefixed;
+        annexb_needed |= !outputs[i].length_prefixed;
+    }
+
+    long video_origin, audio_origin;
+    ComputeOrigins(&info, audio_sample_rate, &video_origin, &audio_origin);
+    AudioClock_t audio_clock = {.sample_rate = audio_sample_rate};
+
+    // Packets are read straight into a refcounted buffer, which the muxers share instead of each copying it.
+    // Parameter sets wait in a buffer of their own to be glued to the key frame following them.
+    uint8_t *param_sets_buffer = NULL;
+    size_t param_sets_buffer_size = 0, param_sets_offset = 0;
+    long video_packets = 0, audio_packets = 0;
+    bool lost = false;
+    HXFrame_t hx_frame;
+    while (HXReadFrame(in_file, &hx_frame) && hx_frame.header != HXFI) {
+        CountRecordHeader(hx_frame.header, &lost, true);
+        size_t length = (size_t) HXPayloadLength(&hx_frame);
+        AVPacket packet, length_prefixed;
+        switch (hx_frame.header) {
+            case HXVF:
+                ReadPacket(in_file, &packet, param_sets_buffer, param_sets_offset, length);
+                if (NalIsParameterSet(hevc, NalUnitType(hevc, packet.data + param_sets_offset, length))) {
+                    if (param_sets_offset + length > param_sets_buffer_size) {
+                        param_sets_buffer_size = param_sets_offset + length;
+                        if (!(param_sets_buffer = realloc(param_sets_buffer, param_sets_buffer_size))) {
+                            fprintf(stderr, "Cannot allocate memory, aborting.\n");
+                            exit(1);
+                        }
+                    }
+                    memcpy(param_sets_buffer + param_sets_offset, packet.data + param_sets_offset, length);
+                    param_sets_offset += length;
+                    av_packet_unref(&packet);
+                    break;
+                }
+                param_sets_offset = 0;
+                packet.flags = hx_frame.data.hxvf.type == HXVF_TYPE_I ? AV_PKT_FLAG_KEY : 0;
+                packet.stream_index = 0;
+                packet.pts = packet.dts = HXElapsed(hx_frame.data.hxvf.timestamp, video_origin);
+
+                // Converted in place if no output wants Annex-B, else into a second shared buffer
+                av_init_packet(&length_prefixed);
+                bool in_place = !annexb_needed && NalAnnexBToLengthPrefixed(packet.data, (size_t) packet.size);
+                if (length_prefixed_needed && !in_place) {
+                    if (av_new_packet(&length_prefixed, (int) NAL_LENGTH_PREFIXED_SIZE((size_t) packet.size)) < 0) {
+                        fprintf(stderr, "Cannot allocate memory, aborting.\n");
+                        exit(1);
+                    }
+                    length_prefixed.size = (int) NalAnnexBToLengthPrefixedCopy(packet.data, (size_t) packet.size,
+                                                                               length_prefixed.data);
+                    length_prefixed.flags = packet.flags;
+                    length_prefixed.stream_index = packet.stream_index;
+                    length_prefixed.pts = length_prefixed.dts = packet.pts;
+                }
+                WritePacket(outputs, outputs_count, &packet, length_prefixed.buf ? &length_prefixed : &packet,
+                            (AVRational) {1, TIMEBASE_MS});
+                av_packet_unref(&length_prefixed);
+                av_packet_unref(&packet);
+                video_packets++;
+                METRICS_ADD(video_packets, 1);
+                break;
+
+            case HXAF:
+                if (audio_sample_rate <= 0) {
+                    if (!HXSkipPayload(in_file, &hx_frame)) {
+                        fprintf(stderr, "Premature end of file, aborting.\n");
+                        exit(1);
+                    }
+                    break;
+                }
+                ReadPacket(in_file, &packet, NULL, 0, length);
+
+                // A-law, one byte per sample
+                int64_t pts;
+                if (!AudioClockNext(&audio_clock, HXElapsed(hx_frame.data.hxaf.timestamp, audio_origin), length,
+                                    &pts)) {
+                    av_packet_unref(&packet);
+                    break;
+                }
+                packet.stream_index = 1;
+                packet.pts = packet.dts = pts;
+                packet.duration = (int64_t) length;
+                packet.flags = AV_PKT_FLAG_KEY;
+                WritePacket(outputs, outputs_count, &packet, &packet, (AVRational) {1, audio_sample_rate});
+                av_packet_unref(&packet);
+                audio_packets++;
+                METRICS_ADD(audio_packets, 1);
+                break;
+
+            case HXVS:
+            case HXVT:
+                break;
+
+            default: // counted and reported by CountRecordHeader, as in ConvertFile
+                break;
+        }
+    }
+    METRICS_ADD(bytes_in, ftello(in_file));
+    fclose(in_file);
+    free(param_sets_buffer);
+
+    for (int i = 0; i < outputs_count; i++) {
+        AVFormatContext *format_ctx = outputs[i].format_ctx;
+        av_write_trailer(format_ctx);
+        if (!(format_ctx->oformat->flags & AVFMT_NOFILE)) {
+            METRICS_ADD(bytes_out, avio_tell(format_ctx->pb));
+            avio_closep(&format_ctx->pb);
+        }
+        avformat_free_context(format_ctx);
+    }
+    free(outputs);
+    free(strings);
+
+    if (!options->quiet) {
+        fprintf(stderr, "Done! Wrote %ld video packets and %ld audio packets to %d outputs.\n", video_packets,
+                audio_packets, outputs_count);
+    }
+    return 0;
+}
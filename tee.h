@@ -0,0 +1,28 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef TEE_H
+#define TEE_H
+
+#include "convert.h"
+
+// Remuxes in_filename to several outputs at once, reading and parsing it a single time. outputs lists them separated
+// by '|', each optionally preceded by its muxer options in brackets, separated by ':', with f=format overriding the
+// format guessed from the extension: "[f=mp4:movflags=+faststart]web.mp4|archive.mkv". Every packet is shared by all
+// the outputs, which only add references to it. Errors are fatal, like in ConvertFile.
+int TeeFile(const char *in_filename, const char *outputs, const ConvertOptions_t *options);
+
+#endif
@@ -0,0 +1,219 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "timeline.h"
+#include "hxscan.h"
+
+#define TIMELINE_MAX_SECONDS    (24 * 3600) // ignore timestamps jumping further than this from the first one
+
+typedef struct TimelineSecond_t {
+    unsigned long video_bytes;
+    unsigned long video_frames;
+    unsigned long p_bytes;
+    unsigned long p_frames;
+    unsigned long p_max;
+    unsigned long key_frames;
+    unsigned long key_interval; // ms between the last two key frames seen up to this second
+    unsigned long audio_packets;
+} TimelineSecond_t;
+
+void WriteJsonString(FILE *out, const char *str) {
+    fputc('"', out);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            fprintf(out, "\\%c", *str);
+        } else if ((unsigned char) *str < 0x20) {
+            fprintf(out, "\\u%04x", *str);
+        } else {
+            fputc(*str, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static TimelineSecond_t *GetSecond(TimelineSecond_t **seconds, long *seconds_count, long *seconds_size, long second) {
+    if (second < 0 || second >= TIMELINE_MAX_SECONDS) {
+        return NULL;
+    }
+
+    if (second >= *seconds_size) {
+        long size = *seconds_size ? *seconds_size : 64;
+        while (size <= second) {
+            size *= 2;
+        }
+        *seconds = realloc(*seconds, size * sizeof(TimelineSecond_t));
+        if (*seconds == NULL) {
+            fprintf(stderr, "Cannot allocate memory, aborting.\n");
+            exit(1);
+        }
+        memset(*seconds + *seconds_size, 0, (size - *seconds_size) * sizeof(TimelineSecond_t));
+        *seconds_size = size;
+    }
+
+    if (second >= *seconds_count) {
+        *seconds_count = second + 1;
+    }
+    return *seconds + second;
+}
+
+static int CompareULong(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *) a, y = *(const unsigned long *) b;
+    return (x > y) - (x < y);
+}
+
+bool WriteTimeline(FILE *in_file, const char *in_filename, FILE *out_file) {
+    HXFrame_t hx_frame;
+    const char *codec = NULL;
+    int video_w = 0, video_h = 0;
+    bool video_ts_set = false, audio_ts_set = false, key_ts_set = false;
+    uint32_t video_ts_initial = 0, audio_ts_initial = 0, key_ts_prev = 0;
+    unsigned long key_interval = 0;
+    TimelineSecond_t *seconds = NULL;
+    long seconds_count = 0, seconds_size = 0;
+    bool hxfi_detected = false;
+
+    while (!hxfi_detected && HXReadFrame(in_file, &hx_frame)) {
+        TimelineSecond_t *second;
+
+        switch (hx_frame.header) {
+            case HXVS:
+                codec = "h264";
+                video_w = (int) hx_frame.data.hxvs.width;
+                video_h = (int) hx_frame.data.hxvs.height;
+                break;
+
+            case HXVT:
+                codec = "h265";
+                video_w = (int) hx_frame.data.hxvt.width;
+                video_h = (int) hx_frame.data.hxvt.height;
+                break;
+
+            case HXVF:
+                if (!video_ts_set) {
+                    video_ts_initial = hx_frame.data.hxvf.timestamp;
+                    video_ts_set = true;
+                }
+
+                second = GetSecond(&seconds, &seconds_count, &seconds_size,
+                                   HXElapsed(hx_frame.data.hxvf.timestamp, video_ts_initial) / 1000);
+                if (second) {
+                    second->video_bytes += hx_frame.data.hxvf.length;
+                    if (hx_frame.data.hxvf.type == HXVF_TYPE_P) {
+                        second->video_frames++;
+                        second->p_frames++;
+                        second->p_bytes += hx_frame.data.hxvf.length;
+                        if (hx_frame.data.hxvf.length > second->p_max) {
+                            second->p_max = hx_frame.data.hxvf.length;
+                        }
+                    } else if (!key_ts_set || hx_frame.data.hxvf.timestamp != key_ts_prev) {
+                        // Parameter sets and the key frame following them share the same timestamp
+                        if (key_ts_set) {
+                            key_interval = HXElapsed(hx_frame.data.hxvf.timestamp, key_ts_prev);
+                        }
+                        key_ts_prev = hx_frame.data.hxvf.timestamp;
+                        key_ts_set = true;
+                        second->video_frames++;
+                        second->key_frames++;
+                    }
+                    second->key_interval = key_interval;
+                }
+
+                if (!HXSkipPayload(in_file, &hx_frame)) {
+                    fprintf(stderr, "Seek error, aborting.\n");
+                    free(seconds);
+                    return false;
+                }
+                break;
+
+            case HXAF:
+                // Audio timestamps may come from a different clock than video ones, so they have their own origin
+                if (!audio_ts_set) {
+                    audio_ts_initial = hx_frame.data.hxaf.timestamp;
+                    audio_ts_set = true;
+                }
+
+                second = GetSecond(&seconds, &seconds_count, &seconds_size,
+                                   HXElapsed(hx_frame.data.hxaf.timestamp, audio_ts_initial) / 1000);
+                if (second) {
+                    second->audio_packets++;
+                }
+
+                if (!HXSkipPayload(in_file, &hx_frame)) {
+                    fprintf(stderr, "Seek error, aborting.\n");
+                    free(seconds);
+                    return false;
+                }
+                break;
+
+            case HXFI:
+                hxfi_detected = true;
+                break;
+
+            default:
+                fprintf(stderr, "Unknown audio_frame header: %u.\n", hx_frame.header);
+                break;
+        }
+    }
+
+    if (!codec || !video_ts_set) {
+        fprintf(stderr, "No video detected in %s.\n", in_filename);
+        free(seconds);
+        return false;
+    }
+
+    // Clip-wide P-frame size statistics, useful to rank clips by activity
+    unsigned long *p_avgs = malloc((seconds_count ? seconds_count : 1) * sizeof(unsigned long));
+    if (p_avgs == NULL) {
+        fprintf(stderr, "Cannot allocate memory, aborting.\n");
+        exit(1);
+    }
+    long p_avgs_count = 0;
+    unsigned long p_peak = 0;
+    for (long i = 0; i < seconds_count; i++) {
+        if (seconds[i].p_frames) {
+            p_avgs[p_avgs_count++] = seconds[i].p_bytes / seconds[i].p_frames;
+        }
+        if (seconds[i].p_max > p_peak) {
+            p_peak = seconds[i].p_max;
+        }
+    }
+    unsigned long p_median = 0;
+    if (p_avgs_count) {
+        qsort(p_avgs, p_avgs_count, sizeof(unsigned long), CompareULong);
+        p_median = p_avgs[p_avgs_count / 2];
+    }
+
+    fprintf(out_file, "{\"file\":");
+    WriteJsonString(out_file, in_filename);
+    fprintf(out_file, ",\"codec\":\"%s\",\"width\":%d,\"height\":%d,\"seconds\":%ld,"
+                      "\"p_median\":%lu,\"p_peak_avg\":%lu,\"p_peak\":%lu,"
+                      "\"fields\":[\"video_kbps\",\"frames\",\"p_avg\",\"p_max\",\"keys\",\"key_interval_ms\","
+                      "\"audio_packets\"],\"timeline\":[",
+            codec, video_w, video_h, seconds_count, p_median, p_avgs_count ? p_avgs[p_avgs_count - 1] : 0, p_peak);
+    for (long i = 0; i < seconds_count; i++) {
+        TimelineSecond_t *s = &seconds[i];
+        fprintf(out_file, "%s[%lu,%lu,%lu,%lu,%lu,%lu,%lu]", i ? "," : "", s->video_bytes * 8 / 1000,
+                s->video_frames, s->p_frames ? s->p_bytes / s->p_frames : 0, s->p_max, s->key_frames,
+                s->key_interval, s->audio_packets);
+    }
+    fprintf(out_file, "]}\n");
+
+    free(p_avgs);
+    free(seconds);
+    return true;
+}
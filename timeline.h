@@ -0,0 +1,30 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+// Scans record headers only, skipping every payload, and writes a per-second activity timeline of the input as
+// a single line of JSON: video bitrate, frame count, P-frame sizes, key frames and audio presence.
+bool WriteTimeline(FILE *in_file, const char *in_filename, FILE *out_file);
+
+// Writes str as a quoted JSON string, escaping quotes, backslashes and control characters
+void WriteJsonString(FILE *out, const char *str);
+
+#endif
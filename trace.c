@@ -0,0 +1,97 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "trace.h"
+
+#define TRACE_EVENT_SIZE    1024
+
+int trace_fd = -1;
+static int trace_pid;   // the main process, so that all tracks are shown together
+static int trace_track;
+
+static void TraceWrite(const char *event, int length) {
+    if (length >= TRACE_EVENT_SIZE) {
+        length = TRACE_EVENT_SIZE - 1;
+    }
+    while (write(trace_fd, event, (size_t) length) < 0 && errno == EINTR) {
+    }
+}
+
+// JSON string contents of text, truncated to fit size
+static void TraceEscape(char *escaped, size_t size, const char *text) {
+    size_t length = 0;
+    for (const unsigned char *c = (const unsigned char *) text; *c && length + 7 < size; c++) {
+        if (*c == '"' || *c == '\\') {
+            escaped[length++] = '\\';
+            escaped[length++] = (char) *c;
+        } else if (*c < 0x20) {
+            length += snprintf(escaped + length, size - length, "\\u%04x", *c);
+        } else {
+            escaped[length++] = (char) *c;
+        }
+    }
+    escaped[length] = '\0';
+}
+
+bool TraceStart(const char *filename) {
+    if ((trace_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) < 0) {
+        fprintf(stderr, "Cannot create trace file %s: %s\n", filename, strerror(errno));
+        return false;
+    }
+    trace_pid = (int) getpid();
+    TraceWrite("[\n", 2);
+    TraceTrack(0, "main");
+    return true;
+}
+
+void TraceTrack(int track, const char *name) {
+    char event[TRACE_EVENT_SIZE], label[64];
+    trace_track = track;
+    if (track) {
+        snprintf(label, sizeof(label), "%s %d", name, track);
+    } else {
+        snprintf(label, sizeof(label), "%s", name);
+    }
+    int length = snprintf(event, sizeof(event), "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,"
+                                                "\"args\":{\"name\":\"%s\"}},\n", trace_pid, track, label);
+    TraceWrite(event, length);
+}
+
+int64_t TraceNow(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void TraceSpan(int64_t start, const char *name, const char *detail) {
+    char event[TRACE_EVENT_SIZE], escaped[TRACE_EVENT_SIZE / 2];
+    int64_t end = TraceNow();
+    int length = snprintf(event, sizeof(event), "{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%lld,"
+                                                "\"dur\":%lld", name, trace_pid, trace_track, (long long) start,
+                          (long long) (end - start));
+    if (detail) {
+        TraceEscape(escaped, sizeof(escaped), detail);
+        length += snprintf(event + length, sizeof(event) - length, ",\"args\":{\"detail\":\"%s\"}", escaped);
+    }
+    length += snprintf(event + length, sizeof(event) - length, "},\n");
+    TraceWrite(event, length);
+}
@@ -0,0 +1,47 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TRACE_PACKET_SAMPLE 64  // one packet in this many gets spans of its own
+
+// Descriptor of the trace file, -1 unless tracing. Events are complete JSON objects appended with a single write each,
+// so that the worker processes of batch conversions can share the file.
+extern int trace_fd;
+
+#define TRACE_BEGIN(start) int64_t start = trace_fd >= 0 ? TraceNow() : 0
+#define TRACE_END(start, name, detail) do { \
+    if (trace_fd >= 0) TraceSpan(start, name, detail); \
+} while (0)
+
+// Creates filename as a Chrome trace event file, which Perfetto and chrome://tracing load, the array of events being
+// left open so that processes can keep appending to it
+bool TraceStart(const char *filename);
+
+// Events of this process go to track, a thread of the trace, named name followed by the track number if not 0
+void TraceTrack(int track, const char *name);
+
+// Monotonic clock in microseconds, which is the same for all processes
+int64_t TraceNow(void);
+
+// Records a span from start to now, with detail, a file name for instance, as its argument if not NULL
+void TraceSpan(int64_t start, const char *name, const char *detail);
+
+#endif
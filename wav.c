@@ -0,0 +1,182 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <endian.h>
+#include "wav.h"
+#include "hxscan.h"
+#include "alaw.h"
+
+#define WAV_READ_BUFFER     1024    // a few audio records, small enough not to read much of the video around them
+#define WAV_DEFAULT_RATE    8000
+#define WAV_FORMAT_PCM      1
+#define WAV_FORMAT_ALAW     6
+#define WAV_UNKNOWN_SIZE    0xffffffff  // what streaming writers put in the header, as sizes are known only at the end
+
+static uint8_t *PutLE16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t) v;
+    p[1] = (uint8_t) (v >> 8);
+    return p + 2;
+}
+
+static uint8_t *PutLE32(uint8_t *p, uint32_t v) {
+    p = PutLE16(p, (uint16_t) v);
+    return PutLE16(p, (uint16_t) (v >> 16));
+}
+
+// Non-PCM formats have an extended fmt chunk and a fact chunk holding the number of samples
+static bool WriteWavHeader(FILE *out_file, bool decode, int sample_rate, uint32_t samples) {
+    uint8_t header[58], *p = header;
+    uint16_t sample_size = decode ? 2 : 1;
+    uint32_t data_size = samples == WAV_UNKNOWN_SIZE ? WAV_UNKNOWN_SIZE : samples * sample_size;
+    uint32_t fmt_size = decode ? 16 : 18;
+    uint32_t header_size = decode ? 44 : 58;
+
+    memcpy(p, "RIFF", 4);
+    p = PutLE32(p + 4, data_size == WAV_UNKNOWN_SIZE ? WAV_UNKNOWN_SIZE : header_size - 8 + data_size);
+    memcpy(p, "WAVEfmt ", 8);
+    p = PutLE32(p + 8, fmt_size);
+    p = PutLE16(p, decode ? WAV_FORMAT_PCM : WAV_FORMAT_ALAW);
+    p = PutLE16(p, 1); // mono
+    p = PutLE32(p, (uint32_t) sample_rate);
+    p = PutLE32(p, (uint32_t) sample_rate * sample_size);
+    p = PutLE16(p, sample_size);
+    p = PutLE16(p, sample_size * 8);
+    if (!decode) {
+        p = PutLE16(p, 0);
+        memcpy(p, "fact", 4);
+        p = PutLE32(p + 4, 4);
+        p = PutLE32(p, samples);
+    }
+    memcpy(p, "data", 4);
+    PutLE32(p + 4, data_size);
+
+    return fwrite(header, 1, header_size, out_file) == header_size;
+}
+
+bool WriteWav(FILE *in_file, const char *in_filename, FILE *out_file, bool decode) {
+    HXFrame_t hx_frame;
+    uint8_t *alaw = NULL;
+    int16_t *pcm = NULL;
+    size_t buffer_size = 0;
+    uint32_t samples = 0, last_length = 0;
+    uint32_t audio_ts_initial = 0, audio_ts_last = 0;
+    bool audio_ts_set = false;
+    bool hxfi_detected = false;
+    bool success = true;
+
+    // Audio records are small and scattered among large video ones: a small buffer avoids reading what follows them
+    setvbuf(in_file, NULL, _IOFBF, WAV_READ_BUFFER);
+
+    if (!WriteWavHeader(out_file, decode, WAV_DEFAULT_RATE, WAV_UNKNOWN_SIZE)) {
+        fprintf(stderr, "Cannot write output file.\n");
+        return false;
+    }
+
+    while (success && !hxfi_detected && HXReadFrame(in_file, &hx_frame)) {
+        switch (hx_frame.header) {
+            case HXVS:
+            case HXVT:
+                break;
+
+            case HXVF:
+                if (!HXSkipPayload(in_file, &hx_frame)) {
+                    fprintf(stderr, "Seek error, aborting.\n");
+                    success = false;
+                }
+                break;
+
+            case HXAF: {
+                size_t length = (size_t) HXPayloadLength(&hx_frame);
+                if (length > buffer_size) {
+                    buffer_size = length;
+                    alaw = realloc(alaw, buffer_size);
+                    pcm = realloc(pcm, buffer_size * sizeof(int16_t));
+                    if (alaw == NULL || pcm == NULL) {
+                        fprintf(stderr, "Cannot allocate memory, aborting.\n");
+                        exit(1);
+                    }
+                }
+                if (fread(alaw, 1, length, in_file) != length) {
+                    fprintf(stderr, "Premature end of file, aborting.\n");
+                    success = false;
+                    break;
+                }
+
+                size_t written;
+                if (decode) {
+                    AlawDecode(alaw, pcm, length);
+                    for (size_t i = 0; i < length; i++) { // WAV samples are little-endian whatever the host
+                        pcm[i] = (int16_t) htole16((uint16_t) pcm[i]);
+                    }
+                    written = fwrite(pcm, sizeof(int16_t), length, out_file);
+                } else {
+                    written = fwrite(alaw, 1, length, out_file);
+                }
+                if (written != length) {
+                    fprintf(stderr, "Cannot write output file.\n");
+                    success = false;
+                    break;
+                }
+
+                if (!audio_ts_set) {
+                    audio_ts_initial = hx_frame.data.hxaf.timestamp;
+                    audio_ts_set = true;
+                }
+                audio_ts_last = hx_frame.data.hxaf.timestamp;
+                last_length = (uint32_t) length;
+                samples += (uint32_t) length;
+                break;
+            }
+
+            case HXFI:
+                hxfi_detected = true;
+                break;
+
+            default:
+                fprintf(stderr, "Unknown audio_frame header: %u.\n", hx_frame.header);
+                break;
+        }
+    }
+    free(alaw);
+    free(pcm);
+
+    if (!success) {
+        return false;
+    }
+    if (!audio_ts_set) {
+        fprintf(stderr, "No audio detected in %s.\n", in_filename);
+        return false;
+    }
+
+    // The last packet is still playing at its timestamp, so it doesn't count towards the rate
+    long elapsed = HXElapsed(audio_ts_last, audio_ts_initial);
+    int sample_rate = elapsed > 0 ? HXNominalSampleRate((double) (samples - last_length) / (double) elapsed) :
+                      WAV_DEFAULT_RATE;
+
+    if (fseek(out_file, 0, SEEK_SET) == 0) {
+        if (!WriteWavHeader(out_file, decode, sample_rate, samples)) {
+            fprintf(stderr, "Cannot write output file.\n");
+            return false;
+        }
+    } else if (sample_rate != WAV_DEFAULT_RATE) {
+        fprintf(stderr, "Warning! Audio is sampled at %d Hz but output can't seek, header says %d Hz.\n",
+                sample_rate, WAV_DEFAULT_RATE);
+    }
+    return true;
+}
@@ -0,0 +1,28 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef WAV_H
+#define WAV_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+// Writes the audio track of the input as a WAV file, either as it is (a-law) or decoded to 16 bit PCM. Only audio
+// records are read, video payloads are skipped with seeks. in_file must not have been read from yet, as its buffer is
+// resized. If out_file can't seek, the header is left with unknown sizes and 8000 Hz.
+bool WriteWav(FILE *in_file, const char *in_filename, FILE *out_file, bool decode);
+
+#endif
@@ -0,0 +1,38 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "workers.h"
+
+void RunWorkers(int jobs, void *(*worker)(void *), void *arg) {
+    pthread_t *threads = calloc(jobs > 1 ? jobs - 1 : 1, sizeof(pthread_t));
+    if (threads == NULL) {
+        fprintf(stderr, "Cannot allocate memory, aborting.\n");
+        exit(1);
+    }
+
+    int started = 0;
+    while (started < jobs - 1 && pthread_create(&threads[started], NULL, worker, arg) == 0) {
+        started++;
+    }
+    worker(arg);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
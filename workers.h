@@ -0,0 +1,24 @@
+// Copyright (C) 2024 Francesco Vannini
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef WORKERS_H
+#define WORKERS_H
+
+// Runs worker(arg) on jobs threads, the calling one included, and returns when all of them have. Workers share arg
+// and take their work items from it. Fewer threads are used if some can't be started.
+void RunWorkers(int jobs, void *(*worker)(void *), void *arg);
+
+#endif